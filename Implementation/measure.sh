@@ -2,19 +2,39 @@
 if [[ $# -lt 2 ]]
 then
   printf "Usage:\n"
-  printf "\t%s <iterations> <input_file>\n" $0
+  printf "\t%s <iterations> <input_file>...\n" $0
+  printf "Writes the results of scale1 to scale4 at factors 2, 5, 8, 11 and 16\n"
+  printf "to img<name>-B<iterations>.csv, see --bench in %s --help.\n" "${MAIN:-./main-bench}"
+  printf "Environment: MAIN (binary), FORMAT (csv or json), CPU (CPU to pin to),\n"
+  printf "\tCOUNTERS (set to add hardware counters, see --counters)\n"
   exit
 fi
 
-in_file="$(basename $2 .ppm)"
-csv_file="img$in_file-B$1"
-printf "scale1,scale2,scale3,scale4,factor\n" > "$csv_file"
-for i in 2 5 8 11 16
+# Time the optimized build (make bench), not the ASan one
+main="${MAIN:-./main-bench}"
+if [[ ! -x "$main" ]]
+then
+  printf "%s not found, run make bench first\n" "$main"
+  exit 1
+fi
+
+format="${FORMAT:-csv}"
+pin=()
+if [[ -n "$CPU" ]]
+then
+  pin=(--cpu "$CPU")
+fi
+counters=()
+if [[ -n "$COUNTERS" ]]
+then
+  counters=(--counters)
+fi
+
+iterations=$1
+shift
+for img in "$@"
 do
-  for j in {1..4}
-  do
-    timing=$(./main -V$j -B$1 -f$i $2 -o /dev/null | cut -d ' ' -f2)
-    printf "%s," "${timing::-1}" >> "$csv_file"
-  done
-  printf "%d\n" $i >> "$csv_file"
+  out_file="img$(basename "$img" .ppm)-B$iterations.$format"
+  "$main" --bench -V1,2,3,4 -f2,5,8,11,16 -B"$iterations" --warmup 3 \
+    --format "$format" "${pin[@]}" "${counters[@]}" -o "$out_file" "$img" || exit 1
 done
@@ -0,0 +1,442 @@
+// getline(), strdup(), flockfile() and pthreads are POSIX, not C17; see
+// man feature_test_macros(7)
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "file_parsing.h"
+#include "scale.h"
+#include "util.h"
+
+char **batch_inputs(char *const *args, size_t n_args, const char *manifest,
+                    size_t *n) {
+  size_t cap = n_args > 16 ? n_args : 16;
+  char **names = malloc(cap * sizeof(char *));
+  FILE *fp = NULL;
+  char *line = NULL;
+  size_t line_size = 0;
+  *n = 0;
+  if (!names)
+    goto malloc_error;
+
+  for (size_t i = 0; i < n_args; i++) {
+    names[*n] = strdup(args[i]);
+    if (!names[*n])
+      goto malloc_error;
+    ++*n;
+  }
+
+  if (!manifest)
+    return names;
+
+  if (!strcmp(manifest, "-")) {
+    fp = stdin;
+  } else {
+    fp = fopen(manifest, "r");
+    if (!fp) {
+      perror("Error opening manifest");
+      goto cleanup;
+    }
+  }
+
+  errno = 0;
+  for (ssize_t len; (len = getline(&line, &line_size, fp)) != -1;) {
+    // Strip the line ending, including DOS ones
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = 0;
+    if (len == 0)
+      continue;
+
+    if (*n == cap) {
+      char **grown = realloc(names, 2 * cap * sizeof(char *));
+      if (!grown)
+        goto malloc_error;
+      names = grown;
+      cap *= 2;
+    }
+    names[*n] = strdup(line);
+    if (!names[*n])
+      goto malloc_error;
+    ++*n;
+  }
+  if (errno == ENOMEM)
+    goto malloc_error;
+  if (ferror(fp)) {
+    perror("Error reading manifest");
+    goto cleanup;
+  }
+
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+  return names;
+
+malloc_error:
+  fprintf(stderr, "Error allocating memory.\n");
+cleanup:
+  free(line);
+  if (fp && fp != stdin)
+    fclose(fp);
+  if (names)
+    batch_inputs_free(names, *n);
+  return NULL;
+}
+
+void batch_inputs_free(char **names, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    free(names[i]);
+  free(names);
+}
+
+char *batch_out_name(const char *out_template, const char *name_in) {
+  const char *base = strrchr(name_in, '/');
+  base = base ? base + 1 : name_in;
+
+  if (!strstr(out_template, "%s")) {
+    // A directory
+    size_t dir_len = strlen(out_template);
+    bool slash = dir_len > 0 && out_template[dir_len - 1] == '/';
+    char *name = malloc(dir_len + 1 + strlen(base) + 1);
+    if (name)
+      sprintf(name, slash ? "%s%s" : "%s/%s", out_template, base);
+    return name;
+  }
+
+  size_t base_len = strlen(base);
+  if (base_len > 4 && !strcmp(base + base_len - 4, ".ppm"))
+    base_len -= 4;
+
+  // Every "%s" (2 characters) becomes base_len characters
+  size_t len = 0;
+  for (const char *p = out_template; *p;) {
+    if (p[0] == '%' && p[1] == 's') {
+      len += base_len;
+      p += 2;
+    } else {
+      len++;
+      p++;
+    }
+  }
+
+  char *name = malloc(len + 1);
+  if (!name)
+    return NULL;
+  char *dest = name;
+  for (const char *p = out_template; *p;) {
+    if (p[0] == '%' && p[1] == 's') {
+      memcpy(dest, base, base_len);
+      dest += base_len;
+      p += 2;
+    } else {
+      *dest++ = *p++;
+    }
+  }
+  *dest = 0;
+  return name;
+}
+
+// State shared by the workers of a batch. Jobs are taken from names in order,
+// next is the index of the next job nobody has taken yet. names_out holds the
+// output file name of each job, NULL for jobs batch_check() rejected.
+struct batch_st {
+  char *const *names;
+  char **names_out;
+  size_t n;
+  size_t scale_factor;
+  size_t version;
+
+  pthread_mutex_t lock;
+  size_t next;
+  size_t failed;
+};
+
+// Buffers a worker keeps from one file to the next
+struct worker_bufs_st {
+  uint8_t *in;
+  size_t in_size;
+  uint8_t *out;
+  size_t out_size;
+};
+
+// Prints an error message for the file name. Workers print concurrently, so
+// lock stderr to keep both parts of the message together.
+static void batch_error(const char *name, const char *msg) {
+  flockfile(stderr);
+  fprintf(stderr, "%s: %s\n", name, msg);
+  funlockfile(stderr);
+}
+
+// An output file name and the job it belongs to, to find duplicates
+struct out_job_st {
+  char *name;
+  size_t job;
+};
+
+// Orders by name, then by job
+static int cmp_out_job(const void *a, const void *b) {
+  const struct out_job_st *x = a, *y = b;
+  const int res = strcmp(x->name, y->name);
+  if (res)
+    return res;
+  return x->job < y->job ? -1 : x->job > y->job;
+}
+
+// Identifies a file independently of the name it was reached by
+struct file_id_st {
+  dev_t dev;
+  ino_t ino;
+};
+
+static int cmp_file_id(const void *a, const void *b) {
+  const struct file_id_st *x = a, *y = b;
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+// Makes the output file names of all jobs, and rejects (frees and sets to
+// NULL, after printing an error message) those of jobs that would
+//   - write the same output file as an earlier job, which would leave either
+//     one's output or a mix of both, or
+//   - write to a file that is an input of the batch, possibly their own, which
+//     would be truncated while it's being read (a mapped one even crashes).
+// Return value:
+//   0 if successful
+//   1 if allocating memory failed, after printing an error message
+static int batch_check(struct batch_st *b, const char *out_template) {
+  const size_t n = b->n ? b->n : 1;
+  struct out_job_st *outs = malloc(n * sizeof(struct out_job_st));
+  struct file_id_st *inputs = malloc(n * sizeof(struct file_id_st));
+  int ret = 1;
+  if (!outs || !inputs)
+    goto cleanup;
+
+  for (size_t i = 0; i < b->n; i++) {
+    b->names_out[i] = batch_out_name(out_template, b->names[i]);
+    if (!b->names_out[i])
+      goto cleanup;
+    outs[i] = (struct out_job_st){b->names_out[i], i};
+  }
+
+  // The first job of a run of equal names keeps it
+  qsort(outs, b->n, sizeof(struct out_job_st), cmp_out_job);
+  for (size_t i = 1, first = 0; i < b->n; i++) {
+    if (strcmp(outs[i].name, outs[first].name)) {
+      first = i;
+      continue;
+    }
+    flockfile(stderr);
+    fprintf(stderr, "%s: Output file %s is also the output of %s, skipping.\n",
+            b->names[outs[i].job], outs[i].name, b->names[outs[first].job]);
+    funlockfile(stderr);
+    b->names_out[outs[i].job] = NULL;
+  }
+  for (size_t i = 0; i < b->n; i++) {
+    if (!b->names_out[outs[i].job])
+      free(outs[i].name);
+  }
+
+  // Inputs that can't be found fail by themselves later on
+  size_t n_inputs = 0;
+  struct stat st;
+  for (size_t i = 0; i < b->n; i++) {
+    if (!stat(b->names[i], &st))
+      inputs[n_inputs++] = (struct file_id_st){st.st_dev, st.st_ino};
+  }
+  qsort(inputs, n_inputs, sizeof(struct file_id_st), cmp_file_id);
+  for (size_t i = 0; i < b->n; i++) {
+    if (!b->names_out[i] || stat(b->names_out[i], &st))
+      continue;
+    const struct file_id_st id = {st.st_dev, st.st_ino};
+    if (bsearch(&id, inputs, n_inputs, sizeof(struct file_id_st),
+                cmp_file_id)) {
+      batch_error(b->names[i], "Output file is an input of the batch, "
+                               "skipping.");
+      free(b->names_out[i]);
+      b->names_out[i] = NULL;
+    }
+  }
+  ret = 0;
+
+cleanup:
+  if (ret)
+    fprintf(stderr, "Error allocating memory.\n");
+  free(outs);
+  free(inputs);
+  return ret;
+}
+
+// Scales a single file of the batch
+// Return value:
+//   0 if successful
+//   1 otherwise, after printing an error message
+static int batch_one(const struct batch_st *b, const char *name_in,
+                     const char *name_out, struct worker_bufs_st *bufs) {
+  FILE *infile = NULL;
+  FILE *outfile = NULL;
+  struct img_st inimg = {0, 0, NULL, NULL, 0, 0, 0};
+  int ret = 1;
+
+  infile = fopen(name_in, "r");
+  if (!infile) {
+    batch_error(name_in, strerror(errno));
+    goto cleanup;
+  }
+  enum parse_err res =
+      parse_file_reuse(infile, &inimg, &bufs->in, &bufs->in_size);
+  if (res != PARSE_OK) {
+    flockfile(stderr);
+    fprintf(stderr, "%s: ", name_in);
+    report_parse_err(infile, res);
+    funlockfile(stderr);
+    goto cleanup;
+  }
+  fclose(infile);
+  infile = NULL;
+
+  // The same implementation, or the same refusal, as for a single file.
+  // Refuse before opening the output, so that no empty file is left behind.
+  const size_t sf = b->scale_factor;
+  const size_t ss = img_sample_size(&inimg);
+  const size_t version =
+      b->version ? b->version
+                 : pick_version(sf, inimg.width, inimg.channels, ss);
+  if (inimg.width * inimg.height * sf != 0 &&
+      !scale_usable(version, sf, inimg.width, inimg.channels, ss)) {
+    flockfile(stderr);
+    fprintf(stderr, "%s: ", name_in);
+    report_unusable(version, sf, inimg.channels, ss);
+    funlockfile(stderr);
+    goto cleanup;
+  }
+
+  outfile = fopen(name_out, "w");
+  if (!outfile) {
+    batch_error(name_out, strerror(errno));
+    goto cleanup;
+  }
+
+  uint8_t *scaled_img = NULL;
+  if (inimg.width * inimg.height * sf != 0) {
+    errno = 0;
+    size_t size_out =
+        output_imgsize(inimg.width, inimg.height, sf, inimg.channels * ss);
+    if (errno == ERANGE) {
+      batch_error(name_in, "Error allocating memory.");
+      goto cleanup;
+    }
+    if (size_out > bufs->out_size) {
+      uint8_t *grown = realloc(bufs->out, size_out);
+      if (!grown) {
+        batch_error(name_in, "Error allocating memory.");
+        goto cleanup;
+      }
+      bufs->out = grown;
+      bufs->out_size = size_out;
+    }
+    scaled_img = bufs->out;
+
+    void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+                size_t) = scale_band_fun(version, inimg.channels, ss);
+    errno = 0;
+    fun(inimg.img, inimg.width, inimg.height, sf, scaled_img, 0,
+        inimg.height);
+    if (errno == ENOMEM) {
+      batch_error(name_in, "Error allocating memory.");
+      goto cleanup;
+    }
+  }
+
+  if (write_img(outfile, inimg.width * sf, inimg.height * sf, inimg.channels,
+                inimg.maxval, scaled_img)) {
+    batch_error(name_out, "Error writing to output file.");
+    goto cleanup;
+  }
+  ret = 0;
+
+cleanup:
+  // A raster in bufs->in stays there for the next file
+  if (inimg.map)
+    free_img(&inimg);
+  if (infile)
+    fclose(infile);
+  if (outfile && fclose(outfile) && !ret) {
+    batch_error(name_out, "Error writing to output file.");
+    ret = 1;
+  }
+  return ret;
+}
+
+static void *batch_worker(void *arg) {
+  struct batch_st *b = arg;
+  struct worker_bufs_st bufs = {NULL, 0, NULL, 0};
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    size_t job = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (job >= b->n)
+      break;
+
+    if (!b->names_out[job] ||
+        batch_one(b, b->names[job], b->names_out[job], &bufs)) {
+      pthread_mutex_lock(&b->lock);
+      b->failed++;
+      pthread_mutex_unlock(&b->lock);
+    }
+  }
+
+  free(bufs.in);
+  free(bufs.out);
+  return NULL;
+}
+
+size_t scale_batch(char *const *names, size_t n, const char *out_template,
+                   size_t scale_factor, size_t version, size_t threads) {
+  struct batch_st b = {names,   NULL, n, scale_factor,
+                       version, PTHREAD_MUTEX_INITIALIZER, 0, 0};
+  b.names_out = calloc(n ? n : 1, sizeof(char *));
+  if (!b.names_out || batch_check(&b, out_template)) {
+    if (b.names_out)
+      batch_inputs_free(b.names_out, n);
+    else
+      fprintf(stderr, "Error allocating memory.\n");
+    return n;
+  }
+  if (threads > n)
+    threads = n;
+  if (threads <= 1) {
+    batch_worker(&b);
+    batch_inputs_free(b.names_out, n);
+    return b.failed;
+  }
+
+  // Like in scale_parallel_rows(), the calling thread is one of the workers,
+  // and if a thread can't be created, the others take over its share.
+  pthread_t *tids = malloc((threads - 1) * sizeof(pthread_t));
+  bool *started = calloc(threads - 1, sizeof(bool));
+  if (tids && started) {
+    for (size_t i = 0; i < threads - 1; i++)
+      started[i] = !pthread_create(&tids[i], NULL, batch_worker, &b);
+  }
+  batch_worker(&b);
+  if (tids && started) {
+    for (size_t i = 0; i < threads - 1; i++) {
+      if (started[i])
+        pthread_join(tids[i], NULL);
+    }
+  }
+
+  free(tids);
+  free(started);
+  batch_inputs_free(b.names_out, n);
+  return b.failed;
+}
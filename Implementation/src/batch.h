@@ -0,0 +1,39 @@
+// Collects the input files of a batch: the n_args names in args, followed by
+// one name per line of the file manifest, if manifest is not NULL ("-" reads
+// the list from stdin). Empty lines are skipped.
+//
+// Return value:
+//   an array of *n names, to be released with batch_inputs_free()
+//   NULL on failure, after printing an error message
+extern char **batch_inputs(char *const *args, size_t n_args,
+                           const char *manifest, size_t *n);
+
+extern void batch_inputs_free(char **names, size_t n);
+
+// Scales each of the n files in names by scale_factor, using implementation
+// number version (1-based like --version, 0 picks pick_version() per image).
+// Output file names are made from out_template, see batch_out_name().
+//
+// Files are handed out to a pool of `threads` worker threads, each of which
+// scales one file at a time and keeps its buffers for the next file. A file
+// that fails (can't be read, parsed, scaled by that implementation (see
+// scale_usable()) or written) is reported on stderr and
+// skipped; the rest of the batch goes on. So is a file whose output would be
+// an input of the batch (e.g. its own input), or the output of an earlier
+// file of the batch (e.g. of a/x.ppm for b/x.ppm).
+//
+// Return value:
+//   the amount of files that failed
+extern size_t scale_batch(char *const *names, size_t n,
+                          const char *out_template, size_t scale_factor,
+                          size_t version, size_t threads);
+
+// Makes the output file name for name_in:
+//   if out_template contains "%s", every "%s" is replaced by the base name of
+//   name_in without its ".ppm" extension,
+//   otherwise, out_template is a directory and the output is written there
+//   under the base name of name_in.
+// Return value:
+//   the name, to be freed by the caller
+//   NULL if allocating it failed
+extern char *batch_out_name(const char *out_template, const char *name_in);
@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "counters.h"
+#include "file_parsing.h"
+#include "outbuf.h"
+#include "scale.h"
+#include "timing.h"
+#include "util.h"
+
+// Writes s as a JSON string
+static void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+// Writes the counters per call and the ratios derived from them, as more
+// CSV fields or JSON members: empty or null where a counter is missing
+static void bench_counters(FILE *out, bool json, const struct counters_st *c,
+                           double pixels, double bytes) {
+  double per_call[COUNTERS];
+  for (size_t i = 0; i < COUNTERS; i++) {
+    per_call[i] = c->calls && counters_have(c, i)
+                      ? (double)c->total[i] / c->calls
+                      : -1;
+    if (json)
+      fprintf(out, ", \"%s\": ", counter_names[i]);
+    else
+      fputc(',', out);
+    if (per_call[i] >= 0)
+      fprintf(out, "%.0f", per_call[i]);
+    else if (json)
+      fprintf(out, "null");
+  }
+
+  const double cycles = per_call[COUNTER_CYCLES];
+  const double instructions = per_call[COUNTER_INSTRUCTIONS];
+  const char *const names[] = {"ipc", "bytes_per_cycle", "cycles_per_pixel"};
+  const double ratios[] = {cycles > 0 && instructions >= 0
+                               ? instructions / cycles
+                               : -1,
+                           cycles > 0 ? bytes / cycles : -1,
+                           cycles >= 0 ? cycles / pixels : -1};
+  for (size_t i = 0; i < 3; i++) {
+    if (json)
+      fprintf(out, ", \"%s\": ", names[i]);
+    else
+      fputc(',', out);
+    if (ratios[i] >= 0)
+      fprintf(out, "%.3f", ratios[i]);
+    else if (json)
+      fprintf(out, "null");
+  }
+}
+
+static void bench_record(FILE *out, bool json, bool first, const char *name,
+                         const struct img_st *img, size_t version,
+                         size_t scale_factor, size_t threads,
+                         const struct timing_stats_st *stats,
+                         const struct counters_st *counters) {
+  const double pixels =
+      (double)img->width * img->height * scale_factor * scale_factor;
+  const double bytes = pixels * img->channels * img_sample_size(img);
+  double mb_s = timing_mb_s(stats, img->width, img->height, scale_factor,
+                            img->channels * img_sample_size(img));
+  double mp_s = timing_mp_s(stats, img->width, img->height, scale_factor);
+
+  if (!json) {
+    // Names with commas or quotes would need CSV quoting; we don't expect any
+    fprintf(out, "%s,%zu,%zu,%zu,%zu,%zu,%zu,%lu,%lu,%lu,%lu,%.2f,%.2f", name,
+            img->width, img->height, version, scale_factor, threads,
+            stats->iterations, stats->min, stats->median, stats->p95,
+            stats->p99, mb_s, mp_s);
+    if (counters)
+      bench_counters(out, false, counters, pixels, bytes);
+    fputc('\n', out);
+    return;
+  }
+
+  fprintf(out, "%s\n  {\"image\": ", first ? "" : ",");
+  json_string(out, name);
+  fprintf(out,
+          ", \"width\": %zu, \"height\": %zu, \"version\": %zu, "
+          "\"scale_factor\": %zu, \"threads\": %zu, \"iterations\": %zu, "
+          "\"min_ns\": %lu, \"median_ns\": %lu, \"p95_ns\": %lu, "
+          "\"p99_ns\": %lu, \"mb_s\": %.2f, \"mp_s\": %.2f",
+          img->width, img->height, version, scale_factor, threads,
+          stats->iterations, stats->min, stats->median, stats->p95, stats->p99,
+          mb_s, mp_s);
+  if (counters)
+    bench_counters(out, true, counters, pixels, bytes);
+  fputc('}', out);
+}
+
+int bench_matrix(char *const *names, size_t n,
+                 const struct bench_opts_st *opts, FILE *out) {
+  int ret = 0;
+  bool first = true;
+
+  struct counters_st counters;
+  if (opts->counters && !counters_open(&counters)) {
+    fprintf(stderr,
+            "Note: No hardware counters available: %s. Virtual machines "
+            "often have none, and /proc/sys/kernel/perf_event_paranoid may "
+            "forbid them. Measuring without.\n",
+            strerror(errno));
+  }
+
+  if (opts->json) {
+    fprintf(out, "[");
+  } else {
+    fprintf(out, "image,width,height,version,scale_factor,threads,iterations,"
+                 "min_ns,median_ns,p95_ns,p99_ns,mb_s,mp_s");
+    if (opts->counters) {
+      for (size_t i = 0; i < COUNTERS; i++)
+        fprintf(out, ",%s", counter_names[i]);
+      fprintf(out, ",ipc,bytes_per_cycle,cycles_per_pixel");
+    }
+    fprintf(out, "\n");
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    struct img_st img = {0, 0, NULL, NULL, 0, 0, 0};
+    FILE *fp = fopen(names[i], "r");
+    if (!fp) {
+      fprintf(stderr, "%s: ", names[i]);
+      perror("Error opening input file");
+      ret = 1;
+      continue;
+    }
+    int res = parse_file(fp, &img);
+    fclose(fp);
+    if (res) {
+      fprintf(stderr, "%s: could not be parsed, skipping.\n", names[i]);
+      ret = 1;
+      continue;
+    }
+    if (img.width * img.height == 0) {
+      fprintf(stderr, "%s: image of size 0, skipping.\n", names[i]);
+      free_img(&img);
+      continue;
+    }
+
+    for (size_t f = 0; f < opts->n_factors; f++) {
+      const size_t sf = opts->factors[f];
+      errno = 0;
+      size_t size_out =
+          output_imgsize(img.width, img.height, sf,
+                         img.channels * img_sample_size(&img));
+      struct outbuf_st result = {NULL, 0, 0};
+      if (errno == ERANGE || !sf ||
+          outbuf_alloc(&result, size_out, opts->huge_pages)) {
+        fprintf(stderr, "%s: can't allocate output for scale factor %zu, "
+                        "skipping.\n",
+                names[i], sf);
+        ret = 1;
+        continue;
+      }
+
+      for (size_t v = 0; v < opts->n_versions; v++) {
+        const size_t version = opts->versions[v];
+        if (!scale_usable(version, sf, img.width, img.channels,
+                          img_sample_size(&img)))
+          continue;
+        struct timing_stats_st stats;
+        if (opts->counters)
+          counters_reset(&counters);
+        if (timing_loop(&stats, true, opts->warmup, opts->repeats,
+                        opts->counters ? &counters : NULL,
+                        scale_band_fun(version, img.channels,
+                                       img_sample_size(&img)),
+                        opts->threads,
+                        img.img, img.width, img.height, sf, result.data)) {
+          ret = 1;
+          continue;
+        }
+        bench_record(out, opts->json, first, names[i], &img, version, sf,
+                     opts->threads, &stats,
+                     opts->counters ? &counters : NULL);
+        first = false;
+        fflush(out);
+      }
+      outbuf_free(&result);
+    }
+    free_img(&img);
+  }
+
+  if (opts->json)
+    fprintf(out, "\n]\n");
+  if (opts->counters)
+    counters_close(&counters);
+  return ret;
+}
@@ -0,0 +1,32 @@
+// What to measure in bench_matrix(): every implementation in versions (1-based
+// like --version) at every scale factor in factors, on every input image.
+struct bench_opts_st {
+  const size_t *versions;
+  size_t n_versions;
+  const size_t *factors;
+  size_t n_factors;
+  size_t warmup;
+  size_t repeats;
+  size_t threads;
+  bool json;
+  bool huge_pages; // allocate the output with outbuf_alloc(..., true)
+  bool counters;   // add hardware counters per call, see counters.h
+};
+
+// Runs timing_loop() for every combination in opts on each of the n images
+// in names, and writes one record per combination to out, as CSV (with a
+// header line) or as a JSON array. Combinations an implementation can't
+// handle (scale factor too large, instructions missing on this CPU, a grey or
+// RGBA image for an RGB-only implementation) are left out. Images that fail
+// to parse are reported on stderr and left out, too.
+//
+// With opts->counters, each record also has the hardware counters per call,
+// IPC, output bytes per cycle and cycles per output pixel. Counters that
+// aren't available are empty (CSV) or null (JSON); if none are, a note is
+// printed to stderr and the records have no values for them.
+//
+// Return value:
+//   0 if every image could be measured
+//   1 otherwise
+extern int bench_matrix(char *const *names, size_t n,
+                        const struct bench_opts_st *opts, FILE *out);
@@ -0,0 +1,108 @@
+// syscall() is not part of C17; see man feature_test_macros(7)
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "counters.h"
+
+const char *const counter_names[COUNTERS] = {
+    "cycles",        "instructions", "l1d_misses",
+    "llc_misses",    "branch_misses", "dtlb_misses"};
+
+// perf_event_attr type and config of each counter
+static const uint32_t counter_types[COUNTERS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+static const uint64_t counter_configs[COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+        PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+        PERF_COUNT_HW_CACHE_RESULT_MISS << 16};
+
+size_t counters_open(struct counters_st *c) {
+  size_t opened = 0;
+  int first_err = 0;
+  for (size_t i = 0; i < COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_types[i];
+    attr.config = counter_configs[i];
+    // Count the threads scale_parallel() starts, too. Their counts are added
+    // when they exit, which is before counters_end() reads.
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (c->fd[i] >= 0)
+      opened++;
+    else if (!first_err)
+      first_err = errno;
+  }
+  counters_reset(c);
+  errno = opened ? 0 : first_err;
+  return opened;
+}
+
+void counters_close(struct counters_st *c) {
+  for (size_t i = 0; i < COUNTERS; i++) {
+    if (c->fd[i] >= 0)
+      close(c->fd[i]);
+    c->fd[i] = -1;
+  }
+}
+
+void counters_reset(struct counters_st *c) {
+  memset(c->total, 0, sizeof(c->total));
+  c->calls = 0;
+}
+
+// Reads value, time enabled and time running of counter i into v. Inherited
+// counters can't be reset together with the counts of their threads, so
+// counters_end() works with differences instead.
+static bool counter_read(const struct counters_st *c, size_t i,
+                         uint64_t v[3]) {
+  return c->fd[i] >= 0 &&
+         read(c->fd[i], v, 3 * sizeof(uint64_t)) == 3 * sizeof(uint64_t);
+}
+
+void counters_begin(struct counters_st *c) {
+  for (size_t i = 0; i < COUNTERS; i++) {
+    if (!counter_read(c, i, c->begin[i]))
+      memset(c->begin[i], 0, sizeof(c->begin[i]));
+  }
+}
+
+void counters_end(struct counters_st *c) {
+  for (size_t i = 0; i < COUNTERS; i++) {
+    uint64_t v[3];
+    if (!counter_read(c, i, v))
+      continue;
+    const uint64_t value = v[0] - c->begin[i][0];
+    const uint64_t enabled = v[1] - c->begin[i][1];
+    const uint64_t running = v[2] - c->begin[i][2];
+    // With more counters than the CPU has registers for, each one only ran
+    // part of the time; extrapolate
+    if (running && running < enabled)
+      c->total[i] += (uint64_t)((double)value * enabled / running);
+    else
+      c->total[i] += value;
+  }
+  c->calls++;
+}
+
+bool counters_have(const struct counters_st *c, enum counter counter) {
+  return c->fd[counter] >= 0;
+}
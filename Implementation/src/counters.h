@@ -0,0 +1,50 @@
+// Hardware performance counters through Linux' perf_event_open(), to tell
+// whether a kernel is bound by compute, cache misses or stores. The counters
+// only count user space of this process and the threads it starts after
+// counters_open(), which is allowed with the default perf_event_paranoid of 2.
+// Counters the CPU, the kernel or a virtual machine doesn't provide are left
+// out; everything else still works.
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+enum counter {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_L1D_MISSES, // L1 data cache read misses
+  COUNTER_LLC_MISSES, // last level cache misses
+  COUNTER_BRANCH_MISSES,
+  COUNTER_DTLB_MISSES, // data TLB read misses
+  COUNTERS
+};
+
+struct counters_st {
+  int fd[COUNTERS]; // -1 if the counter isn't available
+  // Values at counters_begin(), and the sums of the differences up to
+  // counters_end(), scaled up where the kernel had to multiplex counters
+  uint64_t begin[COUNTERS][3];
+  uint64_t total[COUNTERS];
+  size_t calls;
+};
+#endif
+
+// Names of the counters, for CSV columns and JSON keys
+extern const char *const counter_names[COUNTERS];
+
+// Opens and starts all counters that are available.
+// Return value:
+//   the number of counters opened; if 0, errno tells why the first one
+//   couldn't be opened
+extern size_t counters_open(struct counters_st *c);
+extern void counters_close(struct counters_st *c);
+
+// Sets the totals and the number of calls to 0
+extern void counters_reset(struct counters_st *c);
+
+// Call right before and after the code to count; counters_end() adds what
+// the counters counted in between to the totals.
+extern void counters_begin(struct counters_st *c);
+extern void counters_end(struct counters_st *c);
+
+// Whether counter is available
+extern bool counters_have(const struct counters_st *c, enum counter counter);
@@ -1,13 +1,25 @@
+// mmap(), fileno(), writev() and MAP_ANONYMOUS are not part of C17; see
+// man feature_test_macros(7)
+#define _DEFAULT_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <tmmintrin.h> // SSSE3
 
 #include "file_parsing.h"
+#include "trace.h"
 #include "util.h"
 
 // Arbitrary choice, though making it too short will make parsing slow.
@@ -17,7 +29,39 @@
 // fgets().
 #define FGETS_LENGTH 72
 
-enum parse_type { P3_FILE, P6_FILE };
+// P5 and P6 rasters at least this big are mapped into memory instead of being
+// read, see parse_file_mmap(). For smaller ones, setting up the mapping costs
+// more than the copy it saves.
+#define MMAP_MIN_SIZE (64 * 1024)
+
+// Size of the chunks a plain-text raster is read in, see read_samples_p3()
+#define P3_CHUNK_SIZE (64 * 1024)
+
+// Plain-text rasters with at least this many samples are decoded in parallel
+// (if parse_set_threads() allows), in chunks of at least this many bytes, see
+// p3_decode_parallel(). Below that, starting threads costs more than it saves.
+#define P3_PARALLEL_MIN_SAMPLES (256 * 1024)
+#define P3_PARALLEL_MIN_CHUNK (256 * 1024)
+
+// Samples per chunk when writing a 16-bit raster, see write_raster()
+#define SWAP_CHUNK_SAMPLES (16 * 1024)
+
+// Samples per line of plain-text output, see write_raster_plain(): three RGB
+// pixels. With maxval 65535, that's at most 9 * 6 characters (five digits and
+// a space or the line break), below the 70 the format asks for.
+#define PLAIN_LINE_SAMPLES 9
+
+// Size of the chunks a plain-text raster is written in. A line is added to a
+// chunk as long as less than PLAIN_CHUNK_SIZE bytes are used, so the buffer
+// needs room for one more line, plus the 4 bytes a sample may be overwritten.
+#define PLAIN_CHUNK_SIZE (64 * 1024)
+#define PLAIN_CHUNK_SLACK 64
+
+// Largest maxval the formats allow
+#define MAX_MAXVAL 65535
+
+// Plain-text rasters (P2, P3) and binary ones (P5, P6, P7)
+enum parse_type { PLAIN_FILE, RAW_FILE };
 
 // Struct to keep track of line-related information we need during parsing.
 //   lineptr: pointer to beginning of line (will be used to call free())
@@ -27,8 +71,17 @@ struct line_info_st {
   const char *linepos;
 };
 
-// We can't use strlen() because fgets() might have read null bytes from the P6
-// image raster.
+// Buffer for reading a plain-text raster in chunks.
+//   buf: P3_CHUNK_SIZE bytes, of which [pos, len) haven't been parsed yet
+struct p3_reader_st {
+  FILE *fp;
+  char *buf;
+  size_t pos;
+  size_t len;
+};
+
+// We can't use strlen() because fgets() might have read null bytes from the
+// binary image raster.
 size_t ln_length(char *ln, size_t max_length) {
   for (size_t len = 0; len < max_length; len++) {
     if (ln[len] == '\n')
@@ -147,68 +200,504 @@ enum parse_err parse_file_header(FILE *fp, struct img_st *dest,
       return res;
   }
 
-  if (vals[2] != 255) {
+  if (vals[2] == 0 || vals[2] > MAX_MAXVAL) {
     return WRONG_DEPTH;
   }
   dest->width = vals[0];
   dest->height = vals[1];
+  dest->maxval = vals[2];
 
   return PARSE_OK;
 }
 
-enum parse_err parse_file_p3(FILE *fp, struct img_st *dest,
-                             struct line_info_st *lastln) {
-  enum parse_err res;
-  size_t tmp;
+size_t img_sample_size(const struct img_st *img) {
+  return img->maxval > 255 ? 2 : 1;
+}
 
-  for (size_t read_cur = 0; read_cur < dest->width * dest->height * 3;
-       read_cur++) {
-    res = read_number(fp, lastln, &tmp, false);
-    if (res == OUT_OF_RANGE_ERR)
-      return PIXEL_OOR;
-    if (res != PARSE_OK)
-      return res;
-    if (res > 255)
-      return PIXEL_OOR;
-    dest->img[read_cur] = tmp;
+size_t img_readable_size(const struct img_st *img) {
+  if (img->map)
+    return (uint8_t *)img->map + img->map_size - img->img;
+  return input_imgsize(img->width, img->height,
+                       img->channels * img_sample_size(img));
+}
+
+// Swaps the bytes of n 16-bit samples from src to dest, which may be the same
+// buffer: the file formats store them big endian, x86 is little endian.
+static void swap16(const uint8_t *src, size_t n, uint8_t *dest) {
+  const __m128i swap =
+      _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    _mm_storeu_si128((__m128i *)(dest + 2 * i), _mm_shuffle_epi8(v, swap));
+  }
+  for (; i < n; i++) {
+    const uint8_t hi = src[2 * i];
+    dest[2 * i] = src[2 * i + 1];
+    dest[2 * i + 1] = hi;
   }
+}
+
+// Whether the line buffer holds nothing but whitespace from pos on
+static bool rest_is_space(const char *pos) {
+  while (isspace(*pos))
+    pos++;
+  return *pos == 0;
+}
+
+// Parses the header of a PAM (P7) file, which unlike the other formats is one
+// field per line, up to ENDHDR:
+//   WIDTH 640
+//   HEIGHT 480
+//   DEPTH 4
+//   MAXVAL 255
+//   TUPLTYPE RGB_ALPHA
+//   ENDHDR
+// TUPLTYPE is optional and ignored; DEPTH is the number of channels. The
+// raster starts right after the newline of ENDHDR, and since fgets() stops
+// there, ln->linepos is left at that newline, like parse_file_header() leaves
+// it at the whitespace after maxval.
+enum parse_err parse_pam_header(FILE *fp, struct img_st *dest,
+                                struct line_info_st *ln) {
+  static const char *const fields[] = {"WIDTH", "HEIGHT", "DEPTH", "MAXVAL"};
+  size_t vals[4];
+  bool seen[4] = {false, false, false, false};
 
+  // The rest of the line with the magic number
+  if (!rest_is_space(ln->lineptr))
+    return PARSE_ERR;
+
+  for (;;) {
+    if (fgets(ln->lineptr, FGETS_LENGTH, fp) == NULL)
+      return READ_ERR;
+    const size_t len = ln_length(ln->lineptr, FGETS_LENGTH);
+    const bool complete = len < FGETS_LENGTH;
+    if (strlen(ln->lineptr) < (complete ? len : FGETS_LENGTH - 1) &&
+        !feof(fp))
+      return PARSE_ERR; // Null byte in the header
+
+    const char *pos = ln->lineptr;
+    while (isspace(*pos))
+      pos++;
+    size_t key_len = 0;
+    while (pos[key_len] && !isspace(pos[key_len]))
+      key_len++;
+
+    if (key_len == 0) {
+      continue; // Empty line
+    } else if (*pos == '#' || (key_len == 8 && !strncmp(pos, "TUPLTYPE", 8))) {
+      // Skip the rest of a long comment or tuple type
+      while (!complete && strlen(ln->lineptr) == FGETS_LENGTH - 1 &&
+             ln->lineptr[FGETS_LENGTH - 2] != '\n') {
+        if (fgets(ln->lineptr, FGETS_LENGTH, fp) == NULL)
+          return READ_ERR;
+      }
+      continue;
+    } else if (key_len == 6 && !strncmp(pos, "ENDHDR", 6)) {
+      if (!complete)
+        return feof(fp) ? READ_ERR : PARSE_ERR;
+      if (!rest_is_space(pos + 6))
+        return PARSE_ERR;
+      ln->linepos = ln->lineptr + len;
+      break;
+    }
+
+    size_t i = 0;
+    while (i < 4 && (strlen(fields[i]) != key_len ||
+                     strncmp(pos, fields[i], key_len)))
+      i++;
+    if (i == 4 || seen[i] || !complete)
+      return PARSE_ERR;
+    const char *endptr, *numptr;
+    errno = 0;
+    vals[i] = strtosizet(pos + key_len, &endptr, &numptr);
+    if (errno == ERANGE)
+      return OUT_OF_RANGE_ERR;
+    if (!numptr || !rest_is_space(endptr))
+      return PARSE_ERR;
+    seen[i] = true;
+  }
+
+  for (size_t i = 0; i < 4; i++) {
+    if (!seen[i])
+      return PARSE_ERR;
+  }
+  if (vals[3] == 0 || vals[3] > MAX_MAXVAL)
+    return WRONG_DEPTH;
+  if (vals[2] != 1 && vals[2] != 3 && vals[2] != 4)
+    return WRONG_CHANNELS;
+  dest->width = vals[0];
+  dest->height = vals[1];
+  dest->channels = vals[2];
+  dest->maxval = vals[3];
   return PARSE_OK;
 }
 
+// Character classes in the plain-text raster (P2 or P3), see read_samples_p3()
+enum p3_class { P3_OTHER = 0, P3_DIGIT, P3_SPACE, P3_PLUS, P3_MINUS };
+
+// Threads to decode plain-text rasters with, see parse_set_threads()
+static size_t parse_threads = 1;
+
+// Same whitespace as isspace() in the "C" locale
+static const uint8_t p3_classes[256] = {
+    ['0'] = P3_DIGIT,  ['1'] = P3_DIGIT,  ['2'] = P3_DIGIT,  ['3'] = P3_DIGIT,
+    ['4'] = P3_DIGIT,  ['5'] = P3_DIGIT,  ['6'] = P3_DIGIT,  ['7'] = P3_DIGIT,
+    ['8'] = P3_DIGIT,  ['9'] = P3_DIGIT,  [' '] = P3_SPACE,  ['\t'] = P3_SPACE,
+    ['\n'] = P3_SPACE, ['\v'] = P3_SPACE, ['\f'] = P3_SPACE, ['\r'] = P3_SPACE,
+    ['+'] = P3_PLUS,   ['-'] = P3_MINUS};
+
+// Initializes rd to read the raster that follows the header in lastln.
+// Afterwards, rd->buf must be freed by the caller (unless it is NULL).
+enum parse_err p3_reader_init(struct p3_reader_st *rd, FILE *fp,
+                              const struct line_info_st *lastln) {
+  rd->fp = fp;
+  rd->buf = malloc(P3_CHUNK_SIZE);
+  if (!rd->buf)
+    return MALLOC_ERR;
+
+  // Start with what fgets() has already read after maxval. Since the raster
+  // of a P3 file is text, strlen() works here.
+  rd->len = strlen(lastln->linepos);
+  memcpy(rd->buf, lastln->linepos, rd->len);
+  rd->pos = 0;
+  return PARSE_OK;
+}
+
+// State of the plain-text decoder, see p3_decode(). It is kept between calls
+// because a number may be split between two chunks of the file.
+//   count:  samples stored so far
+//   val:    the number being decoded
+//   in_num: seen a sign or digit of the current number
+//   digits: seen a digit of the current number
+struct p3_state_st {
+  size_t count;
+  unsigned val;
+  bool in_num;
+  bool digits;
+};
+
+// Decodes buf[*pos] to buf[len - 1] into dest (as uint8_t or, if maxval > 255,
+// as uint16_t), and stops after sample n, leaving the whitespace after it to
+// the next call like read_number() does. Afterwards, *pos is where decoding
+// stopped. On errors, st->count is the index of the sample that was being
+// decoded.
+// Error handling is the same as read_number() with allow_comments == false,
+// except that values from maxval + 1 to SIZE_MAX are now rejected as well.
+static inline enum parse_err p3_decode(struct p3_state_st *st,
+                                       const uint8_t *buf, size_t *pos,
+                                       size_t len, uint8_t *dest, size_t n,
+                                       size_t maxval) {
+  const bool wide = maxval > 255;
+  enum parse_err res = PARSE_OK;
+  size_t i = *pos;
+  size_t count = st->count;
+  unsigned val = st->val;
+  bool in_num = st->in_num;
+  bool digits = st->digits;
+
+  for (; i < len; i++) {
+    uint8_t c = buf[i];
+    switch (p3_classes[c]) {
+    case P3_DIGIT:
+      val = val * 10 + (c - '0');
+      if (val > maxval) {
+        res = PIXEL_OOR;
+        goto end;
+      }
+      in_num = digits = true;
+      continue;
+    case P3_SPACE:
+      if (!in_num)
+        continue;
+      if (!digits) {
+        res = PARSE_ERR; // Lone '+'
+        goto end;
+      }
+      if (wide)
+        ((uint16_t *)dest)[count++] = val;
+      else
+        dest[count++] = val;
+      val = 0;
+      in_num = digits = false;
+      if (count == n)
+        goto end;
+      continue;
+    case P3_PLUS:
+      if (in_num) {
+        res = PARSE_ERR;
+        goto end;
+      }
+      in_num = true;
+      continue;
+    case P3_MINUS:
+      // A negative number is out of range, like in strtosizet()
+      res = in_num ? PARSE_ERR : PIXEL_OOR;
+      goto end;
+    default:
+      // Including '#': comments are not allowed in the raster
+      res = PARSE_ERR;
+      goto end;
+    }
+  }
+
+end:
+  *pos = i;
+  st->count = count;
+  st->val = val;
+  st->in_num = in_num;
+  st->digits = digits;
+  return res;
+}
+
+// At the end of the file: the last number doesn't need whitespace after it,
+// so store it if there is one (and room for it in the n samples of dest).
+static void p3_finish(struct p3_state_st *st, uint8_t *dest, size_t n,
+                      size_t maxval) {
+  if (!st->digits || st->count == n)
+    return;
+  if (maxval > 255)
+    ((uint16_t *)dest)[st->count++] = st->val;
+  else
+    dest[st->count++] = st->val;
+}
+
+// Reads n plain-text samples into dest, as uint8_t or (if maxval > 255) as
+// uint16_t.
+// Instead of going through read_number() for every sample, this reads the
+// file in chunks of P3_CHUNK_SIZE and decodes them with a single pass over
+// the characters (see p3_decode()).
+enum parse_err read_samples_p3(struct p3_reader_st *rd, uint8_t *dest,
+                               size_t n, size_t maxval) {
+  struct p3_state_st st = {0};
+  enum parse_err res = PARSE_OK;
+
+  while (st.count < n) {
+    if (rd->pos == rd->len) {
+      rd->pos = 0;
+      rd->len = fread(rd->buf, 1, P3_CHUNK_SIZE, rd->fp);
+      if (rd->len == 0) {
+        if (feof(rd->fp))
+          p3_finish(&st, dest, n, maxval);
+        if (st.count < n)
+          res = READ_ERR;
+        break;
+      }
+    }
+    res = p3_decode(&st, (const uint8_t *)rd->buf, &rd->pos, rd->len, dest, n,
+                    maxval);
+    if (res != PARSE_OK)
+      break;
+  }
+  return res;
+}
+
+// Reads the rest of the file (after what p3_reader_init() took from the
+// header's line) into rd->buf, growing it as needed; rd->len is its size.
+static enum parse_err p3_slurp(struct p3_reader_st *rd) {
+  size_t cap = P3_CHUNK_SIZE;
+  struct stat sb;
+  long pos = ftell(rd->fp);
+  if (!fstat(fileno(rd->fp), &sb) && S_ISREG(sb.st_mode) && pos >= 0 &&
+      sb.st_size > pos)
+    cap = rd->len + (sb.st_size - pos) + 1; // + 1 to see EOF without growing
+  for (;;) {
+    char *grown = realloc(rd->buf, cap);
+    if (!grown)
+      return MALLOC_ERR;
+    rd->buf = grown;
+    rd->len += fread(rd->buf + rd->len, 1, cap - rd->len, rd->fp);
+    if (rd->len < cap)
+      return ferror(rd->fp) ? READ_ERR : PARSE_OK;
+    if (cap > SIZE_MAX / 2)
+      return MALLOC_ERR;
+    cap *= 2;
+  }
+}
+
+// One chunk of the raster text for p3_decode_parallel():
+//   text, len: the characters, starting right after whitespace
+//   dest:      where its samples go; room for cap of them
+//   count:     samples decoded
+//   res:       PARSE_OK, or the error at sample number count of the chunk
+struct p3_chunk_st {
+  const uint8_t *text;
+  size_t len;
+  uint8_t *dest;
+  size_t cap;
+  size_t maxval;
+  bool last;
+  size_t count;
+  enum parse_err res;
+};
+
+static void *p3_chunk_worker(void *arg) {
+  struct p3_chunk_st *ch = arg;
+  struct p3_state_st st = {0};
+  size_t pos = 0;
+  ch->res = p3_decode(&st, ch->text, &pos, ch->len, ch->dest, ch->cap,
+                      ch->maxval);
+  // Chunks other than the last one end with whitespace, so only the last one
+  // can end within a number
+  if (ch->res == PARSE_OK && ch->last && pos == ch->len)
+    p3_finish(&st, ch->dest, ch->cap, ch->maxval);
+  ch->count = st.count;
+  return NULL;
+}
+
+// Decodes the raster text in text[0, len) into the n samples of dest with
+// up to threads threads: the text is split into chunks at whitespace, so that
+// no number spans two of them, and every chunk is decoded on its own. Only
+// the first chunk knows where its samples go, the others decode into buffers
+// of their own; once all are done, their counts give the offsets to copy the
+// samples to. Errors and the sample count are checked as if the text had been
+// decoded in one go: an error only counts if it comes before sample n, and
+// anything after sample n is ignored.
+static enum parse_err p3_decode_parallel(const uint8_t *text, size_t len,
+                                         uint8_t *dest, size_t n,
+                                         size_t maxval, size_t threads) {
+  const size_t sample_size = maxval > 255 ? 2 : 1;
+  if (threads > len / P3_PARALLEL_MIN_CHUNK + 1)
+    threads = len / P3_PARALLEL_MIN_CHUNK + 1;
+  struct p3_chunk_st *chunks = calloc(threads, sizeof(struct p3_chunk_st));
+  pthread_t *tids = malloc(threads * sizeof(pthread_t));
+  bool *started = calloc(threads, sizeof(bool));
+  enum parse_err res = PARSE_OK;
+  if (!chunks || !tids || !started) {
+    res = MALLOC_ERR;
+    goto cleanup;
+  }
+
+  size_t begin = 0;
+  for (size_t i = 0; i < threads; i++) {
+    size_t end = len;
+    if (i < threads - 1) {
+      end = len / threads * (i + 1);
+      if (end < begin)
+        end = begin;
+      while (end < len && p3_classes[text[end - 1]] != P3_SPACE)
+        end++;
+    }
+    struct p3_chunk_st *ch = &chunks[i];
+    ch->text = text + begin;
+    ch->len = end - begin;
+    // A sample takes at least two characters, one digit and one whitespace,
+    // except for the last one of the file
+    ch->cap = (ch->len + 1) / 2 < n ? (ch->len + 1) / 2 : n;
+    ch->maxval = maxval;
+    ch->last = end == len;
+    ch->dest = i == 0 ? dest : malloc(ch->cap * sample_size + 1);
+    if (!ch->dest) {
+      res = MALLOC_ERR;
+      goto cleanup;
+    }
+    begin = end;
+  }
+
+  // The calling thread decodes the first chunk itself
+  for (size_t i = 1; i < threads; i++)
+    started[i] = !pthread_create(&tids[i], NULL, p3_chunk_worker, &chunks[i]);
+  p3_chunk_worker(&chunks[0]);
+  for (size_t i = 1; i < threads; i++) {
+    if (started[i])
+      pthread_join(tids[i], NULL);
+    else
+      p3_chunk_worker(&chunks[i]);
+  }
+
+  size_t offset = 0;
+  for (size_t i = 0; i < threads && offset < n; i++) {
+    const struct p3_chunk_st *ch = &chunks[i];
+    if (ch->res != PARSE_OK && offset + ch->count < n) {
+      res = ch->res;
+      break;
+    }
+    const size_t count = ch->count < n - offset ? ch->count : n - offset;
+    if (i > 0)
+      memcpy(dest + offset * sample_size, ch->dest, count * sample_size);
+    offset += count;
+  }
+  if (res == PARSE_OK && offset < n)
+    res = READ_ERR;
+
+cleanup:
+  if (chunks) {
+    for (size_t i = 1; i < threads; i++)
+      free(chunks[i].dest);
+  }
+  free(chunks);
+  free(tids);
+  free(started);
+  return res;
+}
+
+enum parse_err parse_file_p3(FILE *fp, struct img_st *dest,
+                             struct line_info_st *lastln) {
+  struct p3_reader_st rd;
+  const size_t n = dest->width * dest->height * dest->channels;
+  enum parse_err res = p3_reader_init(&rd, fp, lastln);
+  if (res != PARSE_OK)
+    goto cleanup;
+  if (parse_threads > 1 && n >= P3_PARALLEL_MIN_SAMPLES) {
+    res = p3_slurp(&rd);
+    if (res == PARSE_OK)
+      res = p3_decode_parallel((const uint8_t *)rd.buf, rd.len, dest->img, n,
+                               dest->maxval, parse_threads);
+  } else {
+    res = read_samples_p3(&rd, dest->img, n, dest->maxval);
+  }
+
+cleanup:
+  if (rd.buf)
+    free(rd.buf);
+  return res;
+}
+
+void parse_set_threads(size_t threads) {
+  parse_threads = threads ? threads : 1;
+}
+
+// If the whitespace that separates colour depth from raster was not a '\n',
+// fgets() has read more than it should have. Returns how many raster bytes
+// are left in the line buffer, starting at lastln->linepos + 1.
+size_t raster_in_line(const struct line_info_st *lastln) {
+  return ln_length(lastln->lineptr, FGETS_LENGTH) -
+         (lastln->linepos - lastln->lineptr);
+}
+
 enum parse_err parse_file_p6(FILE *fp, struct img_st *dest,
                              struct line_info_st *lastln) {
   // DO NOT USE fgets() FOR READING IMAGE RASTER!
   // If our image anywhere contains the byte 10 (ASCII for '\n'), it would not
   // get the full image. Use fread() instead, it doesn't care about newlines.
 
-  // If the whitespace that separates colour depth from raster was not a '\n',
-  // fgets() has read more than it should have. Copy the remaining contents of
-  // the buffer to dest->img.
-  size_t imgbuf_size = dest->width * dest->height * 3;
-  size_t lastln_size = ln_length(lastln->lineptr, FGETS_LENGTH) -
-                       (lastln->linepos - lastln->lineptr);
+  // Copy what fgets() has already read of the raster to dest->img.
+  const size_t samples = dest->width * dest->height * dest->channels;
+  size_t imgbuf_size = samples * img_sample_size(dest);
+  size_t lastln_size = raster_in_line(lastln);
 
   if (lastln_size >= imgbuf_size) {
     memcpy(dest->img, lastln->linepos + 1, imgbuf_size);
-    return PARSE_OK;
-  }
-
-  memcpy(dest->img, lastln->linepos + 1, lastln_size);
-  imgbuf_size -= lastln_size;
-
-  size_t r = fread(dest->img, 1, imgbuf_size, fp);
-  if (r < imgbuf_size) {
-    return READ_ERR;
+  } else {
+    memcpy(dest->img, lastln->linepos + 1, lastln_size);
+    size_t rest = imgbuf_size - lastln_size;
+    if (fread(dest->img + lastln_size, 1, rest, fp) < rest)
+      return READ_ERR;
   }
+  if (dest->maxval > 255)
+    swap16(dest->img, samples, dest->img);
   return PARSE_OK;
 }
 
-enum parse_err parse_file_h(FILE *fp, struct img_st *dest) {
+// Checks the magic number and parses the header, including dest->channels:
+// 1 for PGM (P2, P5), 3 for PPM (P3, P6), and DEPTH for PAM (P7).
+// Afterwards, lastln->lineptr must be freed by the caller (even on failure,
+// unless it is NULL).
+enum parse_err parse_file_start(FILE *fp, struct img_st *dest,
+                                enum parse_type *ptype,
+                                struct line_info_st *lastln) {
   // Before anything else, check for magic number
-  enum parse_type ptype;
-  enum parse_err res = PARSE_OK;
-  dest->img = NULL;
+  lastln->lineptr = NULL;
   int c = fgetc(fp);
   if (c == EOF)
     return READ_ERR;
@@ -216,11 +705,14 @@ enum parse_err parse_file_h(FILE *fp, struct img_st *dest) {
     return NO_MAGIC_NUM;
   c = fgetc(fp);
   switch (c) {
+  case '2':
   case '3':
-    ptype = P3_FILE;
+    *ptype = PLAIN_FILE;
     break;
+  case '5':
   case '6':
-    ptype = P6_FILE;
+  case '7':
+    *ptype = RAW_FILE;
     break;
   case EOF:
     return READ_ERR;
@@ -230,58 +722,213 @@ enum parse_err parse_file_h(FILE *fp, struct img_st *dest) {
 
   // Allocate and initialize an appropriate line buffer, and start
   // parsing header
+  lastln->lineptr = malloc(FGETS_LENGTH * sizeof(char));
+  if (!lastln->lineptr)
+    return MALLOC_ERR;
+  lastln->linepos = lastln->lineptr;
+  if (fgets(lastln->lineptr, FGETS_LENGTH, fp) == NULL)
+    return READ_ERR;
+
+  if (c == '7')
+    return parse_pam_header(fp, dest, lastln);
+  dest->channels = c == '2' || c == '5' ? 1 : 3;
+  return parse_file_header(fp, dest, lastln);
+}
+
+// Parses the header of a P5 or P6 file that is mapped at map, in place. This
+// only handles the common case: if anything is unusual (a comment inside a
+// number, maxval not 255, a number too large, ...) it returns 0, and the caller
+// falls back to the stdio parser, which also reports the proper error.
+// Otherwise, returns the offset of the raster and stores width and height.
+size_t p6_header_in_place(const uint8_t *map, size_t size, size_t *width,
+                          size_t *height) {
+  size_t vals[3];
+  size_t pos = 2; // skip the magic number
+
+  for (int i = 0; i < 3; i++) {
+    // Whitespace and comments
+    while (pos < size) {
+      if (isspace(map[pos])) {
+        pos++;
+      } else if (map[pos] == '#') {
+        while (pos < size && map[pos] != '\n')
+          pos++;
+      } else {
+        break;
+      }
+    }
+
+    if (pos == size || !isdigit(map[pos]))
+      return 0;
+    vals[i] = 0;
+    for (; pos < size && isdigit(map[pos]); pos++) {
+      if (__builtin_mul_overflow(vals[i], 10, &vals[i]) ||
+          __builtin_add_overflow(vals[i], map[pos] - '0', &vals[i]))
+        return 0;
+    }
+    if (pos == size || !isspace(map[pos]))
+      return 0;
+  }
+  if (vals[2] != 255)
+    return 0;
+
+  *width = vals[0];
+  *height = vals[1];
+  return pos + 1; // Exactly one whitespace separates maxval and raster
+}
+
+// Zero-copy loader for large P5 and P6 files: maps the file and lets dest->img
+// point directly into the mapping, so the raster is never copied and the page
+// cache is shared between processes scaling the same file.
+//
+// The SIMD scale functions read a few bytes past the end of the raster (which
+// input_imgsize() pads for). Reading past the end of the file is fine within
+// its last page, so we reserve one more page of zeros behind the mapping,
+// which covers any such read.
+//
+// Return value:
+//   true if the file was mapped and dest is complete
+//   false if this file can't be handled here (not a regular file, not P5/P6,
+//   too small, unusual or invalid header, mmap failed, ...). Nothing has been
+//   read from fp in this case, so it can be parsed the normal way.
+bool parse_file_mmap(FILE *fp, struct img_st *dest) {
+  struct stat sb;
+  int fd = fileno(fp);
+  if (fd < 0 || ftell(fp) != 0 || fstat(fd, &sb) || !S_ISREG(sb.st_mode) ||
+      (size_t)sb.st_size < MMAP_MIN_SIZE)
+    return false;
+
+  const size_t file_size = sb.st_size;
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t map_size = (file_size + page - 1) / page * page + page;
+
+  // Reserve the whole range, then map the file over its beginning
+  uint8_t *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+  if (map == MAP_FAILED)
+    return false;
+  if (mmap(map, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+      MAP_FAILED)
+    goto fallback;
+
+  if (map[0] != 'P' || (map[1] != '5' && map[1] != '6'))
+    goto fallback;
+  const size_t channels = map[1] == '5' ? 1 : 3;
+  size_t width, height;
+  size_t offset = p6_header_in_place(map, file_size, &width, &height);
+  if (!offset)
+    goto fallback;
+
+  // Let the stdio parser report overflows and files that are too short
+  errno = 0;
+  input_imgsize(width, height, channels);
+  if (errno == ERANGE || width * height * channels > file_size - offset ||
+      width * height * channels < MMAP_MIN_SIZE)
+    goto fallback;
+
+  madvise(map, map_size, MADV_SEQUENTIAL);
+  dest->width = width;
+  dest->height = height;
+  dest->channels = channels;
+  dest->maxval = 255;
+  dest->img = map + offset;
+  dest->map = map;
+  dest->map_size = map_size;
+  return true;
+
+fallback:
+  munmap(map, map_size);
+  return false;
+}
+
+// Bytes of the header parse_file_start() has parsed, for tracing. 0 if fp
+// can't tell its position (a pipe).
+static size_t header_bytes(FILE *fp, const struct line_info_st *lastln) {
+  const long pos = ftell(fp);
+  const size_t ahead = raster_in_line(lastln);
+  return pos < 0 || (size_t)pos < ahead ? 0 : (size_t)pos - ahead;
+}
+
+enum parse_err parse_file_reuse(FILE *fp, struct img_st *dest, uint8_t **buf,
+                                size_t *buf_size) {
+  enum parse_type ptype;
+  enum parse_err res = PARSE_OK;
   struct line_info_st lastln;
-  lastln.lineptr = malloc(FGETS_LENGTH * sizeof(char));
-  lastln.linepos = lastln.lineptr;
-  if (fgets(lastln.lineptr, FGETS_LENGTH, fp) == NULL) {
-    res = READ_ERR;
-    goto cleanup;
+  dest->img = NULL;
+  dest->map = NULL;
+  dest->map_size = 0;
+
+  // A mapped raster isn't decoded at all; its page faults count towards the
+  // kernel that reads it
+  uint64_t t = trace_begin();
+  if (parse_file_mmap(fp, dest)) {
+    trace_end(TRACE_HEADER, t, dest->img - (uint8_t *)dest->map);
+    return PARSE_OK;
   }
 
-  res = parse_file_header(fp, dest, &lastln);
+  res = parse_file_start(fp, dest, &ptype, &lastln);
   if (res != PARSE_OK)
     goto cleanup;
+  trace_end(TRACE_HEADER, t, trace_on ? header_bytes(fp, &lastln) : 0);
 
-  // Now, let's allocate a buffer to fit our image into.
+  // Now, let's make sure the buffer fits our image.
   errno = 0;
-  size_t imgbuf_size = input_imgsize(dest->width, dest->height);
+  size_t imgbuf_size = input_imgsize(dest->width, dest->height,
+                                     dest->channels * img_sample_size(dest));
   if (errno == ERANGE) {
     res = MALLOC_ERR;
     goto cleanup;
   }
-  if (dest->width * dest->height == 0) {
-    dest->img = NULL;
-    goto cleanup;
-  }
-  dest->img = malloc(imgbuf_size * sizeof(char));
-  if (!dest->img) {
-    res = MALLOC_ERR;
+  if (dest->width * dest->height == 0)
     goto cleanup;
+  if (imgbuf_size > *buf_size) {
+    t = trace_begin();
+    uint8_t *grown = realloc(*buf, imgbuf_size * sizeof(char));
+    if (!grown) {
+      res = MALLOC_ERR;
+      goto cleanup;
+    }
+    trace_end(TRACE_ALLOC, t, imgbuf_size);
+    *buf = grown;
+    *buf_size = imgbuf_size;
   }
+  dest->img = *buf;
 
+  t = trace_begin();
   switch (ptype) {
-  case P3_FILE:
+  case PLAIN_FILE:
     res = parse_file_p3(fp, dest, &lastln);
     break;
-  case P6_FILE:
+  case RAW_FILE:
     res = parse_file_p6(fp, dest, &lastln);
     break;
   }
+  trace_end(TRACE_DECODE, t,
+            dest->width * dest->height * dest->channels *
+                img_sample_size(dest));
 
 cleanup:
-  if (res != PARSE_OK && dest->img)
-    free(dest->img);
+  if (res != PARSE_OK)
+    dest->img = NULL;
   if (lastln.lineptr)
     free(lastln.lineptr);
   return res;
 }
 
-// Wrapper around parse_file_h() that does error handling
-int parse_file(FILE *fp, struct img_st *dest) {
-  enum parse_err res = parse_file_h(fp, dest);
-  if (res != PARSE_OK)
-    dest->img =
-        NULL; // It was already freed, make that clear by setting it to NULL
+enum parse_err parse_file_h(FILE *fp, struct img_st *dest) {
+  uint8_t *buf = NULL;
+  size_t buf_size = 0;
+  enum parse_err res = parse_file_reuse(fp, dest, &buf, &buf_size);
+  if (res != PARSE_OK && buf)
+    free(buf);
+  return res;
+}
+
+// Prints an error message for res
+// Return value:
+//   0 if res is PARSE_OK
+//   1 otherwise
+int report_parse_err(FILE *fp, enum parse_err res) {
   switch (res) {
   case PARSE_OK:
     return 0;
@@ -297,11 +944,15 @@ int parse_file(FILE *fp, struct img_st *dest) {
     fprintf(stderr, "Error parsing input file.\n");
     return 1;
   case NO_MAGIC_NUM:
-    fprintf(stderr, "Missing the magic number P6.\n");
+    fprintf(stderr, "Missing the magic number (P2, P3, P5, P6 or P7).\n");
     return 1;
   case WRONG_DEPTH:
-    fprintf(stderr, "Colour depth not 24 bit. This program only supports depth "
-                    "of 24 bit (maxval 255).\n");
+    fprintf(stderr, "Unsupported colour depth. maxval must be between 1 and "
+                    "65535.\n");
+    return 1;
+  case WRONG_CHANNELS:
+    fprintf(stderr, "Unsupported PAM depth. This program only supports 1 "
+                    "(grey), 3 (RGB) and 4 (RGBA) channels.\n");
     return 1;
   case MALLOC_ERR:
     fprintf(stderr, "Failed to allocate sufficient memory.\n");
@@ -320,15 +971,332 @@ int parse_file(FILE *fp, struct img_st *dest) {
   }
 }
 
-int write_img(FILE *fp, size_t width, size_t height, const uint8_t *img) {
-  if (fprintf(fp, "P6\n") < 0)
-    return 1;
-  if (fprintf(fp, "%zu %zu\n", width, height) < 0)
+// Wrapper around parse_file_h() that does error handling
+int parse_file(FILE *fp, struct img_st *dest) {
+  enum parse_err res = parse_file_h(fp, dest);
+  if (res != PARSE_OK)
+    dest->img =
+        NULL; // It was already freed, make that clear by setting it to NULL
+  return report_parse_err(fp, res);
+}
+
+struct img_stream_st {
+  FILE *fp;
+  enum parse_type ptype;
+  size_t channels;
+  size_t maxval;
+  struct line_info_st lastln;
+  // Binary raster: bytes that fgets() read together with the header
+  const char *leftover;
+  size_t leftover_size;
+  // Plain-text raster: read through this
+  struct p3_reader_st p3;
+};
+
+struct img_stream_st *stream_open(FILE *fp, struct img_st *dest) {
+  struct img_stream_st *st = malloc(sizeof(struct img_stream_st));
+  if (!st) {
+    report_parse_err(fp, MALLOC_ERR);
+    return NULL;
+  }
+  st->fp = fp;
+  st->p3.buf = NULL;
+  dest->img = NULL;
+  dest->map = NULL;
+  dest->map_size = 0;
+
+  const uint64_t t = trace_begin();
+  enum parse_err res = parse_file_start(fp, dest, &st->ptype, &st->lastln);
+  if (res == PARSE_OK)
+    trace_end(TRACE_HEADER, t, trace_on ? header_bytes(fp, &st->lastln) : 0);
+  if (res == PARSE_OK) {
+    // Same overflow checks as for parsing the whole file, although we never
+    // allocate the whole image
+    errno = 0;
+    input_imgsize(dest->width, dest->height,
+                  dest->channels * img_sample_size(dest));
+    if (errno == ERANGE)
+      res = MALLOC_ERR;
+  }
+  if (res == PARSE_OK && st->ptype == PLAIN_FILE)
+    res = p3_reader_init(&st->p3, fp, &st->lastln);
+  if (res != PARSE_OK) {
+    report_parse_err(fp, res);
+    stream_close(st);
+    return NULL;
+  }
+
+  st->channels = dest->channels;
+  st->maxval = dest->maxval;
+  if (st->ptype == RAW_FILE) {
+    st->leftover = st->lastln.linepos + 1;
+    st->leftover_size = raster_in_line(&st->lastln);
+  }
+  return st;
+}
+
+int stream_read_rows(struct img_stream_st *st, size_t width, uint8_t *dest,
+                     size_t rows) {
+  const size_t samples = st->channels * width * rows;
+  size_t size = samples * (st->maxval > 255 ? 2 : 1);
+  enum parse_err res = PARSE_OK;
+
+  const uint64_t t = trace_begin();
+  switch (st->ptype) {
+  case PLAIN_FILE:
+    res = read_samples_p3(&st->p3, dest, samples, st->maxval);
+    break;
+  case RAW_FILE: {
+    size_t from_line = st->leftover_size < size ? st->leftover_size : size;
+    memcpy(dest, st->leftover, from_line);
+    st->leftover += from_line;
+    st->leftover_size -= from_line;
+    if (fread(dest + from_line, 1, size - from_line, st->fp) <
+        size - from_line)
+      res = READ_ERR;
+    else if (st->maxval > 255)
+      swap16(dest, samples, dest);
+    break;
+  }
+  }
+  trace_end(TRACE_DECODE, t, size);
+  return report_parse_err(st->fp, res);
+}
+
+void stream_close(struct img_stream_st *st) {
+  if (st->lastln.lineptr)
+    free(st->lastln.lineptr);
+  if (st->p3.buf)
+    free(st->p3.buf);
+  free(st);
+}
+
+void free_img(struct img_st *img) {
+  if (img->map)
+    munmap(img->map, img->map_size);
+  else if (img->img)
+    free(img->img);
+  img->img = NULL;
+  img->map = NULL;
+}
+
+// Formats the header for write_img_header() or write_img_header_plain() into
+// buf, which has room for HEADER_SIZE bytes, and returns its length.
+#define HEADER_SIZE 128
+static size_t format_header(char *buf, size_t width, size_t height,
+                            size_t channels, size_t maxval, bool plain) {
+  int len;
+  if (channels == 4) {
+    // There is no PNM format for RGBA, and no plain PAM
+    len = snprintf(buf, HEADER_SIZE,
+                   "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH 4\nMAXVAL %zu\n"
+                   "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+                   width, height, maxval);
+  } else {
+    const char magic = plain ? (channels == 1 ? '2' : '3')
+                             : (channels == 1 ? '5' : '6');
+    len = snprintf(buf, HEADER_SIZE, "P%c\n%zu %zu\n%zu\n", magic, width,
+                   height, maxval);
+  }
+  // Three numbers of at most 20 digits always fit
+  return len;
+}
+
+int write_img_header(FILE *fp, size_t width, size_t height, size_t channels,
+                     size_t maxval) {
+  char buf[HEADER_SIZE];
+  size_t len = format_header(buf, width, height, channels, maxval, false);
+  const uint64_t t = trace_begin();
+  const int res = fwrite(buf, 1, len, fp) < len;
+  trace_end(TRACE_WRITE, t, len);
+  return res;
+}
+
+int write_raster(FILE *fp, const uint8_t *raster, size_t n, size_t maxval) {
+  uint64_t t = trace_begin();
+  if (maxval <= 255) {
+    const int res = n > 0 && fwrite(raster, 1, n, fp) < n;
+    trace_end(TRACE_WRITE, t, n);
+    return res;
+  }
+  // Swap to big endian through a buffer, the raster itself stays as it is
+  uint8_t buf[2 * SWAP_CHUNK_SAMPLES];
+  for (size_t i = 0; i < n; i += SWAP_CHUNK_SAMPLES) {
+    const size_t k = n - i < SWAP_CHUNK_SAMPLES ? n - i : SWAP_CHUNK_SAMPLES;
+    t = trace_begin();
+    swap16(raster + 2 * i, k, buf);
+    trace_end(TRACE_ENCODE, t, 2 * k);
+    t = trace_begin();
+    if (fwrite(buf, 2, k, fp) < k)
+      return 1;
+    trace_end(TRACE_WRITE, t, 2 * k);
+  }
+  return 0;
+}
+
+// Writes all of iov to fd, continuing after partial writes (e.g. to a pipe,
+// or beyond the 2 GiB Linux writes at most per call).
+static int writev_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t r = writev(fd, iov, n);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    for (; n > 0 && (size_t)r >= iov->iov_len; iov++, n--)
+      r -= iov->iov_len;
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return 0;
+}
+
+int write_img(FILE *fp, size_t width, size_t height, size_t channels,
+              size_t maxval, const uint8_t *img) {
+  char header[HEADER_SIZE];
+  size_t len = format_header(header, width, height, channels, maxval, false);
+  const size_t n = channels * width * height;
+  if (maxval > 255 || n == 0) {
+    // 16-bit samples need their bytes swapped on the way
+    const uint64_t t = trace_begin();
+    if (fwrite(header, 1, len, fp) < len)
+      return 1;
+    trace_end(TRACE_WRITE, t, len);
+    return write_raster(fp, img, n, maxval);
+  }
+  // Header and raster in one system call, straight from img: going through
+  // stdio would copy the whole raster into its buffer first. Whatever fp has
+  // buffered must go out before.
+  const uint64_t t = trace_begin();
+  if (fflush(fp))
     return 1;
-  if (fprintf(fp, "255\n") < 0)
+  struct iovec iov[2] = {{header, len}, {(void *)img, n}};
+  const int res = writev_all(fileno(fp), iov, 2);
+  trace_end(TRACE_WRITE, t, len + n);
+  return res;
+}
+
+int write_img_header_plain(FILE *fp, size_t width, size_t height,
+                           size_t channels, size_t maxval) {
+  if (channels == 4)
     return 1;
-  size_t img_size = 3 * width * height;
-  if (img_size > 0 && fwrite(img, 1, img_size, fp) < img_size)
+  char buf[HEADER_SIZE];
+  size_t len = format_header(buf, width, height, channels, maxval, true);
+  const uint64_t t = trace_begin();
+  const int res = fwrite(buf, 1, len, fp) < len;
+  trace_end(TRACE_WRITE, t, len);
+  return res;
+}
+
+// Decimal digits of 0 to 255 followed by a space, padded to 4 bytes (no
+// terminating 0), and the length of each without padding: "7 " is 2, "255 "
+// is 4
+static const char digit_chars[256][4] = {
+    "0 ", "1 ", "2 ", "3 ", "4 ", "5 ", "6 ", "7 ", "8 ", "9 ", "10 ", "11 ",
+    "12 ", "13 ", "14 ", "15 ", "16 ", "17 ", "18 ", "19 ", "20 ", "21 ", "22 ",
+    "23 ", "24 ", "25 ", "26 ", "27 ", "28 ", "29 ", "30 ", "31 ", "32 ", "33 ",
+    "34 ", "35 ", "36 ", "37 ", "38 ", "39 ", "40 ", "41 ", "42 ", "43 ", "44 ",
+    "45 ", "46 ", "47 ", "48 ", "49 ", "50 ", "51 ", "52 ", "53 ", "54 ", "55 ",
+    "56 ", "57 ", "58 ", "59 ", "60 ", "61 ", "62 ", "63 ", "64 ", "65 ", "66 ",
+    "67 ", "68 ", "69 ", "70 ", "71 ", "72 ", "73 ", "74 ", "75 ", "76 ", "77 ",
+    "78 ", "79 ", "80 ", "81 ", "82 ", "83 ", "84 ", "85 ", "86 ", "87 ", "88 ",
+    "89 ", "90 ", "91 ", "92 ", "93 ", "94 ", "95 ", "96 ", "97 ", "98 ", "99 ",
+    "100 ", "101 ", "102 ", "103 ", "104 ", "105 ", "106 ", "107 ", "108 ",
+    "109 ", "110 ", "111 ", "112 ", "113 ", "114 ", "115 ", "116 ", "117 ",
+    "118 ", "119 ", "120 ", "121 ", "122 ", "123 ", "124 ", "125 ", "126 ",
+    "127 ", "128 ", "129 ", "130 ", "131 ", "132 ", "133 ", "134 ", "135 ",
+    "136 ", "137 ", "138 ", "139 ", "140 ", "141 ", "142 ", "143 ", "144 ",
+    "145 ", "146 ", "147 ", "148 ", "149 ", "150 ", "151 ", "152 ", "153 ",
+    "154 ", "155 ", "156 ", "157 ", "158 ", "159 ", "160 ", "161 ", "162 ",
+    "163 ", "164 ", "165 ", "166 ", "167 ", "168 ", "169 ", "170 ", "171 ",
+    "172 ", "173 ", "174 ", "175 ", "176 ", "177 ", "178 ", "179 ", "180 ",
+    "181 ", "182 ", "183 ", "184 ", "185 ", "186 ", "187 ", "188 ", "189 ",
+    "190 ", "191 ", "192 ", "193 ", "194 ", "195 ", "196 ", "197 ", "198 ",
+    "199 ", "200 ", "201 ", "202 ", "203 ", "204 ", "205 ", "206 ", "207 ",
+    "208 ", "209 ", "210 ", "211 ", "212 ", "213 ", "214 ", "215 ", "216 ",
+    "217 ", "218 ", "219 ", "220 ", "221 ", "222 ", "223 ", "224 ", "225 ",
+    "226 ", "227 ", "228 ", "229 ", "230 ", "231 ", "232 ", "233 ", "234 ",
+    "235 ", "236 ", "237 ", "238 ", "239 ", "240 ", "241 ", "242 ", "243 ",
+    "244 ", "245 ", "246 ", "247 ", "248 ", "249 ", "250 ", "251 ", "252 ",
+    "253 ", "254 ", "255 "};
+static const uint8_t digit_len[256] = {
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4};
+
+// Writes v and a space to out, returns the number of bytes
+static size_t format_sample16(char *out, unsigned v) {
+  char digits[5];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  for (size_t i = 0; i < n; i++)
+    out[i] = digits[n - 1 - i];
+  out[n] = ' ';
+  return n + 1;
+}
+
+int write_raster_plain(FILE *fp, const uint8_t *raster, size_t row_samples,
+                       size_t rows, size_t maxval) {
+  const bool wide = maxval > 255;
+  char buf[PLAIN_CHUNK_SIZE + PLAIN_CHUNK_SLACK];
+  size_t used = 0;
+
+  // Every row of the image starts a new line. A chunk is one encode span,
+  // then one write span.
+  uint64_t begin = trace_begin();
+  for (size_t y = 0; y < rows; y++) {
+    for (size_t i = 0; i < row_samples; i += PLAIN_LINE_SAMPLES) {
+      if (used >= PLAIN_CHUNK_SIZE) {
+        trace_end(TRACE_ENCODE, begin, used);
+        begin = trace_begin();
+        if (fwrite(buf, 1, used, fp) < used)
+          return 1;
+        trace_end(TRACE_WRITE, begin, used);
+        used = 0;
+        begin = trace_begin();
+      }
+      const size_t first = y * row_samples + i;
+      const size_t end = first + (row_samples - i < PLAIN_LINE_SAMPLES
+                                      ? row_samples - i
+                                      : PLAIN_LINE_SAMPLES);
+      if (wide) {
+        const uint16_t *samples = (const uint16_t *)raster;
+        for (size_t k = first; k < end; k++)
+          used += format_sample16(buf + used, samples[k]);
+      } else {
+        // Always copy all 4 bytes, but only advance by the digits and space
+        for (size_t k = first; k < end; k++) {
+          memcpy(buf + used, digit_chars[raster[k]], 4);
+          used += digit_len[raster[k]];
+        }
+      }
+      buf[used - 1] = '\n';
+    }
+  }
+  trace_end(TRACE_ENCODE, begin, used);
+  begin = trace_begin();
+  const int res = used > 0 && fwrite(buf, 1, used, fp) < used;
+  trace_end(TRACE_WRITE, begin, used);
+  return res;
+}
+
+int write_img_plain(FILE *fp, size_t width, size_t height, size_t channels,
+                    size_t maxval, const uint8_t *img) {
+  if (write_img_header_plain(fp, width, height, channels, maxval))
     return 1;
-  return 0;
+  return write_raster_plain(fp, img, channels * width, height, maxval);
 }
@@ -1,12 +1,21 @@
 #ifndef IMG_ST_H
 #define IMG_ST_H
 
-// NOTE: We do not store colour depth.
-//       Since task statement says 24-bit color, we can assume depth is 255.
+// channels is 1 for grey (PGM), 3 for RGB (PPM) and 1, 3 or 4 for PAM, where 4
+// is RGBA; the pixels' channels are interleaved. maxval is the colour depth,
+// 1 to 65535. Samples are one byte up to maxval 255, and two bytes (uint16_t,
+// in host byte order) above, see img_sample_size().
+// If the raster was mapped from the input file instead of being read (see
+// parse_file_h()), map and map_size describe the mapping, and img points
+// into it. Use free_img() to release either kind.
 struct img_st {
   size_t width;
   size_t height;
   uint8_t *img;
+  void *map;
+  size_t map_size;
+  size_t channels;
+  size_t maxval;
 };
 #endif
 
@@ -20,7 +29,8 @@ enum parse_err {
   WRONG_DEPTH,
   MALLOC_ERR,
   OUT_OF_RANGE_ERR,
-  PIXEL_OOR
+  PIXEL_OOR,
+  WRONG_CHANNELS
 };
 #endif
 
@@ -31,11 +41,87 @@ enum parse_err {
 // exit on failure
 extern int parse_file(FILE *fp, struct img_st *dest);
 
+// Sets how many threads parse_file() and parse_file_h() may use to decode a
+// large plain-text (P2, P3) raster. The default is 1. Not thread-safe, call it
+// before parsing.
+extern void parse_set_threads(size_t threads);
+
+// Bytes per sample of img: 1 if img->maxval <= 255, 2 otherwise
+extern size_t img_sample_size(const struct img_st *img);
+
+// Bytes that may be read at img->img (parsed by parse_file() or
+// parse_file_h()): up to the end of the mapping, or the input_imgsize() of
+// the buffer the raster was read into.
+extern size_t img_readable_size(const struct img_st *img);
+
+// Writes img as P5 (1 channel), P6 (3 channels) or P7 (4 channels, RGBA) with
+// the given maxval. img holds samples as described for struct img_st. 8-bit
+// images are written with a single writev() of header and raster, bypassing
+// fp's buffer.
 // Return value:
 //   0 if completed without errors
 //   1 otherwise
-extern int write_img(FILE *fp, size_t width, size_t height, const uint8_t *img);
+extern int write_img(FILE *fp, size_t width, size_t height, size_t channels,
+                     size_t maxval, const uint8_t *img);
+
+// Only writes the header, the raster can then be written with write_raster().
+// Return value like write_img()
+extern int write_img_header(FILE *fp, size_t width, size_t height,
+                            size_t channels, size_t maxval);
+
+// Writes n samples, converting 16-bit ones (maxval > 255) to big endian, the
+// byte order of the file formats.
+// Return value like write_img()
+extern int write_raster(FILE *fp, const uint8_t *raster, size_t n,
+                        size_t maxval);
+
+// The same as plain text: P2 (1 channel) or P3 (3 channels), samples in
+// decimal, every row of the image on new lines. There is no plain format for
+// RGBA, these fail for 4 channels.
+// Return value like write_img()
+extern int write_img_plain(FILE *fp, size_t width, size_t height,
+                           size_t channels, size_t maxval, const uint8_t *img);
+extern int write_img_header_plain(FILE *fp, size_t width, size_t height,
+                                  size_t channels, size_t maxval);
+// Writes rows rows of row_samples samples each
+extern int write_raster_plain(FILE *fp, const uint8_t *raster,
+                              size_t row_samples, size_t rows, size_t maxval);
+
+// Streaming interface: parse the header only and read the raster row by row
+// afterwards, so the whole image never needs to be in memory.
+struct img_stream_st;
+
+// Parses the header of fp into dest->width, dest->height, dest->channels and
+// dest->maxval (dest->img is set to NULL). Returns NULL on failure, after
+// printing an error message like parse_file() does.
+extern struct img_stream_st *stream_open(FILE *fp, struct img_st *dest);
+
+// Reads the next <rows> rows of the raster into dest.
+// Return value:
+//   0 if reading succeeded
+//   1 otherwise, after printing an error message
+extern int stream_read_rows(struct img_stream_st *st, size_t width,
+                            uint8_t *dest, size_t rows);
+
+extern void stream_close(struct img_stream_st *st);
 
 // This function needs to be exposed so that the tests can check for a specific
 // error
 enum parse_err parse_file_h(FILE *fp, struct img_st *dest);
+
+// Same as parse_file_h(), but reads the raster into *buf, which has room for
+// *buf_size bytes and is grown with realloc() if necessary. This way, a buffer
+// can be reused for many images. Afterwards, dest->img is either NULL, *buf,
+// or (if dest->map is set) points into a mapping that free_img() releases.
+// *buf stays valid and must be freed by the caller, even on failure.
+enum parse_err parse_file_reuse(FILE *fp, struct img_st *dest, uint8_t **buf,
+                                size_t *buf_size);
+
+// Prints an error message for res (nothing for PARSE_OK)
+// Return value:
+//   0 if res is PARSE_OK
+//   1 otherwise
+extern int report_parse_err(FILE *fp, enum parse_err res);
+
+// Frees the raster of an image returned by parse_file() or parse_file_h()
+extern void free_img(struct img_st *img);
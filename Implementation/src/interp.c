@@ -0,0 +1,281 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interp.h"
+#include "parallel.h"
+#include "scale.h"
+#include "util.h"
+
+// Largest maxval the formats allow
+#define MAX_MAXVAL 65535
+
+// Bytes the input needs after the last pixel. The SIMD kernels load whole
+// vectors, and the last load of a row may start at its last pixel; none of
+// them reads more than 16 bytes past the raster, this leaves some room.
+#define INPUT_PADDING 64
+
+// Scratch buffers, grown as needed:
+//   pad: input that isn't padded, or the source pixels around a ROI
+//   roi: the scaled source pixels around a ROI
+struct interp_ctx_st {
+  struct scale_pool_st *pool;
+  size_t version;
+  uint8_t *pad;
+  size_t pad_size;
+  uint8_t *roi;
+  size_t roi_size;
+};
+
+// Return value:
+//   *buf, grown to at least size bytes if it was smaller
+//   NULL if allocating memory failed
+static uint8_t *scratch(uint8_t **buf, size_t *buf_size, size_t size) {
+  if (size > *buf_size) {
+    uint8_t *grown = realloc(*buf, size);
+    if (!grown)
+      return NULL;
+    *buf = grown;
+    *buf_size = size;
+  }
+  return *buf;
+}
+
+// Contexts that exist. Freeing the last one frees the tables of the scale
+// factors they used (see scale_plans_free()), so that a library user who is
+// done scaling doesn't keep them until the process exits.
+static pthread_mutex_t ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t ctx_count;
+
+struct interp_ctx_st *interp_ctx_new(size_t threads) {
+  struct interp_ctx_st *ctx = calloc(1, sizeof(struct interp_ctx_st));
+  if (!ctx)
+    return NULL;
+  const int saved = errno;
+  ctx->pool = scale_pool_new(threads);
+  errno = saved;
+  if (!ctx->pool) {
+    free(ctx);
+    return NULL;
+  }
+  pthread_mutex_lock(&ctx_lock);
+  ctx_count++;
+  pthread_mutex_unlock(&ctx_lock);
+  return ctx;
+}
+
+void interp_ctx_free(struct interp_ctx_st *ctx) {
+  if (!ctx)
+    return;
+  scale_pool_free(ctx->pool);
+  free(ctx->pad);
+  free(ctx->roi);
+  free(ctx);
+  pthread_mutex_lock(&ctx_lock);
+  if (!--ctx_count)
+    scale_plans_free();
+  pthread_mutex_unlock(&ctx_lock);
+}
+
+enum interp_err interp_set_version(struct interp_ctx_st *ctx,
+                                   size_t version) {
+  if (!ctx || version > MAX_IMPLEMENTATION)
+    return INTERP_EINVAL;
+  ctx->version = version;
+  return INTERP_OK;
+}
+
+// Bytes per sample of img, 0 if img is invalid
+static size_t sample_size(const struct interp_image_st *img) {
+  if (!img || (img->channels != 1 && img->channels != CHANNELS &&
+               img->channels != 4))
+    return 0;
+  if (img->maxval == 0 || img->maxval > MAX_MAXVAL)
+    return 0;
+  return img->maxval > 255 ? 2 : 1;
+}
+
+enum interp_err interp_output_size(const struct interp_image_st *img,
+                                   size_t scale_factor, size_t *size) {
+  const size_t ss = sample_size(img);
+  if (!ss || scale_factor == 0 || !size)
+    return INTERP_EINVAL;
+  const int saved = errno;
+  errno = 0;
+  *size = output_imgsize(img->width, img->height, scale_factor,
+                         img->channels * ss);
+  const bool overflow = errno == ERANGE;
+  errno = saved;
+  return overflow ? INTERP_ERANGE : INTERP_OK;
+}
+
+enum interp_err interp_input_size(const struct interp_image_st *img,
+                                  size_t *size) {
+  const size_t ss = sample_size(img);
+  if (!ss || !size)
+    return INTERP_EINVAL;
+  size_t raster_size;
+  if (__builtin_mul_overflow(img->width, img->height, &raster_size) ||
+      __builtin_mul_overflow(raster_size, img->channels * ss, &raster_size) ||
+      __builtin_add_overflow(raster_size, INPUT_PADDING, size))
+    return INTERP_ERANGE;
+  return INTERP_OK;
+}
+
+// Scales the padded raster src with the implementation ctx asks for, or the
+// one pick_version() picks
+static enum interp_err scale_raster(struct interp_ctx_st *ctx,
+                                    const uint8_t *src, size_t width,
+                                    size_t height, size_t channels, size_t ss,
+                                    size_t scale_factor, uint8_t *out) {
+  const size_t version =
+      ctx->version ? ctx->version
+                   : pick_version(scale_factor, width, channels, ss);
+  if (!scale_usable(version, scale_factor, width, channels, ss))
+    return INTERP_ENOTSUP;
+  void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+              size_t) = scale_band_fun(version, channels, ss);
+
+  // The kernels report failed allocations through errno; keep that inside
+  const int saved = errno;
+  errno = 0;
+  scale_pool_rows(ctx->pool, fun, src, width, height, scale_factor, out, 0,
+                  height);
+  const enum interp_err res = errno == ENOMEM ? INTERP_ENOMEM : INTERP_OK;
+  errno = saved;
+  return res;
+}
+
+enum interp_err interp_scale(struct interp_ctx_st *ctx,
+                             const struct interp_image_st *img,
+                             size_t scale_factor, uint8_t *out,
+                             size_t out_size) {
+  size_t size_out, size_in;
+  enum interp_err res = interp_output_size(img, scale_factor, &size_out);
+  if (res == INTERP_OK)
+    res = interp_input_size(img, &size_in);
+  if (res != INTERP_OK)
+    return res;
+  if (!ctx)
+    return INTERP_EINVAL;
+  if (out_size < size_out)
+    return INTERP_ESIZE;
+  if (img->width * img->height == 0)
+    return INTERP_OK;
+  const size_t ss = sample_size(img);
+  const size_t raster_size = img->width * img->height * img->channels * ss;
+  if (!img->data || !out || img->size < raster_size)
+    return INTERP_EINVAL;
+
+  const uint8_t *src = img->data;
+  if (img->size < size_in) {
+    if (!scratch(&ctx->pad, &ctx->pad_size, size_in))
+      return INTERP_ENOMEM;
+    memcpy(ctx->pad, img->data, raster_size);
+    // The padding only feeds lanes whose results are thrown away, but keep
+    // it defined
+    memset(ctx->pad + raster_size, 0, size_in - raster_size);
+    src = ctx->pad;
+  }
+  return scale_raster(ctx, src, img->width, img->height, img->channels, ss,
+                      scale_factor, out);
+}
+
+enum interp_err interp_scale_roi(struct interp_ctx_st *ctx,
+                                 const struct interp_image_st *img,
+                                 size_t scale_factor,
+                                 const struct interp_roi_st *roi, uint8_t *out,
+                                 size_t out_size) {
+  size_t size_out;
+  enum interp_err res = interp_output_size(img, scale_factor, &size_out);
+  if (res != INTERP_OK)
+    return res;
+  if (!ctx || !roi)
+    return INTERP_EINVAL;
+  // interp_output_size() has checked that the products fit
+  const size_t width_out = img->width * scale_factor;
+  const size_t height_out = img->height * scale_factor;
+  if (roi->x > width_out || roi->width > width_out - roi->x ||
+      roi->y > height_out || roi->height > height_out - roi->y)
+    return INTERP_EINVAL;
+  const size_t ss = sample_size(img);
+  const size_t px = img->channels * ss;
+  if (roi->width * roi->height == 0)
+    return INTERP_OK;
+  if (out_size / px / roi->width < roi->height)
+    return INTERP_ESIZE;
+  const size_t raster_size = img->width * img->height * px;
+  if (!img->data || !out || img->size < raster_size)
+    return INTERP_EINVAL;
+
+  // Output pixel X lies between source columns X / s and X / s + 1, or in
+  // the last column, which gets the boundary treatment. Scaling the source
+  // pixels from the first of these to the last (and no further) gives the
+  // same pixels for the ROI as scaling the whole image. Some kernels need at
+  // least two columns, so take one more to the left if necessary.
+  const size_t s = scale_factor;
+  size_t x0 = roi->x / s;
+  size_t x1 = (roi->x + roi->width - 1) / s + 1;
+  if (x1 > img->width - 1)
+    x1 = img->width - 1;
+  if (x1 == x0 && x0 > 0)
+    x0--;
+  size_t y0 = roi->y / s;
+  size_t y1 = (roi->y + roi->height - 1) / s + 1;
+  if (y1 > img->height - 1)
+    y1 = img->height - 1;
+  if (y1 == y0 && y0 > 0)
+    y0--;
+  const size_t crop_width = x1 - x0 + 1, crop_height = y1 - y0 + 1;
+
+  struct interp_image_st crop = {crop_width, crop_height, img->channels,
+                                 img->maxval, NULL, 0};
+  size_t crop_in, crop_out;
+  res = interp_input_size(&crop, &crop_in);
+  if (res == INTERP_OK)
+    res = interp_output_size(&crop, s, &crop_out);
+  if (res != INTERP_OK)
+    return res;
+  if (!scratch(&ctx->pad, &ctx->pad_size, crop_in) ||
+      !scratch(&ctx->roi, &ctx->roi_size, crop_out))
+    return INTERP_ENOMEM;
+  for (size_t y = 0; y < crop_height; y++)
+    memcpy(ctx->pad + y * crop_width * px,
+           img->data + ((y0 + y) * img->width + x0) * px, crop_width * px);
+  memset(ctx->pad + crop_width * crop_height * px, 0,
+         crop_in - crop_width * crop_height * px);
+
+  res = scale_raster(ctx, ctx->pad, crop_width, crop_height, img->channels,
+                     ss, s, ctx->roi);
+  if (res != INTERP_OK)
+    return res;
+  const size_t crop_row = crop_width * s * px;
+  const uint8_t *from =
+      ctx->roi + (roi->y - y0 * s) * crop_row + (roi->x - x0 * s) * px;
+  for (size_t y = 0; y < roi->height; y++)
+    memcpy(out + y * roi->width * px, from + y * crop_row, roi->width * px);
+  return INTERP_OK;
+}
+
+const char *interp_strerror(enum interp_err err) {
+  switch (err) {
+  case INTERP_OK:
+    return "Success";
+  case INTERP_EINVAL:
+    return "Invalid argument";
+  case INTERP_ENOTSUP:
+    return "The implementation doesn't support this image or scale factor "
+           "on this CPU";
+  case INTERP_ERANGE:
+    return "Output size out of range for size_t";
+  case INTERP_ESIZE:
+    return "Output buffer too small";
+  case INTERP_ENOMEM:
+    return "Failed to allocate memory";
+  default:
+    return "Unknown error";
+  }
+}
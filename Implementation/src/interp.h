@@ -0,0 +1,114 @@
+// libinterp: the scaler as a library, for programs that want to scale images
+// in-process. This is its whole public interface; everything else in src/ is
+// internal. Build it with `make lib` (libinterp.a and libinterp.so).
+//
+// A context holds what scaling many images can reuse: a pool of threads and
+// a scratch buffer for input that needs padding. The tables the
+// implementations precompute per scale factor are cached process-wide, and
+// shared by all contexts. A context must only be used by one thread at a
+// time; use one per thread to scale images concurrently.
+//
+// Errors are returned, nothing is printed, and errno is left alone.
+
+#ifndef INTERP_H
+#define INTERP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define INTERP_API __attribute__((visibility("default")))
+#else
+#define INTERP_API
+#endif
+
+enum interp_err {
+  INTERP_OK = 0,
+  // An argument is invalid: NULL, scale factor 0, channels other than 1, 3
+  // or 4, maxval not between 1 and 65535, or no such implementation
+  INTERP_EINVAL,
+  // The implementation can't scale images with these channels or this depth,
+  // by this scale factor (see scale_max_factor() in scale.h) or images this
+  // narrow, or the CPU lacks the instructions it needs
+  INTERP_ENOTSUP,
+  // The output size doesn't fit into size_t
+  INTERP_ERANGE,
+  // The output buffer is smaller than interp_output_size()
+  INTERP_ESIZE,
+  // Allocating memory or starting threads failed
+  INTERP_ENOMEM
+};
+
+// An image: width x height pixels of `channels` interleaved samples each
+// (1 grey, 3 RGB, 4 RGBA), rows without padding. Up to maxval 255, a sample
+// is a byte; above, it is a uint16_t in host byte order. size is the number
+// of bytes at data.
+struct interp_image_st {
+  size_t width;
+  size_t height;
+  size_t channels;
+  size_t maxval;
+  const uint8_t *data;
+  size_t size;
+};
+
+struct interp_ctx_st;
+
+// Creates a context that scales with `threads` threads (0 is the same as 1).
+// Return value:
+//   the context, to be freed with interp_ctx_free()
+//   NULL if allocating memory failed
+INTERP_API extern struct interp_ctx_st *interp_ctx_new(size_t threads);
+// Freeing the last context also frees the tables the contexts share.
+INTERP_API extern void interp_ctx_free(struct interp_ctx_st *ctx);
+
+// Makes ctx use implementation number <version> (1-based, like --version of
+// the command line tool). 0, the default, picks the fastest one for each
+// image.
+INTERP_API extern enum interp_err interp_set_version(struct interp_ctx_st *ctx,
+                                                     size_t version);
+
+// Stores the size of the buffer interp_scale() needs for img scaled by
+// scale_factor in *size. It is a few bytes more than the scaled image.
+INTERP_API extern enum interp_err
+interp_output_size(const struct interp_image_st *img, size_t scale_factor,
+                   size_t *size);
+
+// Stores the size of the buffer img->data would need for interp_scale() to
+// read it in place in *size: the raster and a few bytes, since the kernels
+// load whole vectors and read a little past the last pixel. Smaller input is
+// copied to ctx's scratch buffer first.
+INTERP_API extern enum interp_err
+interp_input_size(const struct interp_image_st *img, size_t *size);
+
+// Scales img by scale_factor into out, which has room for out_size bytes.
+// The result has the same channels and maxval as img, width and height are
+// multiplied by scale_factor.
+INTERP_API extern enum interp_err
+interp_scale(struct interp_ctx_st *ctx, const struct interp_image_st *img,
+             size_t scale_factor, uint8_t *out, size_t out_size);
+
+// A rectangle of the scaled image, in output pixels
+struct interp_roi_st {
+  size_t x;
+  size_t y;
+  size_t width;
+  size_t height;
+};
+
+// Scales only the part of img scaled by scale_factor that roi covers, and
+// writes it to out as an image of roi->width x roi->height pixels (rows
+// without padding). out needs room for that many pixels. The pixels are the
+// same as interp_scale() would produce there, including the last row and
+// column, but the work depends on the size of roi, not of the whole output:
+// only the source pixels around roi are scaled. roi must lie within the
+// scaled image (INTERP_EINVAL otherwise).
+INTERP_API extern enum interp_err
+interp_scale_roi(struct interp_ctx_st *ctx, const struct interp_image_st *img,
+                 size_t scale_factor, const struct interp_roi_st *roi,
+                 uint8_t *out, size_t out_size);
+
+// A description of err, e.g. for error messages
+INTERP_API extern const char *interp_strerror(enum interp_err err);
+
+#endif
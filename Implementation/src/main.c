@@ -9,34 +9,93 @@
 #include <string.h>
 #include <time.h>
 
+#include "batch.h"
+#include "bench.h"
 #include "file_parsing.h"
+#include "interp.h"
+#include "outbuf.h"
+#include "parallel.h"
+#include "resize.h"
 #include "scale.h"
+#include "stream.h"
 #include "test.h"
 #include "timing.h"
+#include "trace.h"
+#include "tune.h"
 #include "util.h"
 
 // Since we're passing the almost same parameters in every switch case, define a
 // macro
 #define TIMING_LOOP(FUN)                                                       \
-  if (timing_loop(&total, do_timing, timing_repeats, FUN, inimg.img,           \
-                  inimg.width, inimg.height, scale_factor, scaled_img))        \
+  if (timing_loop(&stats, do_timing, warmup, timing_repeats, NULL, FUN,        \
+                  threads, inimg.img, inimg.width, inimg.height, scale_factor, \
+                  scaled_img))                                                 \
     goto cleanup;
 
+// Upper bound for the lists --scale_factor and --version take with --bench
+#define MAX_LIST 32
+
+// --autotune's defaults: scale factors, and how often to time each one
+static const size_t tune_factors[] = {2, 3, 4, 8, 16, 32};
+#define TUNE_REPEATS 5
+
 const char *help_text = "\
 Usage: %s [options] file.ppm\n\
-Valid options are:\n\
+       %s --batch [options] [file.ppm...]\n\
+       %s --bench [options] file.ppm...\n\
+       %s --autotune [options]\n\
+Input files can be PPM (P3, P6), PGM (P2, P5) or PAM (P7) with 1, 3 or 4 channels and a maxval up to 65535 (16 bit); the output has as many channels and the same maxval as the input.\n\
+Valid options are:\n";
+
+// The options, in parts since C compilers only need to support string literals
+// of up to 4095 characters. Printed as they are, not as printf() formats.
+const char *const help_options[] = {"\
+--autotune|-A\n\
+\tMeasure which implementation and thread count scale fastest on this machine, for grey, RGB and RGBA images of 8 and 16 bit in a few sizes, at the factors given with --scale_factor (a list, by default 2,3,4,8,16,32) and with up to --threads threads (by default all CPUs). --time sets the repeats, by default 5. The winners are saved to $INTERP_TUNE_FILE, or to tune-<hostname> in $XDG_CACHE_HOME/interp (by default ~/.cache/interp). Afterwards, scaling an image without --version uses the implementation this table has for the closest size, and without --threads its thread count, too.\n\
+--batch|-b\n\
+\tScale every file given on the command line (and in the --manifest) in one process. The files are spread across --threads worker threads; if one fails, the others are still scaled.\n\
+--trace|-x <filename>\n\
+\tRecord how long each stage takes (opening the files, parsing the header, decoding the raster, allocating, scaling, encoding and writing the output) and how many bytes it processes, and write the spans to <filename> as a Chrome trace-event file (for chrome://tracing or Perfetto). Can't be combined with --autotune, --batch or --bench.\n\
+--trace_summary|-X\n\
+\tThe same, but print the totals per stage as one line of JSON on stderr.\n\
 --time|-B [repeats]\n\
-\tMeasure how much time the scaling took. The call to the scaling function is iterated [repeats] times, by default 100.\n\
+\tMeasure how much time the scaling took. The call to the scaling function is iterated [repeats] times, by default 100, and each call is timed. Prints the total, min/median/p95/p99 per call and the throughput at the median.\n\
+--bench|-M\n\
+\tMeasure every implementation given with --version (a comma-separated list, by default all) at every scale factor given with --scale_factor (also a list) on each input file, and write the results as CSV or JSON to --out (by default stdout). --time sets the repeats.\n\
+--counters|-C\n\
+\tWith --bench, also count cycles, instructions, L1 data cache, last level cache, branch and data TLB misses of every timed call with the CPU's performance counters, and add them per call to the results, with the instructions per cycle, output bytes per cycle and cycles per output pixel. Counters that aren't available (e.g. in a virtual machine) are left empty.\n\
+--cpu|-c <cpu>\n\
+\tWith --time or --bench, pin the process to CPU number <cpu>. With --threads, all threads run on that CPU.\n\
+--format|-F <csv|json>\n\
+\tOutput format of --bench, by default csv.\n\
 --help|-h\n\
 \tShow this help message and exit.\n\
+--manifest|-m <filename>\n\
+\tWith --batch, also scale the files listed in <filename>, one per line. - reads the list from stdin.\n\
+", "\
 --out|-o <filename>\n\
 \tWrite the image to <filename>. Without this option, it is written to out.ppm in the current directory.\n\
+\tWith --batch, every %s in <filename> is replaced by the input's name without directory and .ppm extension; if there is no %s, <filename> is a directory to write the images to. By default, %s_scaled.ppm.\n\
+--resize|-R <size or factors>\n\
+\tInstead of scaling by an integer factor, resize the image to <width>x<height> (e.g. 1920x1080), by a factor (e.g. 1.5 or 3/2), or by a factor per axis (e.g. 4:3). Can't be combined with --batch, --bench, --stream, --threads, --time or --version.\n\
+--roi|-r <x>,<y>,<width>,<height>\n\
+\tOnly compute and write the <width>x<height> pixels of the scaled image whose top left corner is at <x>,<y>. Only the source pixels around them are scaled, so this takes time in proportion to their number, not to the size of the whole scaled image. Can't be combined with --batch, --bench, --resize, --stream or --time.\n\
 --scale_factor|-f <factor>\n\
 \tScale the image by <factor>.\n\
+--plain|-p\n\
+\tWrite the output as plain text (P2 or P3) instead of binary (P5 or P6). Not possible for RGBA images, and can't be combined with --batch.\n\
+--small_pages|-P\n\
+\tAllocate the output image on normal 4 KiB pages. By default, large outputs are put on 2 MiB huge pages, which saves TLB misses while they are written; this is for comparing the two with --time or --bench.\n\
+--stream|-S\n\
+\tRead, scale and write the image a few rows at a time instead of keeping all of it in memory. Can't be combined with --time.\n\
 --test|-t\n\
 \tInstead of scaling an image, run the automated tests and exit.\n\
+--warmup|-W <runs>\n\
+\tWith --time or --bench, call the scaling function <runs> times before measuring, by default 1.\n\
+--threads|-T <threads>\n\
+\tSplit the scaling across <threads> threads, by default 1. Large plain-text (P2, P3) input files are decoded with that many threads, too. With --batch, the number of files scaled at the same time.\n\
 --version|-V <version>\n\
-\tSelect a specific implementation of the scale function.\n";
+\tSelect a specific implementation of the scale function.\n"};
 
 // Wrapper function around strtosizet() from util.c that handles parsing errors
 // Return value:
@@ -61,6 +120,161 @@ int strtosizet_wrapper(char *src, size_t *dest, const char *name) {
   return 0;
 }
 
+// Parses a comma-separated list of at most MAX_LIST numbers, like
+// strtosizet_wrapper() does for a single one. Modifies src.
+// Return value:
+//   0 if parsing successful
+//   1 otherwise
+int parse_list(char *src, size_t *dest, size_t *n, const char *name) {
+  *n = 0;
+  for (char *tok = strtok(src, ","); tok; tok = strtok(NULL, ",")) {
+    if (*n == MAX_LIST) {
+      fprintf(stderr, "Error processing --%s: More than %d values.\n", name,
+              MAX_LIST);
+      return 1;
+    }
+    if (strtosizet_wrapper(tok, &dest[(*n)++], name))
+      return 1;
+  }
+  if (*n == 0) {
+    fprintf(stderr, "Error processing --%s: Argument empty.\n", name);
+    return 1;
+  }
+  return 0;
+}
+
+// Parses the x,y,width,height of --roi into roi
+// Return value:
+//   0 if parsing successful
+//   1 otherwise, after printing an error message
+static int parse_roi(char *src, struct interp_roi_st *roi) {
+  size_t vals[MAX_LIST], n;
+  if (parse_list(src, vals, &n, "roi"))
+    return 1;
+  if (n != 4) {
+    fprintf(stderr, "Error processing --roi: Expected <x>,<y>,<width>,"
+                    "<height>.\n");
+    return 1;
+  }
+  *roi = (struct interp_roi_st){vals[0], vals[1], vals[2], vals[3]};
+  return 0;
+}
+
+// Returns the band function of implementation <version> for img, or of the
+// default one if version is 0.
+// Return value:
+//   the function
+//   NULL if the implementation can't scale img by scale_factor (see
+//   scale_usable()), after printing an error message
+void (*band_fun(size_t version, size_t scale_factor, const struct img_st *img))(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t, size_t) {
+  const size_t ss = img_sample_size(img);
+  if (version == 0)
+    version = pick_version(scale_factor, img->width, img->channels, ss);
+  if (!scale_usable(version, scale_factor, img->width, img->channels, ss)) {
+    report_unusable(version, scale_factor, img->channels, ss);
+    return NULL;
+  }
+  return scale_band_fun(version, img->channels, ss);
+}
+
+// Scales img into result (size_out bytes) through the library, see interp.h;
+// only the part roi covers unless roi is NULL.
+// Return value:
+//   0 if successful
+//   1 otherwise, after printing an error message
+static int scale_img(const struct interp_image_st *img, size_t scale_factor,
+                     const struct interp_roi_st *roi, size_t version,
+                     size_t threads, uint8_t *result, size_t size_out) {
+  struct interp_ctx_st *ctx = interp_ctx_new(threads);
+  enum interp_err err = ctx ? interp_set_version(ctx, version) : INTERP_ENOMEM;
+  if (err == INTERP_OK && roi)
+    err = interp_scale_roi(ctx, img, scale_factor, roi, result, size_out);
+  else if (err == INTERP_OK)
+    err = interp_scale(ctx, img, scale_factor, result, size_out);
+  interp_ctx_free(ctx);
+  if (err == INTERP_ENOTSUP) {
+    report_unusable(version, scale_factor, img->channels,
+                 img->maxval > 255 ? 2 : 1);
+    return 1;
+  } else if (err != INTERP_OK) {
+    fprintf(stderr, "Error: %s.\n", interp_strerror(err));
+    return 1;
+  }
+  return 0;
+}
+
+// Without --version, takes the implementation the autotune table (see
+// tune.h) has for images like img, and without --threads its thread count,
+// too. Leaves both alone if there is no table for this host, or no entry
+// that can scale img.
+static void apply_tuning(const struct img_st *img, size_t scale_factor,
+                         size_t *version, size_t *threads, bool threads_set) {
+  if (*version || img->width * img->height == 0)
+    return;
+  char path[TUNE_PATH_MAX];
+  struct tune_table_st table = {NULL, 0, 0};
+  const int saved = errno;
+  if (!tune_path(path, sizeof(path)) && !tune_load(&table, path)) {
+    const struct tune_entry_st *e = tune_lookup(&table, img, scale_factor);
+    if (e && scale_usable(e->version, scale_factor, img->width,
+                          img->channels, img_sample_size(img))) {
+      *version = e->version;
+      if (!threads_set)
+        *threads = e->threads;
+    }
+    tune_free(&table);
+  }
+  errno = saved;
+}
+
+// Return value:
+//   0 if img can be written as --plain asks for
+//   1 if plain is set but img is RGBA, after printing an error message
+static int plain_unsupported(bool plain, const struct img_st *img) {
+  if (plain && img->channels == 4) {
+    fprintf(stderr, "Error: --plain can't write RGBA images, there is no "
+                    "plain-text PAM.\n");
+    return 1;
+  }
+  return 0;
+}
+
+// fclose() for the output file, which writes out what stdio still buffers
+// Return value:
+//   EXIT_SUCCESS if successful
+//   EXIT_FAILURE if writing failed, after printing an error message
+static int close_output(FILE *fp) {
+  const uint64_t t = trace_begin();
+  const int res = fclose(fp);
+  trace_end(TRACE_WRITE, t, 0);
+  if (res) {
+    fprintf(stderr, "Error writing to output file.\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Writes what --trace and --trace_summary ask for, if tracing is on, and
+// stops it.
+// Return value:
+//   status, or EXIT_FAILURE if writing the trace failed
+static int trace_finish(const char *trace_file, bool summary, int status) {
+  if (!trace_on)
+    return status;
+  if (summary)
+    trace_summary(stderr);
+  if (trace_file) {
+    FILE *fp = fopen(trace_file, "w");
+    if (!fp || trace_write_chrome(fp) | fclose(fp)) {
+      perror("Error writing the trace file");
+      status = EXIT_FAILURE;
+    }
+  }
+  trace_stop();
+  return status;
+}
+
 int main(int argc, char **argv) {
 
 
@@ -69,42 +283,120 @@ int main(int argc, char **argv) {
   size_t use_version = 0;
   bool do_timing = false;
   bool run_tests = false;
+  bool streaming = false;
+  bool batch = false;
+  char *manifest = NULL;
+  bool bench = false;
+  bool json = false;
+  bool huge_pages = true;
+  bool plain = false;
+  bool pin = false;
+  size_t cpu = 0;
+  size_t warmup = 1;
+  size_t factors[MAX_LIST] = {1};
+  size_t n_factors = 1;
+  size_t versions[MAX_LIST] = {0};
+  size_t n_versions = 1;
+  bool resizing = false;
+  bool use_roi = false;
+  bool autotune = false;
+  bool factors_set = false;
+  bool threads_set = false;
+  bool counters = false;
+  char *trace_file = NULL;
+  bool trace_summary_on = false;
+  struct interp_roi_st roi;
+  struct resize_spec_st resize_spec;
   size_t timing_repeats = 100;
+  size_t threads = 1;
   char *name_in;
-  char *name_out = "out.ppm";
+  char *name_out = NULL;
 
   FILE *infile = NULL;
   FILE *outfile = NULL;
-  struct img_st inimg = {0, 0, NULL};
+  struct img_st inimg = {0, 0, NULL, NULL, 0, 0, 0};
+  struct outbuf_st out_buf = {NULL, 0, 0};
   uint8_t *scaled_img = NULL;
 
   // Process options with getopt()
   int option_index = 0;
   const char *optstring =
-      ":B::ho:f:V:"; // : at the beginning of optstring causes getopt() to
+      ":AbB::Cc:F:hMm:o:pPf:r:R:ST:V:W:x:X"; // : at the beginning of optstring causes getopt() to
                      // distinguish between missing argument for option and
                      // unknown option; see man getopt(1)
   static struct option long_options[] = {
+      {"autotune", no_argument, NULL, 'A'},
+      {"batch", no_argument, NULL, 'b'},
       {"time", required_argument , NULL, 'B'},
+      {"bench", no_argument, NULL, 'M'},
+      {"counters", no_argument, NULL, 'C'},
+      {"cpu", required_argument, NULL, 'c'},
+      {"format", required_argument, NULL, 'F'},
       {"help", no_argument, NULL, 'h'},
+      {"manifest", required_argument, NULL, 'm'},
       {"out", required_argument, NULL, 'o'},
+      {"plain", no_argument, NULL, 'p'},
+      {"small_pages", no_argument, NULL, 'P'},
+      {"resize", required_argument, NULL, 'R'},
+      {"roi", required_argument, NULL, 'r'},
       {"scale_factor", required_argument, NULL, 'f'},
+      {"stream", no_argument, NULL, 'S'},
       {"test", no_argument, NULL, 't'},
+      {"threads", required_argument, NULL, 'T'},
+      {"trace", required_argument, NULL, 'x'},
+      {"trace_summary", no_argument, NULL, 'X'},
       {"version", required_argument, NULL, 'V'},
+      {"warmup", required_argument, NULL, 'W'},
       {0, 0, NULL, 0}};
   for (char c = getopt_long(argc, argv, optstring, long_options, &option_index);
        c != -1;
        c = getopt_long(argc, argv, optstring, long_options, &option_index)) {
 
     switch (c) {
+    case 'A':
+      autotune = true;
+      break;
+    case 'b':
+      batch = true;
+      break;
     case 'B':
       do_timing = true;
       if (optarg && strtosizet_wrapper(optarg, &timing_repeats, "time"))
         return EXIT_FAILURE;
       break;
+    case 'C':
+      counters = true;
+      break;
+    case 'c':
+      if (strtosizet_wrapper(optarg, &cpu, "cpu"))
+        return EXIT_FAILURE;
+      pin = true;
+      break;
+    case 'F':
+      if (!strcmp(optarg, "json")) {
+        json = true;
+      } else if (!strcmp(optarg, "csv")) {
+        json = false;
+      } else {
+        fprintf(stderr, "Error processing --format: Must be csv or json.\n");
+        return EXIT_FAILURE;
+      }
+      break;
     case 'h':
-      printf(help_text, argv[0]);
+      printf(help_text, argv[0], argv[0], argv[0], argv[0]);
+      for (size_t i = 0; i < sizeof(help_options) / sizeof(help_options[0]); i++)
+        fputs(help_options[i], stdout);
       return EXIT_SUCCESS;
+    case 'M':
+      bench = true;
+      break;
+    case 'm':
+      if (!strlen(optarg)) {
+        fprintf(stderr, "Error processing --manifest: Filename empty.\n");
+        return EXIT_FAILURE;
+      }
+      manifest = optarg;
+      break;
     case 'o':
       if (!strlen(optarg)) {
         fprintf(stderr, "Error processing --out: Filename empty.\n");
@@ -112,20 +404,73 @@ int main(int argc, char **argv) {
       }
       name_out = optarg;
       break;
+    case 'p':
+      plain = true;
+      break;
+    case 'P':
+      huge_pages = false;
+      break;
     case 'f':
-      if (strtosizet_wrapper(optarg, &scale_factor, "scale_factor"))
+      if (parse_list(optarg, factors, &n_factors, "scale_factor"))
+        return EXIT_FAILURE;
+      factors_set = true;
+      break;
+    case 'r':
+      if (parse_roi(optarg, &roi))
+        return EXIT_FAILURE;
+      use_roi = true;
+      break;
+    case 'R':
+      if (resize_parse_spec(optarg, &resize_spec))
         return EXIT_FAILURE;
+      resizing = true;
+      break;
+    case 'S':
+      streaming = true;
       break;
     case 't':
       run_tests = true;
       break;
+    case 'T':
+      if (strtosizet_wrapper(optarg, &threads, "threads"))
+        return EXIT_FAILURE;
+      if (threads == 0 || threads > MAX_THREADS) {
+        fprintf(stderr,
+                "Error processing --threads: Must be between 1 and %d.\n",
+                MAX_THREADS);
+        return EXIT_FAILURE;
+      }
+      threads_set = true;
+      break;
     case 'V':
-      if (strtosizet_wrapper(optarg, &use_version, "version"))
+      if (parse_list(optarg, versions, &n_versions, "version"))
+        return EXIT_FAILURE;
+      for (size_t i = 0; i < n_versions; i++) {
+        if (versions[i] > MAX_IMPLEMENTATION) {
+          fprintf(stderr, "No such implementation: -V%lu\n", versions[i]);
+          return EXIT_FAILURE;
+        }
+        if (!scale_supported(versions[i])) {
+          fprintf(stderr,
+                  "Implementation -V%lu is not supported by this CPU.\n",
+                  versions[i]);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'W':
+      if (strtosizet_wrapper(optarg, &warmup, "warmup"))
         return EXIT_FAILURE;
-      if (use_version > MAX_IMPLEMENTATION) {
-        fprintf(stderr, "No such implementation: -V%lu\n", use_version);
+      break;
+    case 'x':
+      if (!strlen(optarg)) {
+        fprintf(stderr, "Error processing --trace: Filename empty.\n");
         return EXIT_FAILURE;
       }
+      trace_file = optarg;
+      break;
+    case 'X':
+      trace_summary_on = true;
       break;
     case ':':
       fprintf(stderr, "Error: missing argument for -%c\n", optopt);
@@ -144,6 +489,11 @@ int main(int argc, char **argv) {
     int parser_failed_tests = test_parser();
     int batch_failed_tests = test_batch();
     int hard_coded_failed_tests = test_hard_coded();
+    int batch_mode_failed_tests = test_batch_mode();
+    int stream_failed_tests = test_stream();
+    int resize_failed_tests = test_resize();
+    int interp_failed_tests = test_interp();
+    int tune_failed_tests = test_tune();
 
     printf("\n");
     if (!parser_failed_tests)
@@ -165,12 +515,208 @@ int main(int argc, char **argv) {
       printf("Hardcoded tests sucessful.\n");
     }
 
-    if (parser_failed_tests || batch_failed_tests)
+    if (batch_mode_failed_tests) {
+      fprintf(stderr, "Failed batch mode tests: %d test(s) failed.\n",
+              batch_mode_failed_tests);
+    } else {
+      printf("Batch mode tests successful.\n");
+    }
+
+    if (stream_failed_tests) {
+      fprintf(stderr, "Failed stream tests: %d test(s) failed.\n",
+              stream_failed_tests);
+    } else {
+      printf("Stream tests successful.\n");
+    }
+
+    if (resize_failed_tests) {
+      fprintf(stderr, "Failed resize tests: %d test(s) failed.\n",
+              resize_failed_tests);
+    } else {
+      printf("Resize tests successful.\n");
+    }
+
+    if (interp_failed_tests) {
+      fprintf(stderr, "Failed library tests: %d test(s) failed.\n",
+              interp_failed_tests);
+    } else {
+      printf("Library tests successful.\n");
+    }
+
+    if (tune_failed_tests) {
+      fprintf(stderr, "Failed autotune tests: %d test(s) failed.\n",
+              tune_failed_tests);
+    } else {
+      printf("Autotune tests successful.\n");
+    }
+
+    if (parser_failed_tests || batch_failed_tests || batch_mode_failed_tests ||
+        stream_failed_tests || resize_failed_tests || interp_failed_tests ||
+        tune_failed_tests)
       return EXIT_FAILURE;
     else
       return EXIT_SUCCESS;
   }
 
+  if (counters && !bench) {
+    fprintf(stderr, "Error: --counters requires --bench.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!bench && n_versions > 1) {
+    fprintf(stderr, "Error: Lists of versions are only allowed with "
+                    "--bench.\n");
+    return EXIT_FAILURE;
+  }
+  if (!bench && !autotune && n_factors > 1) {
+    fprintf(stderr, "Error: Lists of scale factors are only allowed with "
+                    "--bench or --autotune.\n");
+    return EXIT_FAILURE;
+  }
+  scale_factor = factors[0];
+  use_version = versions[0];
+
+  if (use_roi && (batch || bench || resizing || streaming || do_timing)) {
+    fprintf(stderr, "Error: --roi can't be combined with --batch, --bench, "
+                    "--resize, --stream or --time.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (resizing && (batch || bench || streaming || do_timing || threads > 1 ||
+                   use_version)) {
+    fprintf(stderr, "Error: --resize can't be combined with --batch, --bench, "
+                    "--stream, --threads, --time or --version.\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((trace_file || trace_summary_on) && (autotune || batch || bench)) {
+    fprintf(stderr, "Error: --trace and --trace_summary can't be combined "
+                    "with --autotune, --batch or --bench.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (pin && pin_to_cpu(cpu))
+    return EXIT_FAILURE;
+
+  if (bench) {
+    if (streaming || batch) {
+      fprintf(stderr, "Error: --bench can't be combined with --stream or "
+                      "--batch.\n");
+      return EXIT_FAILURE;
+    }
+    if (optind >= argc) {
+      fprintf(stderr, "Error: No input files specified.\n");
+      return EXIT_FAILURE;
+    }
+    // A version 0 in a list means the default one, which depends on the image
+    for (size_t i = 0; i < n_versions; i++) {
+      if (n_versions > 1 && versions[i] == 0) {
+        fprintf(stderr, "Error: --version 0 can't be part of a list.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    // Without --version, measure all implementations
+    size_t all_versions[MAX_IMPLEMENTATION];
+    if (n_versions == 1 && versions[0] == 0) {
+      for (size_t i = 0; i < MAX_IMPLEMENTATION; i++)
+        all_versions[i] = i + 1;
+    }
+    struct bench_opts_st opts = {
+        versions[0] ? versions : all_versions,
+        versions[0] ? n_versions : MAX_IMPLEMENTATION,
+        factors,
+        n_factors,
+        warmup,
+        timing_repeats,
+        threads,
+        json,
+        huge_pages,
+        counters};
+
+    FILE *results = stdout;
+    if (name_out) {
+      results = fopen(name_out, "w");
+      if (!results) {
+        perror("Error opening output file");
+        return EXIT_FAILURE;
+      }
+    }
+    int res = bench_matrix(argv + optind, argc - optind, &opts, results);
+    if (results != stdout && fclose(results)) {
+      perror("Error writing output file");
+      res = 1;
+    }
+    return res ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (autotune) {
+    if (batch || bench || resizing || use_roi || streaming || use_version) {
+      fprintf(stderr, "Error: --autotune can't be combined with --batch, "
+                      "--bench, --resize, --roi, --stream or --version.\n");
+      return EXIT_FAILURE;
+    }
+    char path[TUNE_PATH_MAX];
+    if (tune_path(path, sizeof(path))) {
+      fprintf(stderr, "Error: Don't know where to save the autotune table, "
+                      "set INTERP_TUNE_FILE.\n");
+      return EXIT_FAILURE;
+    }
+    struct tune_table_st table = {NULL, 0, 0};
+    if (tune_run(&table, factors_set ? factors : tune_factors,
+                 factors_set ? n_factors
+                             : sizeof(tune_factors) / sizeof(tune_factors[0]),
+                 threads_set ? threads : 0, warmup,
+                 do_timing && timing_repeats ? timing_repeats : TUNE_REPEATS,
+                 stdout)) {
+      fprintf(stderr, "Error allocating memory.\n");
+      tune_free(&table);
+      return EXIT_FAILURE;
+    }
+    int res = tune_save(&table, path);
+    tune_free(&table);
+    if (res) {
+      fprintf(stderr, "%s: ", path);
+      perror("Error saving the autotune table");
+      return EXIT_FAILURE;
+    }
+    printf("Saved to %s.\n", path);
+    return EXIT_SUCCESS;
+  }
+
+  if (manifest && !batch) {
+    fprintf(stderr, "Error: --manifest requires --batch.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (batch) {
+    if (streaming || do_timing || plain) {
+      fprintf(stderr, "Error: --batch can't be combined with --stream, "
+                      "--time or --plain.\n");
+      return EXIT_FAILURE;
+    }
+    size_t n;
+    char **names = batch_inputs(argv + optind, argc - optind, manifest, &n);
+    if (!names)
+      return EXIT_FAILURE;
+    if (n == 0) {
+      fprintf(stderr, "Error: No input files specified.\n");
+      batch_inputs_free(names, n);
+      return EXIT_FAILURE;
+    }
+
+    size_t failed = scale_batch(names, n, name_out ? name_out : "%s_scaled.ppm",
+                                scale_factor, use_version, threads);
+    batch_inputs_free(names, n);
+    if (failed) {
+      fprintf(stderr, "Failed to scale %zu of %zu file(s).\n", failed, n);
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (!name_out)
+    name_out = "out.ppm";
+
   // Get the input name
   if (optind >= argc) {
     fprintf(stderr, "Error: No input file name specified.\n");
@@ -185,9 +731,20 @@ int main(int argc, char **argv) {
 
   name_in = argv[optind];
 
+  if (streaming && do_timing) {
+    fprintf(stderr, "Error: --stream and --time can't be combined.\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((trace_file || trace_summary_on) && trace_start()) {
+    fprintf(stderr, "Error allocating memory.\n");
+    return EXIT_FAILURE;
+  }
+
   // Open files for IO
   // We do not need to check whether infile is a regular file - if it isn't, the
   // file read operations that we do later will fail and we can handle that.
+  uint64_t t = trace_begin();
   infile = fopen(name_in, "r");
   if (!infile) {
     perror("Error opening input file");
@@ -203,42 +760,165 @@ int main(int argc, char **argv) {
     perror("Error opening output file");
     goto cleanup;
   }
+  trace_end(TRACE_OPEN, t, 0);
+
+  if (streaming) {
+    struct img_stream_st *st = stream_open(infile, &inimg);
+    if (!st)
+      goto cleanup;
+    apply_tuning(&inimg, scale_factor, &use_version, &threads, threads_set);
+    void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+                size_t) = band_fun(use_version, scale_factor, &inimg);
+    int res = !fun || plain_unsupported(plain, &inimg) ||
+              scale_stream(st, outfile, &inimg, scale_factor, fun, threads,
+                           plain);
+    stream_close(st);
+    if (res)
+      goto cleanup;
+    fclose(infile);
+    return trace_finish(trace_file, trace_summary_on, close_output(outfile));
+  }
 
-  // Parse the image from input file
+  // Parse the image from input file, plain-text rasters with all threads
+  parse_set_threads(threads);
   if (parse_file(infile, &inimg))
     goto cleanup;
   fclose(infile);
   infile = NULL; // to prevent it from being closed again if we goto cleanup
+  if (plain_unsupported(plain, &inimg))
+    goto cleanup;
+
+  if (resizing) {
+    if (inimg.channels != CHANNELS || inimg.maxval > 255) {
+      fprintf(stderr, "Error: --resize only supports 8-bit RGB images.\n");
+      goto cleanup;
+    }
+    size_t width_out, height_out;
+    if (resize_target(&resize_spec, inimg.width, inimg.height, &width_out,
+                      &height_out))
+      goto cleanup;
+    if (inimg.width * inimg.height != 0) {
+      const size_t size_out = output_imgsize(width_out, height_out, 1, CHANNELS);
+      t = trace_begin();
+      if (outbuf_alloc(&out_buf, size_out, huge_pages))
+        goto malloc_error;
+      trace_end(TRACE_ALLOC, t, size_out);
+      scaled_img = out_buf.data;
+      t = trace_begin();
+      if (resize(inimg.img, inimg.width, inimg.height, scaled_img, width_out,
+                 height_out))
+        goto malloc_error;
+      trace_end(TRACE_KERNEL, t, width_out * height_out * CHANNELS);
+    } else if (width_out * height_out != 0) {
+      fprintf(stderr,
+              "Error: Can't resize an empty image to a non-empty one.\n");
+      goto cleanup;
+    }
+    if ((plain ? write_img_plain : write_img)(
+            outfile, width_out, height_out, CHANNELS, inimg.maxval,
+            scaled_img)) {
+      fprintf(stderr, "Error writing to output file.\n");
+      goto cleanup;
+    }
+    const int status = close_output(outfile);
+    free_img(&inimg);
+    outbuf_free(&out_buf);
+    return trace_finish(trace_file, trace_summary_on, status);
+  }
+
+  if (use_roi) {
+    const struct interp_image_st img = {
+        inimg.width,    inimg.height,
+        inimg.channels, inimg.maxval,
+        inimg.img,      img_readable_size(&inimg)};
+    size_t width_out = inimg.width * scale_factor;
+    size_t height_out = inimg.height * scale_factor;
+    if (scale_factor && (width_out / scale_factor != inimg.width ||
+                         height_out / scale_factor != inimg.height))
+      goto malloc_error;
+    if (roi.x > width_out || roi.width > width_out - roi.x ||
+        roi.y > height_out || roi.height > height_out - roi.y) {
+      fprintf(stderr,
+              "Error: --roi %zu,%zu,%zu,%zu is not within the %zux%zu "
+              "scaled image.\n",
+              roi.x, roi.y, roi.width, roi.height, width_out, height_out);
+      goto cleanup;
+    }
+    const size_t size_out =
+        roi.width * roi.height * inimg.channels * img_sample_size(&inimg);
+    if (size_out) {
+      t = trace_begin();
+      if (outbuf_alloc(&out_buf, size_out, huge_pages))
+        goto malloc_error;
+      trace_end(TRACE_ALLOC, t, size_out);
+      scaled_img = out_buf.data;
+      t = trace_begin();
+      if (scale_img(&img, scale_factor, &roi, use_version, threads,
+                    scaled_img, size_out))
+        goto cleanup;
+      trace_end(TRACE_KERNEL, t, size_out);
+    }
+    if ((plain ? write_img_plain : write_img)(outfile, roi.width, roi.height,
+                                              inimg.channels, inimg.maxval,
+                                              scaled_img)) {
+      fprintf(stderr, "Error writing to output file.\n");
+      goto cleanup;
+    }
+    const int status = close_output(outfile);
+    free_img(&inimg);
+    outbuf_free(&out_buf);
+    return trace_finish(trace_file, trace_summary_on, status);
+  }
+
+  apply_tuning(&inimg, scale_factor, &use_version, &threads, threads_set);
 
   // Calculate the amount of memory needed for output image and allocate it
-  errno = 0;
-  size_t size_out = output_imgsize(inimg.width, inimg.height, scale_factor);
-  if (errno == ERANGE)
+  const struct interp_image_st img = {inimg.width,  inimg.height,
+                                      inimg.channels, inimg.maxval,
+                                      inimg.img,    img_readable_size(&inimg)};
+  size_t size_out;
+  if (interp_output_size(&img, scale_factor, &size_out))
     goto malloc_error;
 
   if (inimg.width * inimg.height * scale_factor != 0) {
-    scaled_img = malloc(size_out);
-    if (!scaled_img)
+    t = trace_begin();
+    if (outbuf_alloc(&out_buf, size_out, huge_pages))
       goto malloc_error;
+    trace_end(TRACE_ALLOC, t, size_out);
+    scaled_img = out_buf.data;
 
-    struct timespec total;
+    // With --time, the kernel span covers all iterations
+    t = trace_begin();
+    if (!do_timing) {
+      if (scale_img(&img, scale_factor, NULL, use_version, threads,
+                    scaled_img, size_out))
+        goto cleanup;
+    } else {
+      // Timing needs the band function itself, to call it in the loop
+      struct timing_stats_st stats;
+      void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+                  size_t) = band_fun(use_version, scale_factor, &inimg);
+      if (!fun)
+        goto cleanup;
 
-    if (use_version == 0) {
-      if (scale_factor <= 16 && inimg.width > 1) {
-        // Fast implementation, but only works for scale_factor <= 16
-        use_version = 4;
-      } else {
-        use_version = 1;
-      }
+      if (timing_loop(&stats, do_timing, warmup, timing_repeats, NULL, fun,
+                      threads, inimg.img, inimg.width, inimg.height,
+                      scale_factor, scaled_img))
+        goto cleanup;
+      printf("Took %.6fs for %lu iterations.\n", stats.total / 1e9,
+             timing_repeats);
+      printf("Per iteration: min %.3f ms, median %.3f ms, p95 %.3f ms, p99 "
+             "%.3f ms\n",
+             stats.min / 1e6, stats.median / 1e6, stats.p95 / 1e6,
+             stats.p99 / 1e6);
+      printf("Throughput: %.2f MB/s, %.2f MP/s (output, at median)\n",
+             timing_mb_s(&stats, inimg.width, inimg.height, scale_factor,
+                         inimg.channels * img_sample_size(&inimg)),
+             timing_mp_s(&stats, inimg.width, inimg.height, scale_factor));
     }
-
-    if (timing_loop(&total, do_timing, timing_repeats,
-                    scale_funs[use_version - 1], inimg.img, inimg.width,
-                    inimg.height, scale_factor, scaled_img))
-      goto cleanup;
-    if (do_timing)
-      printf("Took %ld.%03lds for %lu iterations.\n", total.tv_sec,
-             total.tv_nsec / 1000000, timing_repeats);
+    trace_end(TRACE_KERNEL, t,
+              inimg.width * inimg.height * scale_factor * scale_factor *
+                  inimg.channels * img_sample_size(&inimg));
   } else {
     scaled_img = NULL;
     if (do_timing)
@@ -247,30 +927,27 @@ int main(int argc, char **argv) {
                       "so there are no timing results.\n");
   }
 
-  if (write_img(outfile, inimg.width * scale_factor,
-                inimg.height * scale_factor, scaled_img)) {
+  if ((plain ? write_img_plain : write_img)(
+          outfile, inimg.width * scale_factor, inimg.height * scale_factor,
+          inimg.channels, inimg.maxval, scaled_img)) {
     fprintf(stderr, "Error writing to output file.\n");
     goto cleanup;
   }
-  fclose(outfile);
+  const int status = close_output(outfile);
 
-  if (inimg.img)
-    free(inimg.img);
-  if (scaled_img)
-    free(scaled_img);
+  free_img(&inimg);
+  outbuf_free(&out_buf);
 
-  return EXIT_SUCCESS;
+  return trace_finish(trace_file, trace_summary_on, status);
 
 malloc_error:
   fprintf(stderr, "Error allocating memory.\n");
 cleanup:
-  if (inimg.img)
-    free(inimg.img);
-  if (scaled_img)
-    free(scaled_img);
+  free_img(&inimg);
+  outbuf_free(&out_buf);
   if (infile)
     fclose(infile);
   if (outfile)
     fclose(outfile);
-  return EXIT_FAILURE;
+  return trace_finish(trace_file, trace_summary_on, EXIT_FAILURE);
 }
@@ -0,0 +1,75 @@
+// mmap(), madvise() and their flags are not part of C17; see
+// man feature_test_macros(7)
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "outbuf.h"
+
+// Cache line size, the alignment of buffers that aren't mapped
+#define LINE_SIZE 64
+
+// Maps len bytes (a multiple of HUGE_PAGE_SIZE) at an address aligned to
+// HUGE_PAGE_SIZE, which transparent huge pages need: the kernel only backs
+// whole, aligned 2 MiB ranges with them. mmap() only aligns to 4 KiB, so map
+// one huge page more and unmap what sticks out on either side.
+static uint8_t *map_aligned(size_t len) {
+  uint8_t *p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  const size_t head = -(uintptr_t)p & (HUGE_PAGE_SIZE - 1);
+  if (head)
+    munmap(p, head);
+  munmap(p + head + len, HUGE_PAGE_SIZE - head);
+  return p + head;
+}
+
+int outbuf_alloc(struct outbuf_st *buf, size_t size, bool huge) {
+  buf->size = size;
+  buf->mapped = 0;
+  if (huge && size >= HUGE_PAGE_SIZE &&
+      size <= SIZE_MAX - 2 * HUGE_PAGE_SIZE) {
+    const size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      // No huge pages reserved (see /proc/sys/vm/nr_hugepages). If
+      // transparent huge pages are disabled, madvise() fails, and we just
+      // use small pages.
+      p = map_aligned(len);
+      if (p)
+        madvise(p, len, MADV_HUGEPAGE);
+    }
+    if (p) {
+      buf->data = p;
+      buf->mapped = len;
+      return 0;
+    }
+  }
+  if (size > SIZE_MAX - LINE_SIZE) {
+    buf->data = NULL;
+  } else {
+    // aligned_alloc() wants a multiple of the alignment
+    buf->data = aligned_alloc(LINE_SIZE, (size + LINE_SIZE - 1) /
+                                             LINE_SIZE * LINE_SIZE);
+  }
+  if (!buf->data) {
+    errno = ENOMEM;
+    return 1;
+  }
+  return 0;
+}
+
+void outbuf_free(struct outbuf_st *buf) {
+  if (buf->mapped)
+    munmap(buf->data, buf->mapped);
+  else
+    free(buf->data);
+  buf->data = NULL;
+  buf->size = buf->mapped = 0;
+}
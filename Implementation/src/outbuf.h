@@ -0,0 +1,26 @@
+// Buffers for the scaled image. Every byte of the output is written exactly
+// once, by kernels that are bound by store bandwidth at large factors, so
+// large buffers are mapped on 2 MiB pages: with 4 KiB pages, one output row
+// can span hundreds of them, and every row costs TLB misses. All buffers are
+// aligned to a cache line.
+
+// Size of a huge page on x86-64
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+struct outbuf_st {
+  uint8_t *data;
+  size_t size;
+  // Bytes mapped with mmap(), 0 if data comes from aligned_alloc()
+  size_t mapped;
+};
+
+// Allocates size bytes (their contents are undefined). If huge is true and
+// size is at least HUGE_PAGE_SIZE, the buffer is mapped on explicit huge pages
+// (MAP_HUGETLB) if the system has some reserved, and otherwise asks for
+// transparent huge pages (MADV_HUGEPAGE), which the kernel may or may not
+// grant. Anything else comes from aligned_alloc().
+// Return value:
+//   0 if successful
+//   1 if allocating memory failed (errno is set to ENOMEM)
+extern int outbuf_alloc(struct outbuf_st *buf, size_t size, bool huge);
+extern void outbuf_free(struct outbuf_st *buf);
@@ -0,0 +1,261 @@
+// pthreads are POSIX, not C17; see man feature_test_macros(7)
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "parallel.h"
+
+// Everything a worker thread needs to scale its band
+struct band_st {
+  void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+              size_t);
+  const uint8_t *img;
+  size_t width;
+  size_t height;
+  size_t scale_factor;
+  uint8_t *result;
+  size_t eta_begin;
+  size_t eta_end;
+  // errno is thread-local, so the worker hands it back through here
+  int err;
+};
+
+static void *band_worker(void *arg) {
+  struct band_st *band = arg;
+  errno = 0;
+  band->fun(band->img, band->width, band->height, band->scale_factor,
+            band->result, band->eta_begin, band->eta_end);
+  band->err = errno;
+  return NULL;
+}
+
+void scale_parallel(void (*fun)(const uint8_t *, size_t, size_t, size_t,
+                                uint8_t *, size_t, size_t),
+                    size_t threads, const uint8_t *img, size_t width,
+                    size_t height, size_t scale_factor, uint8_t *result) {
+  scale_parallel_rows(fun, threads, img, width, height, scale_factor, result, 0,
+                      height);
+}
+
+// How many bands to split the source rows eta_begin <= eta < eta_end into
+// with up to `threads` threads
+static size_t band_count(size_t threads, size_t rows, size_t scale_factor) {
+  // A band must contain at least one source row.
+  if (threads > rows)
+    threads = rows;
+  // With scale_factor 1, scale4's 8-byte stores run two bytes into the next
+  // output row, which would race with the band below. Scaling by 1 is just a
+  // copy anyway, so there is nothing to gain from splitting.
+  if (scale_factor == 1)
+    threads = 1;
+  return threads;
+}
+
+// Splits the source rows eta_begin <= eta < eta_end into n bands of (almost)
+// the same height
+static void split_bands(struct band_st *bands, size_t n,
+                        void (*fun)(const uint8_t *, size_t, size_t, size_t,
+                                    uint8_t *, size_t, size_t),
+                        const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result,
+                        size_t eta_begin, size_t eta_end) {
+  const size_t rows = eta_end - eta_begin;
+  for (size_t i = 0; i < n; i++) {
+    bands[i] = (struct band_st){fun,
+                                img,
+                                width,
+                                height,
+                                scale_factor,
+                                result,
+                                eta_begin + i * rows / n,
+                                eta_begin + (i + 1) * rows / n,
+                                0};
+  }
+}
+
+void scale_parallel_rows(void (*fun)(const uint8_t *, size_t, size_t, size_t,
+                                     uint8_t *, size_t, size_t),
+                         size_t threads, const uint8_t *img, size_t width,
+                         size_t height, size_t scale_factor, uint8_t *result,
+                         size_t eta_begin, size_t eta_end) {
+  threads = band_count(threads, eta_end - eta_begin, scale_factor);
+  if (threads <= 1) {
+    fun(img, width, height, scale_factor, result, eta_begin, eta_end);
+    return;
+  }
+
+  struct band_st *bands = malloc(threads * sizeof(struct band_st));
+  pthread_t *tids = malloc(threads * sizeof(pthread_t));
+  bool *started = calloc(threads, sizeof(bool));
+  if (!bands || !tids || !started) {
+    free(bands);
+    free(tids);
+    free(started);
+    errno = ENOMEM;
+    return;
+  }
+  split_bands(bands, threads, fun, img, width, height, scale_factor, result,
+              eta_begin, eta_end);
+
+  // The calling thread takes the last band (which may do the last row), so
+  // only threads - 1 new threads are needed. If creating a thread fails, do
+  // its band here instead of giving up.
+  for (size_t i = 0; i < threads - 1; i++) {
+    started[i] = !pthread_create(&tids[i], NULL, band_worker, &bands[i]);
+    if (!started[i])
+      band_worker(&bands[i]);
+  }
+  band_worker(&bands[threads - 1]);
+
+  int err = 0;
+  for (size_t i = 0; i < threads; i++) {
+    if (i < threads - 1 && started[i])
+      pthread_join(tids[i], NULL);
+    if (bands[i].err == ENOMEM)
+      err = ENOMEM;
+  }
+
+  free(bands);
+  free(tids);
+  free(started);
+  if (err)
+    errno = err;
+}
+
+// The workers of a pool wait on `work` until generation changes, then run
+// band number <index> of the job if it has that many bands (the calling
+// thread runs the last one), and the one that finishes last signals `done`.
+struct scale_pool_st {
+  size_t workers; // Threads started, besides the calling one
+  pthread_t *tids;
+  struct pool_slot_st *slots;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct band_st *bands;
+  size_t n_bands;
+  size_t pending; // Bands of the current job the workers haven't finished
+  size_t generation;
+  bool stop;
+};
+
+struct pool_slot_st {
+  struct scale_pool_st *pool;
+  size_t index;
+};
+
+static void *pool_worker(void *arg) {
+  const struct pool_slot_st *slot = arg;
+  struct scale_pool_st *pool = slot->pool;
+  size_t seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->generation == seen)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->stop)
+      break;
+    seen = pool->generation;
+    if (slot->index >= pool->n_bands - 1)
+      continue;
+    pthread_mutex_unlock(&pool->lock);
+    band_worker(&pool->bands[slot->index]);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct scale_pool_st *scale_pool_new(size_t threads) {
+  struct scale_pool_st *pool = calloc(1, sizeof(struct scale_pool_st));
+  if (!pool) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (threads == 0)
+    threads = 1;
+  pool->tids = malloc((threads - 1) * sizeof(pthread_t) + 1);
+  pool->slots = malloc((threads - 1) * sizeof(struct pool_slot_st) + 1);
+  pool->bands = malloc(threads * sizeof(struct band_st));
+  if (!pool->tids || !pool->slots || !pool->bands) {
+    free(pool->tids);
+    free(pool->slots);
+    free(pool->bands);
+    free(pool);
+    errno = ENOMEM;
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  // If creating a thread fails, the pool just has fewer of them
+  for (size_t i = 0; i < threads - 1; i++) {
+    pool->slots[pool->workers] = (struct pool_slot_st){pool, pool->workers};
+    if (pthread_create(&pool->tids[pool->workers], NULL, pool_worker,
+                       &pool->slots[pool->workers]))
+      break;
+    pool->workers++;
+  }
+  return pool;
+}
+
+void scale_pool_free(struct scale_pool_st *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->workers; i++)
+    pthread_join(pool->tids[i], NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  free(pool->tids);
+  free(pool->slots);
+  free(pool->bands);
+  free(pool);
+}
+
+void scale_pool_rows(struct scale_pool_st *pool,
+                     void (*fun)(const uint8_t *, size_t, size_t, size_t,
+                                 uint8_t *, size_t, size_t),
+                     const uint8_t *img, size_t width, size_t height,
+                     size_t scale_factor, uint8_t *result, size_t eta_begin,
+                     size_t eta_end) {
+  const size_t n =
+      band_count(pool->workers + 1, eta_end - eta_begin, scale_factor);
+  if (n <= 1) {
+    fun(img, width, height, scale_factor, result, eta_begin, eta_end);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  split_bands(pool->bands, n, fun, img, width, height, scale_factor, result,
+              eta_begin, eta_end);
+  pool->n_bands = n;
+  pool->pending = n - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  band_worker(&pool->bands[n - 1]);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+
+  int err = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (pool->bands[i].err == ENOMEM)
+      err = ENOMEM;
+  }
+  if (err)
+    errno = err;
+}
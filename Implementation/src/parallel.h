@@ -0,0 +1,46 @@
+// Upper bound for --threads, to catch typos like -T 1000000 before we try to
+// create that many threads.
+#define MAX_THREADS 1024
+
+// Splits the output into horizontal bands of whole source rows and lets each
+// of `threads` threads run fun (an entry of scale_band_funs) on one band.
+// The result is byte-identical to running fun on the whole image at once.
+//
+// If any band fails to allocate memory, errno is set to ENOMEM afterwards,
+// just like the scale functions themselves do.
+extern void
+scale_parallel(void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *,
+                           size_t, size_t),
+               size_t threads, const uint8_t *img, size_t width, size_t height,
+               size_t scale_factor, uint8_t *result);
+
+// Same as scale_parallel(), but only for the source rows
+// eta_begin <= eta < eta_end (see scale_band_funs).
+extern void scale_parallel_rows(
+    void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+                size_t),
+    size_t threads, const uint8_t *img, size_t width, size_t height,
+    size_t scale_factor, uint8_t *result, size_t eta_begin, size_t eta_end);
+
+// A pool of threads that are started once and then scale the bands of many
+// images, for callers that scale lots of small images, where starting
+// threads for every one of them would cost more than the scaling (see
+// interp.h). The calling thread runs one of the bands itself, so a pool for
+// `threads` threads starts threads - 1.
+struct scale_pool_st;
+
+// Return value:
+//   the pool, to be freed with scale_pool_free()
+//   NULL if allocating memory failed (errno is set to ENOMEM)
+// If starting a thread fails, the pool works with fewer threads.
+extern struct scale_pool_st *scale_pool_new(size_t threads);
+extern void scale_pool_free(struct scale_pool_st *pool);
+
+// Same as scale_parallel_rows(), with the threads of pool. Only one thread
+// may use a pool at a time.
+extern void scale_pool_rows(struct scale_pool_st *pool,
+                            void (*fun)(const uint8_t *, size_t, size_t,
+                                        size_t, uint8_t *, size_t, size_t),
+                            const uint8_t *img, size_t width, size_t height,
+                            size_t scale_factor, uint8_t *result,
+                            size_t eta_begin, size_t eta_end);
@@ -0,0 +1,197 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <tmmintrin.h> // SSSE3
+
+#include "planar.h"
+
+// 16 pixels are 48 bytes, i.e. three vectors. deinterleave_masks[c][j] picks
+// the bytes of channel c out of vector j, into the lanes of the pixels they
+// belong to; the three results ORed together hold the channel of all 16
+// pixels.
+static const int8_t deinterleave_masks[3][3][16] = {
+    {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+    {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+    {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}}};
+
+// The other way round: interleave_masks[j][c] places the pixels' channel c
+// at the bytes of output vector j where it belongs.
+static const int8_t interleave_masks[3][3][16] = {
+    {{0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+     {-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+     {-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1}},
+    {{-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+     {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+     {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1}},
+    {{-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+     {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+     {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15}}};
+
+static inline __m128i load_mask(const int8_t *mask) {
+  return _mm_loadu_si128((const __m128i *)mask);
+}
+
+int planar_alloc(struct planar_st *p, size_t width, size_t height,
+                 size_t channels) {
+  p->width = width;
+  p->height = height;
+  p->channels = channels;
+  p->stride = (width + 16 + PLANAR_ALIGN - 1) / PLANAR_ALIGN * PLANAR_ALIGN;
+  size_t plane_size;
+  if (__builtin_mul_overflow(p->stride, height ? height : 1, &plane_size) ||
+      plane_size > SIZE_MAX / channels) {
+    p->plane[0] = p->plane[1] = p->plane[2] = p->plane[3] = NULL;
+    errno = ERANGE;
+    return 1;
+  }
+  // plane_size is a multiple of PLANAR_ALIGN, as aligned_alloc() wants
+  uint8_t *mem = aligned_alloc(PLANAR_ALIGN, channels * plane_size);
+  for (size_t c = 0; c < 4; c++)
+    p->plane[c] = mem && c < channels ? mem + c * plane_size : NULL;
+  if (!mem) {
+    errno = ENOMEM;
+    return 1;
+  }
+  return 0;
+}
+
+void planar_free(struct planar_st *p) {
+  // All planes live in the allocation of the first one
+  free(p->plane[0]);
+  p->plane[0] = p->plane[1] = p->plane[2] = p->plane[3] = NULL;
+}
+
+void deinterleave_rgb(const uint8_t *src, size_t n, uint8_t *r, uint8_t *g,
+                      uint8_t *b) {
+  uint8_t *dest[3] = {r, g, b};
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v[3] = {_mm_loadu_si128((const __m128i *)(src + 3 * i)),
+                          _mm_loadu_si128((const __m128i *)(src + 3 * i + 16)),
+                          _mm_loadu_si128((const __m128i *)(src + 3 * i + 32))};
+    for (int c = 0; c < 3; c++) {
+      const int8_t(*m)[16] = deinterleave_masks[c];
+      __m128i res = _mm_shuffle_epi8(v[0], load_mask(m[0]));
+      res = _mm_or_si128(res, _mm_shuffle_epi8(v[1], load_mask(m[1])));
+      res = _mm_or_si128(res, _mm_shuffle_epi8(v[2], load_mask(m[2])));
+      _mm_storeu_si128((__m128i *)(dest[c] + i), res);
+    }
+  }
+  for (; i < n; i++) {
+    r[i] = src[3 * i];
+    g[i] = src[3 * i + 1];
+    b[i] = src[3 * i + 2];
+  }
+}
+
+void interleave_rgb(const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                    size_t n, uint8_t *dest) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v[3] = {_mm_loadu_si128((const __m128i *)(r + i)),
+                          _mm_loadu_si128((const __m128i *)(g + i)),
+                          _mm_loadu_si128((const __m128i *)(b + i))};
+    for (int j = 0; j < 3; j++) {
+      const int8_t(*m)[16] = interleave_masks[j];
+      __m128i res = _mm_shuffle_epi8(v[0], load_mask(m[0]));
+      res = _mm_or_si128(res, _mm_shuffle_epi8(v[1], load_mask(m[1])));
+      res = _mm_or_si128(res, _mm_shuffle_epi8(v[2], load_mask(m[2])));
+      _mm_storeu_si128((__m128i *)(dest + 3 * i + 16 * j), res);
+    }
+  }
+  for (; i < n; i++) {
+    dest[3 * i] = r[i];
+    dest[3 * i + 1] = g[i];
+    dest[3 * i + 2] = b[i];
+  }
+}
+
+void deinterleave_rgba(const uint8_t *src, size_t n, uint8_t *r, uint8_t *g,
+                       uint8_t *b, uint8_t *a) {
+  // Groups the channels within each pixel quadruple: rrrr gggg bbbb aaaa
+  const __m128i group =
+      _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v[4];
+    for (int j = 0; j < 4; j++) {
+      v[j] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *)(src + 4 * i + 16 * j)), group);
+    }
+    // Transpose the 32-bit lanes
+    const __m128i rg01 = _mm_unpacklo_epi32(v[0], v[1]);
+    const __m128i rg23 = _mm_unpacklo_epi32(v[2], v[3]);
+    const __m128i ba01 = _mm_unpackhi_epi32(v[0], v[1]);
+    const __m128i ba23 = _mm_unpackhi_epi32(v[2], v[3]);
+    _mm_storeu_si128((__m128i *)(r + i), _mm_unpacklo_epi64(rg01, rg23));
+    _mm_storeu_si128((__m128i *)(g + i), _mm_unpackhi_epi64(rg01, rg23));
+    _mm_storeu_si128((__m128i *)(b + i), _mm_unpacklo_epi64(ba01, ba23));
+    _mm_storeu_si128((__m128i *)(a + i), _mm_unpackhi_epi64(ba01, ba23));
+  }
+  for (; i < n; i++) {
+    r[i] = src[4 * i];
+    g[i] = src[4 * i + 1];
+    b[i] = src[4 * i + 2];
+    a[i] = src[4 * i + 3];
+  }
+}
+
+void interleave_rgba(const uint8_t *r, const uint8_t *g, const uint8_t *b,
+                     const uint8_t *a, size_t n, uint8_t *dest) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i vr = _mm_loadu_si128((const __m128i *)(r + i));
+    const __m128i vg = _mm_loadu_si128((const __m128i *)(g + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    const __m128i rg[2] = {_mm_unpacklo_epi8(vr, vg),
+                           _mm_unpackhi_epi8(vr, vg)};
+    const __m128i ba[2] = {_mm_unpacklo_epi8(vb, va),
+                           _mm_unpackhi_epi8(vb, va)};
+    for (int j = 0; j < 2; j++) {
+      _mm_storeu_si128((__m128i *)(dest + 4 * i + 32 * j),
+                       _mm_unpacklo_epi16(rg[j], ba[j]));
+      _mm_storeu_si128((__m128i *)(dest + 4 * i + 32 * j + 16),
+                       _mm_unpackhi_epi16(rg[j], ba[j]));
+    }
+  }
+  for (; i < n; i++) {
+    dest[4 * i] = r[i];
+    dest[4 * i + 1] = g[i];
+    dest[4 * i + 2] = b[i];
+    dest[4 * i + 3] = a[i];
+  }
+}
+
+void planar_from_interleaved(struct planar_st *p, const uint8_t *img) {
+  uint8_t *const *pl = p->plane;
+  for (size_t y = 0; y < p->height; y++) {
+    const size_t off = y * p->stride;
+    const uint8_t *src = img + p->channels * p->width * y;
+    if (p->channels == 4)
+      deinterleave_rgba(src, p->width, pl[0] + off, pl[1] + off, pl[2] + off,
+                        pl[3] + off);
+    else
+      deinterleave_rgb(src, p->width, pl[0] + off, pl[1] + off, pl[2] + off);
+  }
+}
+
+void planar_to_interleaved(const struct planar_st *p, uint8_t *img) {
+  uint8_t *const *pl = p->plane;
+  for (size_t y = 0; y < p->height; y++) {
+    const size_t off = y * p->stride;
+    uint8_t *dest = img + p->channels * p->width * y;
+    if (p->channels == 4)
+      interleave_rgba(pl[0] + off, pl[1] + off, pl[2] + off, pl[3] + off,
+                      p->width, dest);
+    else
+      interleave_rgb(pl[0] + off, pl[1] + off, pl[2] + off, p->width, dest);
+  }
+}
@@ -0,0 +1,48 @@
+// Planar ("structure of arrays") images: one plane per channel instead of
+// interleaved RGB or RGBA pixels, so that kernels can work on one channel at a
+// time with contiguous loads, without shuffling the channels apart first (see
+// scale9).
+
+// Rows of a plane start at multiples of PLANAR_ALIGN bytes
+#define PLANAR_ALIGN 64
+
+struct planar_st {
+  size_t width;
+  size_t height;
+  size_t channels; // 3 or 4
+  // Bytes from the start of one row of a plane to the next. There are at least
+  // 16 bytes of padding after each row, so kernels may load a whole vector
+  // starting at its last pixel.
+  size_t stride;
+  uint8_t *plane[4];
+};
+
+// Allocates the planes for a width x height image with 3 (RGB) or 4 (RGBA)
+// channels (their contents are undefined).
+// Return value:
+//   0 if successful
+//   1 if allocating memory failed or the size is out of range (errno is set to
+//   ENOMEM or ERANGE)
+extern int planar_alloc(struct planar_st *p, size_t width, size_t height,
+                        size_t channels);
+extern void planar_free(struct planar_st *p);
+
+// Converts the interleaved RGB or RGBA image at img (p->width x p->height, no
+// padding between rows) into the planes of p, or back.
+extern void planar_from_interleaved(struct planar_st *p, const uint8_t *img);
+extern void planar_to_interleaved(const struct planar_st *p, uint8_t *img);
+
+// The same for n pixels of a single row: splits src into r, g and b, or
+// merges r, g and b into dest. Neither reads or writes past the n pixels.
+extern void deinterleave_rgb(const uint8_t *src, size_t n, uint8_t *r,
+                             uint8_t *g, uint8_t *b);
+extern void interleave_rgb(const uint8_t *r, const uint8_t *g,
+                           const uint8_t *b, size_t n, uint8_t *dest);
+
+// The same for RGBA, where a pixel is 32 bits: 4 pixels fill a vector, and
+// 16 of them are a 4x4 transpose of 32-bit lanes, without masks.
+extern void deinterleave_rgba(const uint8_t *src, size_t n, uint8_t *r,
+                              uint8_t *g, uint8_t *b, uint8_t *a);
+extern void interleave_rgba(const uint8_t *r, const uint8_t *g,
+                            const uint8_t *b, const uint8_t *a, size_t n,
+                            uint8_t *dest);
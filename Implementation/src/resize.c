@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resize.h"
+#include "util.h"
+
+// Weights are multiples of 1 / RESIZE_ONE. With 7 bits, a vertically blended
+// channel (at most 255 * RESIZE_ONE) still fits in an int16_t, which lets the
+// horizontal pass use _mm_madd_epi16.
+#define RESIZE_BITS 7
+#define RESIZE_ONE (1 << RESIZE_BITS)
+
+// For every output column X:
+//   xoff: offset of the left source pixel (in channels, i.e. 3 * x)
+//   xw:   its weight RESIZE_ONE - w in the low and the right pixel's weight w
+//         in the high 16 bits, ready to be broadcast for _mm_madd_epi16
+// For every output row Y:
+//   yrow: the upper source row
+//   yw:   the lower source row's weight
+struct resize_plan_st {
+  size_t width;
+  size_t height;
+  size_t width_out;
+  size_t height_out;
+  uint32_t *xoff;
+  uint32_t *xw;
+  size_t *yrow;
+  uint16_t *yw;
+};
+
+// Source position and weight of the next pixel for output position pos, when
+// scaling size to size_out. The weight is rounded to the nearest 1/RESIZE_ONE.
+static void resize_weight(size_t pos, size_t size, size_t size_out,
+                          size_t *src, uint16_t *weight) {
+  // resize_plan_new() checked that size * size_out doesn't overflow
+  size_t num = pos * size;
+  *src = num / size_out;
+  size_t w = ((num % size_out) * RESIZE_ONE + size_out / 2) / size_out;
+  if (w == RESIZE_ONE) {
+    ++*src;
+    w = 0;
+  }
+  if (*src >= size - 1) {
+    *src = size - 1;
+    w = 0;
+  }
+  *weight = w;
+}
+
+struct resize_plan_st *resize_plan_new(size_t width, size_t height,
+                                       size_t width_out, size_t height_out) {
+  if (!width || !height || !width_out || !height_out ||
+      3 * width > UINT32_MAX ||
+      __builtin_mul_overflow_p(width, width_out, (size_t)0) ||
+      __builtin_mul_overflow_p(height, height_out, (size_t)0)) {
+    errno = ERANGE;
+    return NULL;
+  }
+  struct resize_plan_st *plan = malloc(sizeof(struct resize_plan_st));
+  if (!plan) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  plan->width = width;
+  plan->height = height;
+  plan->width_out = width_out;
+  plan->height_out = height_out;
+  plan->xoff = malloc(width_out * sizeof(uint32_t));
+  plan->xw = malloc(width_out * sizeof(uint32_t));
+  plan->yrow = malloc(height_out * sizeof(size_t));
+  plan->yw = malloc(height_out * sizeof(uint16_t));
+  if (!plan->xoff || !plan->xw || !plan->yrow || !plan->yw) {
+    resize_plan_free(plan);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  for (size_t x = 0; x < width_out; x++) {
+    size_t src;
+    uint16_t w;
+    resize_weight(x, width, width_out, &src, &w);
+    plan->xoff[x] = 3 * src;
+    plan->xw[x] = (uint32_t)w << 16 | (RESIZE_ONE - w);
+  }
+  for (size_t y = 0; y < height_out; y++)
+    resize_weight(y, height, height_out, &plan->yrow[y], &plan->yw[y]);
+  return plan;
+}
+
+void resize_plan_free(struct resize_plan_st *plan) {
+  if (!plan)
+    return;
+  free(plan->xoff);
+  free(plan->xw);
+  free(plan->yrow);
+  free(plan->yw);
+  free(plan);
+}
+
+// Blends output pixel x of a row from the vertically blended row v:
+// (RESIZE_ONE - w) * left + w * right per channel, in lanes 0-2
+static inline __m128i resize_pixel(const struct resize_plan_st *plan,
+                                   const int16_t *v, size_t x) {
+  // Bring the left and the right pixel's channels together in pairs
+  const __m128i pairs = _mm_setr_epi8(0, 1, 6, 7, 2, 3, 8, 9, 4, 5, 10, 11, -1,
+                                      -1, -1, -1);
+  __m128i px = _mm_loadu_si128((const __m128i *)(v + plan->xoff[x]));
+  px = _mm_shuffle_epi8(px, pairs);
+  __m128i sum = _mm_madd_epi16(px, _mm_set1_epi32(plan->xw[x]));
+  // Remove both weights' fixed-point scaling, truncating like scale_naive
+  return _mm_srai_epi32(sum, 2 * RESIZE_BITS);
+}
+
+void resize_rows(const struct resize_plan_st *plan, const uint8_t *img,
+                 uint8_t *result, size_t row_begin, size_t row_end) {
+  const size_t px_width = 3 * plan->width;
+  const size_t px_width_out = 3 * plan->width_out;
+  // The horizontal pass loads 8 channels starting at the last pixel
+  int16_t *v = calloc(px_width + 8, sizeof(int16_t));
+  if (!v) {
+    errno = ENOMEM;
+    return;
+  }
+  const __m128i compact =
+      _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+  for (size_t y = row_begin; y < row_end; y++) {
+    // Vertical pass: blend the two source rows into v
+    const uint8_t *row0 = img + plan->yrow[y] * px_width;
+    const uint8_t *row1 =
+        plan->yrow[y] + 1 < plan->height ? row0 + px_width : row0;
+    const int16_t w1 = plan->yw[y];
+    const int16_t w0 = RESIZE_ONE - w1;
+    const __m128i vw0 = _mm_set1_epi16(w0);
+    const __m128i vw1 = _mm_set1_epi16(w1);
+    size_t c = 0;
+    for (; c + 8 <= px_width; c += 8) {
+      __m128i a =
+          _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(row0 + c)));
+      __m128i b =
+          _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(row1 + c)));
+      _mm_storeu_si128((__m128i *)(v + c),
+                       _mm_add_epi16(_mm_mullo_epi16(a, vw0),
+                                     _mm_mullo_epi16(b, vw1)));
+    }
+    for (; c < px_width; c++)
+      v[c] = row0[c] * w0 + row1[c] * w1;
+
+    // Horizontal pass: 4 output pixels (12 bytes) at a time
+    uint8_t *out = result + y * px_width_out;
+    for (size_t x = 0; x < plan->width_out; x += 4) {
+      size_t n = plan->width_out - x < 4 ? plan->width_out - x : 4;
+      __m128i p[4];
+      for (size_t k = 0; k < 4; k++)
+        p[k] = k < n ? resize_pixel(plan, v, x + k) : _mm_setzero_si128();
+      __m128i packed = _mm_packus_epi16(_mm_packs_epi32(p[0], p[1]),
+                                        _mm_packs_epi32(p[2], p[3]));
+      packed = _mm_shuffle_epi8(packed, compact);
+      if (3 * x + 16 <= px_width_out) {
+        _mm_storeu_si128((__m128i *)(out + 3 * x), packed);
+      } else {
+        uint8_t tmp[16];
+        _mm_storeu_si128((__m128i *)tmp, packed);
+        memcpy(out + 3 * x, tmp, 3 * n);
+      }
+    }
+  }
+  free(v);
+}
+
+int resize(const uint8_t *img, size_t width, size_t height, uint8_t *result,
+           size_t width_out, size_t height_out) {
+  struct resize_plan_st *plan =
+      resize_plan_new(width, height, width_out, height_out);
+  if (!plan)
+    return 1;
+  errno = 0;
+  resize_rows(plan, img, result, 0, height_out);
+  resize_plan_free(plan);
+  return errno == ENOMEM;
+}
+
+// Parses a factor (integer, fraction or decimal) at src into num / den
+// Return value:
+//   pointer to the first character after the factor
+//   NULL if there is no valid factor at src
+static const char *parse_factor(const char *src, size_t *num, size_t *den) {
+  const char *endptr, *numptr;
+  errno = 0;
+  *num = strtosizet(src, &endptr, &numptr);
+  *den = 1;
+  if (errno == ERANGE || !numptr || numptr != src)
+    return NULL;
+
+  if (*endptr == '/') {
+    src = endptr + 1;
+    *den = strtosizet(src, &endptr, &numptr);
+    if (errno == ERANGE || !numptr || numptr != src || *den == 0)
+      return NULL;
+  } else if (*endptr == '.') {
+    // 2.25 is 225 / 100
+    src = endptr + 1;
+    size_t frac = strtosizet(src, &endptr, &numptr);
+    if (errno == ERANGE || !numptr || numptr != src)
+      return NULL;
+    *den = int_pow(10, endptr - src);
+    if (errno == ERANGE || __builtin_mul_overflow(*num, *den, num) ||
+        __builtin_add_overflow(*num, frac, num))
+      return NULL;
+  }
+  return *num ? endptr : NULL;
+}
+
+int resize_parse_spec(const char *src, struct resize_spec_st *spec) {
+  const char *endptr, *numptr;
+  *spec = (struct resize_spec_st){false, 0, 0, 1, 1, 1, 1};
+
+  if (strchr(src, 'x')) {
+    spec->is_size = true;
+    errno = 0;
+    spec->width = strtosizet(src, &endptr, &numptr);
+    if (errno == ERANGE || !numptr || numptr != src || *endptr != 'x')
+      goto invalid;
+    src = endptr + 1;
+    spec->height = strtosizet(src, &endptr, &numptr);
+    if (errno == ERANGE || !numptr || numptr != src || *endptr ||
+        !spec->width || !spec->height)
+      goto invalid;
+    return 0;
+  }
+
+  endptr = parse_factor(src, &spec->num_x, &spec->den_x);
+  if (!endptr)
+    goto invalid;
+  if (*endptr == ':') {
+    endptr = parse_factor(endptr + 1, &spec->num_y, &spec->den_y);
+  } else {
+    spec->num_y = spec->num_x;
+    spec->den_y = spec->den_x;
+  }
+  if (!endptr || *endptr)
+    goto invalid;
+  return 0;
+
+invalid:
+  fprintf(stderr, "Error processing --resize: Expected <width>x<height>, "
+                  "<factor> or <x factor>:<y factor>.\n");
+  return 1;
+}
+
+// size * num / den, rounded down but at least 1 if size isn't 0
+static bool scaled_size(size_t size, size_t num, size_t den, size_t *res) {
+  if (__builtin_mul_overflow(size, num, res))
+    return false;
+  *res /= den;
+  if (*res == 0 && size)
+    *res = 1;
+  return true;
+}
+
+int resize_target(const struct resize_spec_st *spec, size_t width,
+                  size_t height, size_t *width_out, size_t *height_out) {
+  if (spec->is_size) {
+    *width_out = spec->width;
+    *height_out = spec->height;
+  } else if (!scaled_size(width, spec->num_x, spec->den_x, width_out) ||
+             !scaled_size(height, spec->num_y, spec->den_y, height_out)) {
+    goto overflow;
+  }
+
+  errno = 0;
+  output_imgsize(*width_out, *height_out, 1, 3);
+  if (errno != ERANGE && 3 * *width_out <= UINT32_MAX)
+    return 0;
+
+overflow:
+  fprintf(stderr, "Error: Output size of --resize out of range.\n");
+  return 1;
+}
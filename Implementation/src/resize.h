@@ -0,0 +1,68 @@
+// Bilinear resizing to an arbitrary size, e.g. by 1.5, by 2.25 or by 4 in x and
+// 3 in y, which the scale functions (integer factor, same for both axes) can't
+// do.
+//
+// Output pixel (X, Y) samples the source at (X * width / width_out,
+// Y * height / height_out), the same mapping scale_naive uses for integer
+// factors; beyond the last source row and column, the image is extended by
+// repeating them. Weights are fixed-point with 7 fractional bits and results
+// are truncated, so for factors that are powers of 2 (up to 128) the output is
+// the same as scale_naive's, and otherwise channels can be off by 1.
+
+// Precomputed per-column and per-row source positions and weights for one
+// combination of input and output size. Opaque; see resize_plan_new().
+struct resize_plan_st;
+
+// Return value:
+//   the plan, to be freed with resize_plan_free()
+//   NULL if allocating memory failed or a size is 0 or too large (errno is
+//   set to ENOMEM or ERANGE)
+extern struct resize_plan_st *resize_plan_new(size_t width, size_t height,
+                                              size_t width_out,
+                                              size_t height_out);
+extern void resize_plan_free(struct resize_plan_st *plan);
+
+// Writes the output rows row_begin <= Y < row_end of the image img (sized as
+// given to resize_plan_new(), in a buffer of input_imgsize()) to result,
+// which holds the whole output image (3 * width_out * height_out bytes).
+// Sets errno to ENOMEM if allocating memory failed.
+extern void resize_rows(const struct resize_plan_st *plan, const uint8_t *img,
+                        uint8_t *result, size_t row_begin, size_t row_end);
+
+// Resizes img from width x height to width_out x height_out in one go
+// Return value:
+//   0 if successful
+//   1 otherwise (errno as for resize_plan_new() and resize_rows())
+extern int resize(const uint8_t *img, size_t width, size_t height,
+                  uint8_t *result, size_t width_out, size_t height_out);
+
+// What --resize asks for: either an output size, or a factor per axis, each
+// of them a fraction num / den.
+struct resize_spec_st {
+  bool is_size;
+  size_t width;
+  size_t height;
+  size_t num_x;
+  size_t den_x;
+  size_t num_y;
+  size_t den_y;
+};
+
+// Parses src, which is one of:
+//   <width>x<height>  output size, e.g. 1920x1080
+//   <f>               factor for both axes
+//   <fx>:<fy>         factor for each axis, e.g. 4:3
+// where a factor is an integer, a fraction (3/2) or a decimal (2.25).
+// Return value:
+//   0 if successful
+//   1 otherwise, after printing an error message
+extern int resize_parse_spec(const char *src, struct resize_spec_st *spec);
+
+// Calculates the output size for spec and an image of width x height. Sizes
+// are rounded down, but not below 1 (unless the input size is 0).
+// Return value:
+//   0 if successful
+//   1 if the output size is out of range, after printing an error message
+extern int resize_target(const struct resize_spec_st *spec, size_t width,
+                         size_t height, size_t *width_out,
+                         size_t *height_out);
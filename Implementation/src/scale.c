@@ -1,6 +1,8 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -9,131 +11,470 @@
 #include <pmmintrin.h> // SSE3
 #include <tmmintrin.h> // SSSE3
 #include <smmintrin.h> // SSE4.1
+#include <immintrin.h> // AVX2, AVX-512 (only used with target attributes)
 
+#include "planar.h"
 #include "scale.h"
+#include "util.h"
 
-void scale1(const uint8_t *img, size_t width, size_t height,
-            size_t scale_factor, uint8_t *result) {
+// scale_naive computes (uint8_t)(sum * (1.0 / s^2)) for the weighted sum of a
+// pixel's four neighbours, sum <= 255 * s^2. scale1 gets the same result with
+// integer arithmetic only: sum / s^2 by multiplying with a reciprocal and
+// shifting (see Granlund/Montgomery, "Division by Invariant Integers using
+// Multiplication"). Because 1.0 / s^2 is rounded, the double product falls
+// just short of k for some exact multiples sum = k * s^2 (e.g. s = 7, k = 1),
+// and truncation turns that into k - 1. quirk[k] records those cases.
+struct scale1_tables_st {
+  uint64_t s2;
+  uint64_t mul; // 0 if s^2 is too large for the reciprocal, then we divide
+  unsigned shift;
+  bool any_quirk;
+  uint8_t quirk[256];
+};
 
-  size_t width_out = width * scale_factor;
+static void scale1_tables(size_t scale_factor, struct scale1_tables_st *t) {
+  t->s2 = (uint64_t)scale_factor * scale_factor;
+  // With l = ceil(log2(s^2)), sums are below 2^(l + 8). Then
+  // mul = 2^(2l + 8) / s^2 + 1 gives exact quotients, as long as
+  // sum * mul < 2^(2l + 17) fits in 64 bits.
+  unsigned l = 0;
+  while (l < 64 && (UINT64_C(1) << l) < t->s2)
+    l++;
+  if (l <= 23) {
+    t->shift = 2 * l + 8;
+    t->mul = (UINT64_C(1) << t->shift) / t->s2 + 1;
+  } else {
+    t->shift = 0;
+    t->mul = 0;
+  }
 
-  double s2 = 1.0 / ((double)(scale_factor * scale_factor));
+  double s2inv = 1.0 / (scale_factor * scale_factor);
+  t->any_quirk = false;
+  for (size_t k = 0; k < 256; k++) {
+    t->quirk[k] = (uint8_t)(s2inv * (double)(k * t->s2)) != k;
+    t->any_quirk |= t->quirk[k];
+  }
+}
 
-  const uint8_t *q00 = img;
-  const uint8_t *q01 = q00 + CHANNELS;
-  const uint8_t *q10 = q00 + CHANNELS * width;
-  const uint8_t *q11 = q10 + CHANNELS;
-
-  size_t *c0 = malloc(scale_factor * scale_factor * sizeof(size_t *));
-  size_t *c1 = malloc(scale_factor * scale_factor * sizeof(size_t *));
-  size_t *c2 = malloc(scale_factor * scale_factor * sizeof(size_t *));
-  size_t *c3 = malloc(scale_factor * scale_factor * sizeof(size_t *));
-  if (!c0 || !c1 || !c2 || !c3) {
-    if (c0)
-      free(c0);
-    if (c1)
-      free(c1);
-    if (c2)
-      free(c2);
-    if (c3)
-      free(c3);
-    errno = ENOMEM;
-    return;
+// Lookup tables shared by scale5, scale6 and scale7. Within the run of
+// 3 * scale_factor output bytes that one source pixel expands to, byte b
+// belongs to channel b % 3 of the pixel x = b / 3. The kernels keep the
+// vertically blended left pixel in lanes 0-2 of a register and the right pixel
+// in lanes 3-5, so they can pick each byte's inputs with a lane permutation.
+//
+// scale5 and scale6 do the arithmetic in float: up to SCALE5_MAX_FACTOR, all
+// weighted sums are integers below 2^24, so they are exact, and float
+// multiplies are a lot cheaper than _mm_mullo_epi32. scale7 is meant for
+// large factors and uses the integer weights iwl/iwr instead.
+//
+// The tables are len entries long each, len being 3 * scale_factor rounded up
+// to a multiple of 32 so the kernels may read whole vectors past the end of
+// the run:
+//   chl:  b % 3       (lane of the left pixel)
+//   chr:  b % 3 + 3   (lane of the right pixel)
+//   wl:   scale_factor - x
+//   wr:   x
+//   iwl, iwr: the same as integers
+//   one:  1           (together with zero: runs that need no horizontal
+//   zero: 0            interpolation, i.e. the last column)
+struct wide_tables_st {
+  int32_t *chl;
+  int32_t *chr;
+  float *wl;
+  float *wr;
+  int32_t *iwl;
+  int32_t *iwr;
+  float *one;
+  float *zero;
+};
+
+// Return value:
+//   0 on success
+//   1 if allocating memory failed
+// tab->chl holds all tables, scale_plan_free() frees it.
+static int wide_tables(size_t scale_factor, struct wide_tables_st *tab) {
+  size_t len = (3 * scale_factor + 31) / 32 * 32;
+  tab->chl = malloc(4 * len * sizeof(int32_t) + 4 * len * sizeof(float));
+  if (!tab->chl)
+    return 1;
+  tab->chr = tab->chl + len;
+  tab->iwl = tab->chr + len;
+  tab->iwr = tab->iwl + len;
+  tab->wl = (float *)(tab->iwr + len);
+  tab->wr = tab->wl + len;
+  tab->one = tab->wr + len;
+  tab->zero = tab->one + len;
+  for (size_t b = 0; b < len; b++) {
+    tab->chl[b] = b % 3;
+    tab->chr[b] = b % 3 + 3;
+    tab->wl[b] = scale_factor - b / 3;
+    tab->wr[b] = b / 3;
+    tab->iwl[b] = scale_factor - b / 3;
+    tab->iwr[b] = b / 3;
+    tab->one[b] = 1;
+    tab->zero[b] = 0;
   }
+  return 0;
+}
 
-  for (size_t y = 0; y < scale_factor; y++) {
-    for (size_t x = 0; x < scale_factor; x++) {
-      c0[y * scale_factor + x] = (scale_factor - x) * (scale_factor - y);
-      c1[y * scale_factor + x] = (scale_factor - x) * y;
-      c2[y * scale_factor + x] = x * (scale_factor - y);
-      c3[y * scale_factor + x] = x * y;
+// Everything the implementations precompute for one scale factor:
+//   t1:   scale1's division tables
+//   wide: the lane and weight tables of scale5, scale6 and scale7
+//   xw:   scale3's horizontal weights (s-x, x, s-x, x) for each x, and
+//   yw:   its vertical weights (s-y, s-y, y, y) for each y (highest lane
+//         first). Their product holds the weights of the four neighbours of
+//         output pixel (x, y).
+//   hwl, hwr: scale8's horizontal weights s - b / c and b / c for byte b of a
+//         run of a pixel with c channels, padded to whole vectors. Indexed by
+//         c, which is 1, 3 or 4.
+//
+// A plan only holds the parts (PLAN_* bits) that the kernels used with its
+// factor so far; scale_plan() builds missing ones. The last PLANS_MAX plans
+// are cached, shared by all threads, so scaling many images at the same factor
+// (batches, timing loops, the bands of scale_parallel()) builds them only once.
+// Parts are only added under the lock and never changed afterwards, so a
+// kernel can use the parts it asked for without holding it. refs counts those
+// kernels: a plan that drops out of the cache is freed when the last of them
+// is done with it.
+#define PLANS_MAX 8
+
+enum plan_part {
+  PLAN_SCALE1 = 1,
+  PLAN_WIDE = 2,
+  PLAN_SCALE3 = 4,
+  PLAN_SCALE8_GREY = 8,
+  PLAN_SCALE8_RGB = 16,
+  PLAN_SCALE8_RGBA = 32,
+  PLAN_ALL = 63
+};
+
+struct scale_plan_st {
+  size_t scale_factor;
+  unsigned parts;
+  size_t refs;
+  bool cached;
+  struct scale1_tables_st t1;
+  struct wide_tables_st wide;
+  __m128i *xw;
+  __m128i *yw;
+  int16_t *hwl[5];
+  int16_t *hwr[5];
+};
+
+static pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
+// Most recently used first
+static struct scale_plan_st *plans[PLANS_MAX];
+static size_t plans_count;
+
+static void scale_plan_free(struct scale_plan_st *plan) {
+  free(plan->wide.chl);
+  free(plan->xw);
+  free(plan->yw);
+  for (size_t c = 1; c < 5; c++)
+    free(plan->hwl[c]);
+  free(plan);
+}
+
+// The PLAN_* bit of scale8's tables for pixels of <channels> bytes
+static unsigned plan_scale8(size_t channels) {
+  return channels == 1   ? PLAN_SCALE8_GREY
+         : channels == 4 ? PLAN_SCALE8_RGBA
+                         : PLAN_SCALE8_RGB;
+}
+
+// Builds the parts of plan that are missing. Call with plans_lock held.
+// Return value:
+//   0 on success
+//   1 if allocating memory failed (the parts built so far are kept)
+static int scale_plan_build(struct scale_plan_st *plan, unsigned parts) {
+  const size_t scale_factor = plan->scale_factor;
+  parts &= ~plan->parts;
+
+  if (parts & PLAN_SCALE1) {
+    scale1_tables(scale_factor, &plan->t1);
+    plan->parts |= PLAN_SCALE1;
+  }
+  if (parts & PLAN_WIDE) {
+    if (wide_tables(scale_factor, &plan->wide))
+      return 1;
+    plan->parts |= PLAN_WIDE;
+  }
+  if (parts & PLAN_SCALE3) {
+    plan->xw = malloc(scale_factor * sizeof(__m128i));
+    plan->yw = malloc(scale_factor * sizeof(__m128i));
+    if (!plan->xw || !plan->yw) {
+      free(plan->xw);
+      free(plan->yw);
+      plan->xw = plan->yw = NULL;
+      return 1;
+    }
+    for (size_t i = 0; i < scale_factor; i++) {
+      const int32_t s = scale_factor, k = i;
+      plan->xw[i] = _mm_set_epi32(s - k, k, s - k, k);
+      plan->yw[i] = _mm_set_epi32(s - k, s - k, k, k);
+    }
+    plan->parts |= PLAN_SCALE3;
+  }
+  static const size_t channels[] = {1, 3, 4};
+  for (size_t i = 0; i < 3; i++) {
+    const size_t c = channels[i];
+    if (!(parts & plan_scale8(c)))
+      continue;
+    // hwl and hwr share one allocation, starting at hwl[c]
+    const size_t len = (c * scale_factor + 7) / 8 * 8;
+    int16_t *hw = malloc(2 * len * sizeof(int16_t));
+    if (!hw)
+      return 1;
+    plan->hwl[c] = hw;
+    plan->hwr[c] = hw + len;
+    for (size_t b = 0; b < len; b++) {
+      plan->hwl[c][b] = scale_factor - b / c;
+      plan->hwr[c][b] = b / c;
+    }
+    plan->parts |= plan_scale8(c);
+  }
+  return 0;
+}
+
+// Return value:
+//   the plan for scale_factor with at least the given parts, to be released
+//   with scale_plan_put()
+//   NULL if allocating memory failed (errno is set to ENOMEM)
+static struct scale_plan_st *scale_plan(size_t scale_factor, unsigned parts) {
+  pthread_mutex_lock(&plans_lock);
+  size_t i = 0;
+  while (i < plans_count && plans[i]->scale_factor != scale_factor)
+    i++;
+  struct scale_plan_st *plan;
+  if (i < plans_count) {
+    plan = plans[i];
+  } else {
+    plan = calloc(1, sizeof(struct scale_plan_st));
+    if (!plan)
+      goto fail;
+    plan->scale_factor = scale_factor;
+    plan->cached = true;
+    if (plans_count == PLANS_MAX) {
+      // Drop the least recently used plan
+      struct scale_plan_st *old = plans[--plans_count];
+      old->cached = false;
+      if (!old->refs)
+        scale_plan_free(old);
     }
+    i = plans_count++;
+  }
+  memmove(plans + 1, plans, i * sizeof(struct scale_plan_st *));
+  plans[0] = plan;
+  if (scale_plan_build(plan, parts))
+    goto fail;
+  plan->refs++;
+  pthread_mutex_unlock(&plans_lock);
+  return plan;
+
+fail:
+  pthread_mutex_unlock(&plans_lock);
+  errno = ENOMEM;
+  return NULL;
+}
+
+static void scale_plan_put(struct scale_plan_st *plan) {
+  pthread_mutex_lock(&plans_lock);
+  if (!--plan->refs && !plan->cached)
+    scale_plan_free(plan);
+  pthread_mutex_unlock(&plans_lock);
+}
+
+int scale_prepare(size_t scale_factor) {
+  struct scale_plan_st *plan = scale_plan(scale_factor, PLAN_ALL);
+  if (!plan)
+    return 1;
+  scale_plan_put(plan);
+  return 0;
+}
+
+void scale_plans_free(void) {
+  pthread_mutex_lock(&plans_lock);
+  for (size_t i = 0; i < plans_count; i++) {
+    plans[i]->cached = false;
+    if (!plans[i]->refs)
+      scale_plan_free(plans[i]);
   }
+  plans_count = 0;
+  pthread_mutex_unlock(&plans_lock);
+}
+
+static inline uint8_t scale1_div(const struct scale1_tables_st *t,
+                                 uint64_t sum) {
+  uint64_t q = t->mul ? (sum * t->mul) >> t->shift : sum / t->s2;
+  if (t->any_quirk && q * t->s2 == sum && t->quirk[q])
+    q--;
+  return q;
+}
+
+void scale1(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result) {
+  scale1_band(img, width, height, scale_factor, result, 0, height);
+}
+
+// scale1_band() for pixels of <channels> bytes. Inlined into one function per
+// channel count, so that the loops over the channels have a constant bound.
+static inline __attribute__((always_inline)) void
+scale1_band_channels(const uint8_t *img, size_t width, size_t height,
+                     size_t scale_factor, uint8_t *result, size_t eta_begin,
+                     size_t eta_end, const size_t channels) {
+  const size_t s = scale_factor;
+  const size_t px_width = channels * width;
+  const size_t px_width_out = px_width * s;
+  struct scale_plan_st *plan = scale_plan(s, PLAN_SCALE1);
+  if (!plan)
+    return;
+  // A local copy: the compiler can't tell that stores to result don't modify
+  // the plan, and would reload the tables after each one
+  const struct scale1_tables_st t = plan->t1;
 
   // let xi, eta be the original image coordinate system, let x,y be the scaled
   // image local coordinate system
-  for (size_t eta = 0; eta < height - 1; eta++) {
-    for (size_t xi = 0; xi < width - 1; xi++) {
-      for (size_t y = 0; y < scale_factor; y++) {
-        for (size_t x = 0; x < scale_factor; x++) {
-          for (size_t i = 0; i < CHANNELS; i++) {
-            result[CHANNELS * (scale_factor * (width_out * eta + xi) +
-                               width_out * y + x) +
-                   i] =
-                (uint8_t)(s2 * (c0[y * scale_factor + x] *
-                                    q00[CHANNELS * (eta * width + xi) + i] +
-                                c1[y * scale_factor + x] *
-                                    q10[CHANNELS * (eta * width + xi) + i] +
-                                c2[y * scale_factor + x] *
-                                    q01[CHANNELS * (eta * width + xi) + i] +
-                                c3[y * scale_factor + x] *
-                                    q11[CHANNELS * (eta * width + xi) + i]));
-          }
+  for (size_t eta = eta_begin; eta < eta_end && eta < height; eta++) {
+    const bool last_row = eta == height - 1;
+    const uint8_t *q0 = img + eta * px_width;
+    // The last row is interpolated with itself, i.e. only horizontally
+    const uint8_t *q1 = last_row ? q0 : q0 + px_width;
+
+    for (size_t y = 0; y < s; y++) {
+      uint8_t *out = result + (eta * s + y) * px_width_out;
+      for (size_t xi = 0; xi < width; xi++) {
+        const bool last_col = xi == width - 1;
+        const size_t left = channels * xi;
+        // The last column is interpolated with itself, i.e. only vertically
+        const size_t right = last_col ? left : left + channels;
+        uint8_t *block = out + left * s;
+
+        if (last_row && last_col) {
+          // The bottom right corner is a copy of the last pixel
+          for (size_t x = 0; x < s; x++)
+            memcpy(block + channels * x, q0 + left, channels);
+          continue;
         }
-      }
-    }
-    // last column
-    for (size_t y = 0; y < scale_factor; y++) {
-      for (size_t x = 0; x < scale_factor; x++) {
-        for (size_t i = 0; i < CHANNELS; i++) {
-          result[CHANNELS * (scale_factor * (width_out * eta + width - 1) +
-                             width_out * y + x) +
-                 i] =
-              (uint8_t)(s2 *
-                        (c0[y * scale_factor + x] *
-                             q00[CHANNELS * (eta * width + width - 1) + i] +
-                         c1[y * scale_factor + x] *
-                             q10[CHANNELS * (eta * width + width - 1) + i] +
-                         c2[y * scale_factor + x] *
-                             q00[CHANNELS * (eta * width + width - 1) + i] +
-                         c3[y * scale_factor + x] *
-                             q10[CHANNELS * (eta * width + width - 1) + i]));
+
+        for (size_t i = 0; i < channels; i++) {
+          // sum = (s - x) * a + x * b, for x = 0, 1, ...
+          int64_t a = (int64_t)((s - y) * q0[left + i] + y * q1[left + i]);
+          int64_t b = (int64_t)((s - y) * q0[right + i] + y * q1[right + i]);
+          int64_t sum = s * a;
+          for (size_t x = 0; x < s; x++, sum += b - a)
+            block[channels * x + i] = scale1_div(&t, sum);
         }
+        // Like scale_naive, copy the source pixel to the top left of each
+        // block that is interpolated in both directions
+        if (y == 0 && !last_row && !last_col)
+          memcpy(block, q0 + left, channels);
       }
     }
   }
-  // last row
-  for (size_t xi = 0; xi < width - 1; xi++) {
-    for (size_t y = 0; y < scale_factor; y++) {
-      for (size_t x = 0; x < scale_factor; x++) {
-        for (size_t i = 0; i < CHANNELS; i++) {
-          result[CHANNELS * (scale_factor * (width_out * (height - 1) + xi) +
-                             width_out * y + x) +
-                 i] =
-              (uint8_t)(s2 *
-                        (c0[y * scale_factor + x] *
-                             q00[CHANNELS * ((height - 1) * width + xi) + i] +
-                         c1[y * scale_factor + x] *
-                             q00[CHANNELS * ((height - 1) * width + xi) + i] +
-                         c2[y * scale_factor + x] *
-                             q01[CHANNELS * ((height - 1) * width + xi) + i] +
-                         c3[y * scale_factor + x] *
-                             q01[CHANNELS * ((height - 1) * width + xi) + i]));
+  scale_plan_put(plan);
+}
+
+void scale1_band(const uint8_t *img, size_t width, size_t height,
+                 size_t scale_factor, uint8_t *result, size_t eta_begin,
+                 size_t eta_end) {
+  scale1_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, CHANNELS);
+}
+
+void scale1_band_grey(const uint8_t *img, size_t width, size_t height,
+                      size_t scale_factor, uint8_t *result, size_t eta_begin,
+                      size_t eta_end) {
+  scale1_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 1);
+}
+
+void scale1_band_rgba(const uint8_t *img, size_t width, size_t height,
+                      size_t scale_factor, uint8_t *result, size_t eta_begin,
+                      size_t eta_end) {
+  scale1_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 4);
+}
+
+// scale1_band_channels() for 16-bit samples. The sums reach 65535 * s^2, so
+// they are divided the way scale_naive16 does it, by multiplying with 1.0 / s^2
+// in double precision; the tables and quirks of the 8-bit path don't apply.
+static inline __attribute__((always_inline)) void
+scale1_band16_channels(const uint8_t *img8, size_t width, size_t height,
+                       size_t scale_factor, uint8_t *result8, size_t eta_begin,
+                       size_t eta_end, const size_t channels) {
+  const uint16_t *img = (const uint16_t *)img8;
+  uint16_t *result = (uint16_t *)result8;
+  const size_t s = scale_factor;
+  const size_t px_width = channels * width;
+  const size_t px_width_out = px_width * s;
+  const double s2inv = 1.0 / ((double)s * s);
+
+  for (size_t eta = eta_begin; eta < eta_end && eta < height; eta++) {
+    const bool last_row = eta == height - 1;
+    const uint16_t *q0 = img + eta * px_width;
+    const uint16_t *q1 = last_row ? q0 : q0 + px_width;
+
+    for (size_t y = 0; y < s; y++) {
+      uint16_t *out = result + (eta * s + y) * px_width_out;
+      for (size_t xi = 0; xi < width; xi++) {
+        const bool last_col = xi == width - 1;
+        const size_t left = channels * xi;
+        const size_t right = last_col ? left : left + channels;
+        uint16_t *block = out + left * s;
+
+        if (last_row && last_col) {
+          for (size_t x = 0; x < s; x++)
+            memcpy(block + channels * x, q0 + left, 2 * channels);
+          continue;
         }
+
+        for (size_t i = 0; i < channels; i++) {
+          int64_t a = (int64_t)((s - y) * q0[left + i] + y * q1[left + i]);
+          int64_t b = (int64_t)((s - y) * q0[right + i] + y * q1[right + i]);
+          int64_t sum = s * a;
+          for (size_t x = 0; x < s; x++, sum += b - a)
+            block[channels * x + i] = (uint16_t)(s2inv * (double)sum);
+        }
+        if (y == 0 && !last_row && !last_col)
+          memcpy(block, q0 + left, 2 * channels);
       }
     }
   }
-  // right bottom corner
-  for (size_t y = 0; y < scale_factor; y++) {
-    for (size_t x = 0; x < scale_factor; x++) {
-      for (size_t i = 0; i < CHANNELS; i++) {
-        result[CHANNELS *
-                   (scale_factor * (width_out * (height - 1) + (width - 1)) +
-                    width_out * y + x) +
-               i] = q00[CHANNELS * ((height - 1) * width + (width - 1)) + i];
-      }
-    }
-  }
-  free(c0);
-  free(c1);
-  free(c2);
-  free(c3);
+}
+
+void scale1_band16(const uint8_t *img, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result, size_t eta_begin,
+                   size_t eta_end) {
+  scale1_band16_channels(img, width, height, scale_factor, result, eta_begin,
+                         eta_end, CHANNELS);
+}
+
+void scale1_band16_grey(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result,
+                        size_t eta_begin, size_t eta_end) {
+  scale1_band16_channels(img, width, height, scale_factor, result, eta_begin,
+                         eta_end, 1);
+}
+
+void scale1_band16_rgba(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result,
+                        size_t eta_begin, size_t eta_end) {
+  scale1_band16_channels(img, width, height, scale_factor, result, eta_begin,
+                         eta_end, 4);
 }
 
 void scale2(const uint8_t *img, size_t width, size_t height,
             size_t scale_factor, uint8_t *result) {
+  scale2_band(img, width, height, scale_factor, result, 0, height);
+}
+
+void scale2_band(const uint8_t *img, size_t width, size_t height,
+                 size_t scale_factor, uint8_t *result, size_t eta_begin,
+                 size_t eta_end) {
   size_t width_out = width * scale_factor;
-  for (size_t x = 0; x < (height - 1) * scale_factor; x++) {
+  size_t eta_stop = eta_end < height - 1 ? eta_end : height - 1;
+  for (size_t x = eta_begin * scale_factor; x < eta_stop * scale_factor;
+       x++) {
     for (size_t y = 0; y < (width - 1) * scale_factor; y++) {
 
       size_t orX = x / scale_factor;
@@ -177,7 +518,7 @@ void scale2(const uint8_t *img, size_t width, size_t height,
   }
 
   // last column
-  for (size_t eta = 0; eta < height - 1; eta++) {
+  for (size_t eta = eta_begin; eta < eta_stop; eta++) {
     for (size_t y = 0; y < scale_factor; y++) {
       for (size_t x = 0; x < scale_factor; x++) {
         for (size_t i = 0; i < CHANNELS; i++) {
@@ -188,6 +529,8 @@ void scale2(const uint8_t *img, size_t width, size_t height,
       }
     }
   }
+  if (eta_end < height)
+    return;
   // last row
   for (size_t xi = 0; xi < width - 1; xi++) {
     for (size_t y = 0; y < scale_factor; y++) {
@@ -215,11 +558,22 @@ void scale2(const uint8_t *img, size_t width, size_t height,
 
 void scale3(const uint8_t *img, size_t width, size_t height,
             size_t scale_factor, uint8_t *result) {
+  scale3_band(img, width, height, scale_factor, result, 0, height);
+}
+
+void scale3_band(const uint8_t *img, size_t width, size_t height,
+                 size_t scale_factor, uint8_t *result, size_t eta_begin,
+                 size_t eta_end) {
   size_t width_out = width * scale_factor;
+  size_t eta_stop = eta_end < height - 1 ? eta_end : height - 1;
 
+  struct scale_plan_st *plan = scale_plan(scale_factor, PLAN_SCALE3);
+  if (!plan)
+    return;
+  const __m128i *xw = plan->xw, *yw = plan->yw;
   double s2 = 1.0 / ((double)(scale_factor * scale_factor));
 
-  for (size_t eta = 0; eta < height - 1; eta++) {
+  for (size_t eta = eta_begin; eta < eta_stop; eta++) {
 
     size_t y0 = eta * scale_factor;
 
@@ -278,12 +632,7 @@ void scale3(const uint8_t *img, size_t width, size_t height,
 
         for (size_t x = 0; x < scale_factor; x++) {
 
-          size_t c0 = ((scale_factor - x) * (scale_factor - y));
-          size_t c1 = ((scale_factor - x) * y);
-          size_t c2 = (x * (scale_factor - y));
-          size_t c3 = (x * y);
-
-          __m128i ms00 = _mm_set_epi32(c0, c2, c1, c3);
+          __m128i ms00 = _mm_mullo_epi32(xw[x], yw[y]);
 
           __m128i resRed = _mm_mullo_epi32(mcRed, ms00);
           __m128i resGreen = _mm_mullo_epi32(mcGreen, ms00);
@@ -336,33 +685,44 @@ void scale3(const uint8_t *img, size_t width, size_t height,
           result[CHANNELS * (width_out * (y0 + y) + (x0 + x)) + 2] =
               (uint8_t)(_mm_extract_epi32(resBlue, 0) * s2);
 
-          result[CHANNELS * (width_out * (y0 + y) + (x2 + x)) + 0] =
-              (uint8_t)(_mm_extract_epi32(resRed2, 0) * s2);
-          result[CHANNELS * (width_out * (y0 + y) + (x2 + x)) + 1] =
-              (uint8_t)(_mm_extract_epi32(resGreen2, 0) * s2);
-          result[CHANNELS * (width_out * (y0 + y) + (x2 + x)) + 2] =
-              (uint8_t)(_mm_extract_epi32(resBlue2, 0) * s2);
-
-          result[CHANNELS * (width_out * (y0 + y) + (x3 + x)) + 0] =
-              (uint8_t)(_mm_extract_epi32(resRed3, 0) * s2);
-          result[CHANNELS * (width_out * (y0 + y) + (x3 + x)) + 1] =
-              (uint8_t)(_mm_extract_epi32(resGreen3, 0) * s2);
-          result[CHANNELS * (width_out * (y0 + y) + (x3 + x)) + 2] =
-              (uint8_t)(_mm_extract_epi32(resBlue3, 0) * s2);
-
-          result[CHANNELS * (width_out * (y0 + y) + (x4 + x)) + 0] =
-              (uint8_t)(_mm_extract_epi32(resRed4, 0) * s2);
-          result[CHANNELS * (width_out * (y0 + y) + (x4 + x)) + 1] =
-              (uint8_t)(_mm_extract_epi32(resGreen4, 0) * s2);
-          result[CHANNELS * (width_out * (y0 + y) + (x4 + x)) + 2] =
-              (uint8_t)(_mm_extract_epi32(resBlue4, 0) * s2);
+          // The block may hang over the right edge of the image. Those
+          // pixels would wrap around into the next output row, which
+          // might belong to another band (see scale_parallel()).
+          if (xi + 1 < width - 1) {
+            result[CHANNELS * (width_out * (y0 + y) + (x2 + x)) + 0] =
+                (uint8_t)(_mm_extract_epi32(resRed2, 0) * s2);
+            result[CHANNELS * (width_out * (y0 + y) + (x2 + x)) + 1] =
+                (uint8_t)(_mm_extract_epi32(resGreen2, 0) * s2);
+            result[CHANNELS * (width_out * (y0 + y) + (x2 + x)) + 2] =
+                (uint8_t)(_mm_extract_epi32(resBlue2, 0) * s2);
+          }
+
+          if (xi + 2 < width - 1) {
+            result[CHANNELS * (width_out * (y0 + y) + (x3 + x)) + 0] =
+                (uint8_t)(_mm_extract_epi32(resRed3, 0) * s2);
+            result[CHANNELS * (width_out * (y0 + y) + (x3 + x)) + 1] =
+                (uint8_t)(_mm_extract_epi32(resGreen3, 0) * s2);
+            result[CHANNELS * (width_out * (y0 + y) + (x3 + x)) + 2] =
+                (uint8_t)(_mm_extract_epi32(resBlue3, 0) * s2);
+          }
+
+          if (xi + 3 < width - 1) {
+            result[CHANNELS * (width_out * (y0 + y) + (x4 + x)) + 0] =
+                (uint8_t)(_mm_extract_epi32(resRed4, 0) * s2);
+            result[CHANNELS * (width_out * (y0 + y) + (x4 + x)) + 1] =
+                (uint8_t)(_mm_extract_epi32(resGreen4, 0) * s2);
+            result[CHANNELS * (width_out * (y0 + y) + (x4 + x)) + 2] =
+                (uint8_t)(_mm_extract_epi32(resBlue4, 0) * s2);
+          }
         }
       }
     }
   }
+  scale_plan_put(plan);
+
 
   // last column
-  for (size_t eta = 0; eta < height - 1; eta++) {
+  for (size_t eta = eta_begin; eta < eta_stop; eta++) {
     for (size_t y = 0; y < scale_factor; y++) {
       for (size_t x = 0; x < scale_factor; x++) {
         for (size_t i = 0; i < CHANNELS; i++) {
@@ -374,6 +734,8 @@ void scale3(const uint8_t *img, size_t width, size_t height,
     }
   }
 
+  if (eta_end < height)
+    return;
   // last row
   for (size_t xi = 0; xi < width - 1; xi++) {
     for (size_t y = 0; y < scale_factor; y++) {
@@ -402,6 +764,12 @@ void scale3(const uint8_t *img, size_t width, size_t height,
 // NOTE: Works only with scale_factor <= 16
 void scale4(const uint8_t *img, size_t width, size_t height,
             size_t scale_factor, uint8_t *result) {
+  scale4_band(img, width, height, scale_factor, result, 0, height);
+}
+
+void scale4_band(const uint8_t *img, size_t width, size_t height,
+                 size_t scale_factor, uint8_t *result, size_t eta_begin,
+                 size_t eta_end) {
   const size_t px_width =
       width * 3; // The width if you count 3 bytes for each pixel
   const size_t px_width_out = px_width * scale_factor;
@@ -435,7 +803,8 @@ void scale4(const uint8_t *img, size_t width, size_t height,
   // sxx: stores (s-x) x
   // mres: stores result of multiplication
   __m128i pxvals1, pxvals2, sxx, syy, sy, mres1, mres2;
-  for (size_t yglobal = 0; yglobal < height - 1; yglobal += 1) {
+  for (size_t yglobal = eta_begin; yglobal < eta_end && yglobal < height - 1;
+       yglobal += 1) {
     for (size_t xglobal = 0; xglobal < px_width - 3; xglobal += 3) {
       // Note: _mm_loadu_si64 also sets bits 127:64 of the xmm register to 0
       pxvals1 = _mm_loadu_si64(img + yglobal * px_width + xglobal);
@@ -528,6 +897,9 @@ void scale4(const uint8_t *img, size_t width, size_t height,
     }
   }
 
+  if (eta_end < height)
+    return;
+
   // In the last row, there is nothing left to interpolate vertically.
   // Just interpolate horizontally and copy across the columns.
   const uint8_t *last_line = img + (height - 1) * px_width;
@@ -588,8 +960,1244 @@ void scale4(const uint8_t *img, size_t width, size_t height,
   }
 }
 
+// Writes the nbytes (at most len) bytes of one run, 16 per iteration:
+//   (wl * left + wr * right) * factor
+// where left/right are the lanes of v chosen by chl/chr. Whole vectors are
+// stored as long as they fit into the room bytes that may be written; runs
+// are written left to right, so spilling into the next run is harmless.
+__attribute__((target("avx2"))) static inline void
+run_avx2(uint8_t *out, size_t nbytes, size_t room, __m256 v,
+         const int32_t *chl, const int32_t *chr, const float *wl,
+         const float *wr, __m256 factor) {
+  for (size_t b = 0; b < nbytes; b += 16) {
+    __m256i res[2];
+    for (int i = 0; i < 2; i++) {
+      const size_t k = b + 8 * i;
+      __m256 left = _mm256_permutevar8x32_ps(
+          v, _mm256_loadu_si256((const __m256i *)(chl + k)));
+      __m256 right = _mm256_permutevar8x32_ps(
+          v, _mm256_loadu_si256((const __m256i *)(chr + k)));
+      __m256 res_flt =
+          _mm256_add_ps(_mm256_mul_ps(left, _mm256_loadu_ps(wl + k)),
+                        _mm256_mul_ps(right, _mm256_loadu_ps(wr + k)));
+      res[i] = _mm256_cvttps_epi32(_mm256_mul_ps(res_flt, factor));
+    }
+    // Narrow 2x8 epi32 to 16 epi8. The pack instructions work within 128-bit
+    // lanes, hence the permutations.
+    __m256i packed = _mm256_packus_epi32(res[0], res[1]);
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+    packed = _mm256_packus_epi16(packed, packed);
+    packed = _mm256_permute4x64_epi64(packed, 0x08);
+    __m128i bytes = _mm256_castsi256_si128(packed);
+
+    if (room - b >= 16)
+      _mm_storeu_si128((__m128i *)(out + b), bytes);
+    else
+      memcpy(out + b, &bytes, nbytes - b);
+  }
+}
+
+// Same as run_avx2(), but 32 bytes per iteration. Masked stores make the
+// room argument unnecessary.
+__attribute__((target("avx512f,avx512bw,avx512vl"))) static inline void
+run_avx512(uint8_t *out, size_t nbytes, __m512 v, const int32_t *chl,
+           const int32_t *chr, const float *wl, const float *wr,
+           __m512 factor) {
+  for (size_t b = 0; b < nbytes; b += 32) {
+    __m128i res[2];
+    for (int i = 0; i < 2; i++) {
+      const size_t k = b + 16 * i;
+      __m512 left = _mm512_permutexvar_ps(_mm512_loadu_si512(chl + k), v);
+      __m512 right = _mm512_permutexvar_ps(_mm512_loadu_si512(chr + k), v);
+      __m512 res_flt =
+          _mm512_add_ps(_mm512_mul_ps(left, _mm512_loadu_ps(wl + k)),
+                        _mm512_mul_ps(right, _mm512_loadu_ps(wr + k)));
+      res[i] = _mm512_cvtepi32_epi8(
+          _mm512_cvttps_epi32(_mm512_mul_ps(res_flt, factor)));
+    }
+    __m256i bytes =
+        _mm256_inserti128_si256(_mm256_castsi128_si256(res[0]), res[1], 1);
+    __mmask32 mask =
+        nbytes - b >= 32 ? 0xffffffff : ((uint32_t)1 << (nbytes - b)) - 1;
+    _mm256_mask_storeu_epi8(out + b, mask, bytes);
+  }
+}
+
+// Variant of scale4 for AVX2. Instead of one output pixel per store, it
+// computes 16 output bytes (5 1/3 pixels) at a time. The arithmetic is the same
+// as in scale4: exact weighted sum, multiplied with 1/s^2 as float and
+// truncated, so the results are identical.
+void scale5(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result) {
+  scale5_band(img, width, height, scale_factor, result, 0, height);
+}
+
+__attribute__((target("avx2"))) void
+scale5_band(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result, size_t eta_begin,
+            size_t eta_end) {
+  const size_t px_width = width * 3;
+  const size_t px_width_out = px_width * scale_factor;
+  const size_t run = 3 * scale_factor;
+
+  struct scale_plan_st *plan = scale_plan(scale_factor, PLAN_WIDE);
+  if (!plan)
+    return;
+  const struct wide_tables_st *t = &plan->wide;
+
+  const __m256 factor2 = _mm256_set1_ps(1.0 / (scale_factor * scale_factor));
+  const __m256 factor1 = _mm256_set1_ps(1.0 / scale_factor);
+
+  for (size_t eta = eta_begin; eta < eta_end && eta < height - 1; eta++) {
+    const uint8_t *row0 = img + eta * px_width;
+    const uint8_t *row1 = row0 + px_width;
+    for (size_t y = 0; y < scale_factor; y++) {
+      uint8_t *out = result + (eta * scale_factor + y) * px_width_out;
+      const __m256 sy = _mm256_set1_ps(scale_factor - y);
+      const __m256 yy = _mm256_set1_ps(y);
+      for (size_t xi = 0; xi < width; xi++) {
+        // Interpolate vertically first: (s-y)P(0,*) + yP(s,*), for the pixel
+        // in lanes 0-2 and its right neighbour in lanes 3-5.
+        __m256 top = _mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32(_mm_loadu_si64(row0 + 3 * xi)));
+        __m256 bottom = _mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32(_mm_loadu_si64(row1 + 3 * xi)));
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(top, sy),
+                                 _mm256_mul_ps(bottom, yy));
+        if (xi < width - 1)
+          run_avx2(out + xi * run, run, px_width_out - xi * run, v, t->chl,
+                   t->chr, t->wl, t->wr, factor2);
+        else // last column: nothing to interpolate horizontally
+          run_avx2(out + xi * run, run, run, v, t->chl, t->chr, t->one, t->zero,
+                   factor1);
+      }
+    }
+  }
+
+  if (eta_end == height) {
+    // In the last row, there is nothing left to interpolate vertically.
+    // Produce the first output row, then copy it.
+    const uint8_t *last_line = img + (height - 1) * px_width;
+    uint8_t *out = result + (height - 1) * scale_factor * px_width_out;
+    for (size_t xi = 0; xi < width; xi++) {
+      __m256 v = _mm256_cvtepi32_ps(
+          _mm256_cvtepu8_epi32(_mm_loadu_si64(last_line + 3 * xi)));
+      if (xi < width - 1)
+        run_avx2(out + xi * run, run, px_width_out - xi * run, v, t->chl,
+                 t->chr, t->wl, t->wr, factor1);
+      else // bottom right corner: just copy the pixel
+        run_avx2(out + xi * run, run, run, v, t->chl, t->chr, t->one, t->zero,
+                 _mm256_set1_ps(1.0));
+    }
+    for (size_t y = 1; y < scale_factor; y++)
+      memcpy(out + y * px_width_out, out, px_width_out);
+  }
+  scale_plan_put(plan);
+}
+
+// Variant of scale5 for AVX-512 (F, BW and VL): 32 output bytes at a time.
+void scale6(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result) {
+  scale6_band(img, width, height, scale_factor, result, 0, height);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl"))) void
+scale6_band(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result, size_t eta_begin,
+            size_t eta_end) {
+  const size_t px_width = width * 3;
+  const size_t px_width_out = px_width * scale_factor;
+  const size_t run = 3 * scale_factor;
+
+  struct scale_plan_st *plan = scale_plan(scale_factor, PLAN_WIDE);
+  if (!plan)
+    return;
+  const struct wide_tables_st *t = &plan->wide;
+
+  const __m512 factor2 = _mm512_set1_ps(1.0 / (scale_factor * scale_factor));
+  const __m512 factor1 = _mm512_set1_ps(1.0 / scale_factor);
+
+  for (size_t eta = eta_begin; eta < eta_end && eta < height - 1; eta++) {
+    const uint8_t *row0 = img + eta * px_width;
+    const uint8_t *row1 = row0 + px_width;
+    for (size_t y = 0; y < scale_factor; y++) {
+      uint8_t *out = result + (eta * scale_factor + y) * px_width_out;
+      const __m512 sy = _mm512_set1_ps(scale_factor - y);
+      const __m512 yy = _mm512_set1_ps(y);
+      for (size_t xi = 0; xi < width; xi++) {
+        __m512 top = _mm512_cvtepi32_ps(
+            _mm512_cvtepu8_epi32(_mm_loadu_si64(row0 + 3 * xi)));
+        __m512 bottom = _mm512_cvtepi32_ps(
+            _mm512_cvtepu8_epi32(_mm_loadu_si64(row1 + 3 * xi)));
+        __m512 v = _mm512_add_ps(_mm512_mul_ps(top, sy),
+                                 _mm512_mul_ps(bottom, yy));
+        if (xi < width - 1)
+          run_avx512(out + xi * run, run, v, t->chl, t->chr, t->wl, t->wr,
+                     factor2);
+        else
+          run_avx512(out + xi * run, run, v, t->chl, t->chr, t->one, t->zero,
+                     factor1);
+      }
+    }
+  }
+
+  if (eta_end == height) {
+    const uint8_t *last_line = img + (height - 1) * px_width;
+    uint8_t *out = result + (height - 1) * scale_factor * px_width_out;
+    for (size_t xi = 0; xi < width; xi++) {
+      __m512 v = _mm512_cvtepi32_ps(
+          _mm512_cvtepu8_epi32(_mm_loadu_si64(last_line + 3 * xi)));
+      if (xi < width - 1)
+        run_avx512(out + xi * run, run, v, t->chl, t->chr, t->wl, t->wr,
+                   factor1);
+      else
+        run_avx512(out + xi * run, run, v, t->chl, t->chr, t->one, t->zero,
+                   _mm512_set1_ps(1.0));
+    }
+    for (size_t y = 1; y < scale_factor; y++)
+      memcpy(out + y * px_width_out, out, px_width_out);
+  }
+  scale_plan_put(plan);
+}
+
+// Like run_avx2(), but with integer sums and the final multiplication with
+// 1/s^2 done in double precision - exactly the way scale_naive does it.
+__attribute__((target("avx2"))) static inline void
+run_avx2_exact(uint8_t *out, size_t nbytes, size_t room, __m256i v,
+               const int32_t *chl, const int32_t *chr, const int32_t *wl,
+               const int32_t *wr, __m256d factor) {
+  for (size_t b = 0; b < nbytes; b += 16) {
+    __m256i res[2];
+    for (int i = 0; i < 2; i++) {
+      const size_t k = b + 8 * i;
+      __m256i left = _mm256_permutevar8x32_epi32(
+          v, _mm256_loadu_si256((const __m256i *)(chl + k)));
+      __m256i right = _mm256_permutevar8x32_epi32(
+          v, _mm256_loadu_si256((const __m256i *)(chr + k)));
+      __m256i sum = _mm256_add_epi32(
+          _mm256_mullo_epi32(left,
+                             _mm256_loadu_si256((const __m256i *)(wl + k))),
+          _mm256_mullo_epi32(right,
+                             _mm256_loadu_si256((const __m256i *)(wr + k))));
+      __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(sum));
+      __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1));
+      res[i] = _mm256_set_m128i(_mm256_cvttpd_epi32(_mm256_mul_pd(hi, factor)),
+                                _mm256_cvttpd_epi32(_mm256_mul_pd(lo, factor)));
+    }
+    __m256i packed = _mm256_packus_epi32(res[0], res[1]);
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+    packed = _mm256_packus_epi16(packed, packed);
+    packed = _mm256_permute4x64_epi64(packed, 0x08);
+    __m128i bytes = _mm256_castsi256_si128(packed);
+
+    if (room - b >= 16)
+      _mm_storeu_si128((__m128i *)(out + b), bytes);
+    else
+      memcpy(out + b, &bytes, nbytes - b);
+  }
+}
+
+// Fast path for large scale factors (AVX2). scale4 to scale6 lose precision
+// above scale_factor 16, while this one keeps 32-bit integer sums and
+// multiplies them with 1/s^2 in double precision, like scale_naive does. It
+// even reproduces scale_naive's boundary handling, so the results are
+// identical for every scale factor up to SCALE7_MAX_FACTOR.
+void scale7(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result) {
+  scale7_band(img, width, height, scale_factor, result, 0, height);
+}
+
+__attribute__((target("avx2"))) void
+scale7_band(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result, size_t eta_begin,
+            size_t eta_end) {
+  const size_t px_width = width * 3;
+  const size_t px_width_out = px_width * scale_factor;
+  const size_t run = 3 * scale_factor;
+
+  struct scale_plan_st *plan = scale_plan(scale_factor, PLAN_WIDE);
+  if (!plan)
+    return;
+  const struct wide_tables_st *t = &plan->wide;
+
+  const __m256d factor = _mm256_set1_pd(1.0 / (scale_factor * scale_factor));
+
+  for (size_t eta = eta_begin; eta < eta_end && eta < height - 1; eta++) {
+    const uint8_t *row0 = img + eta * px_width;
+    const uint8_t *row1 = row0 + px_width;
+    for (size_t y = 0; y < scale_factor; y++) {
+      uint8_t *out = result + (eta * scale_factor + y) * px_width_out;
+      const __m256i sy = _mm256_set1_epi32(scale_factor - y);
+      const __m256i yy = _mm256_set1_epi32(y);
+      for (size_t xi = 0; xi < width; xi++) {
+        __m256i top = _mm256_cvtepu8_epi32(_mm_loadu_si64(row0 + 3 * xi));
+        __m256i bottom = _mm256_cvtepu8_epi32(_mm_loadu_si64(row1 + 3 * xi));
+        __m256i v = _mm256_add_epi32(_mm256_mullo_epi32(top, sy),
+                                     _mm256_mullo_epi32(bottom, yy));
+        if (xi < width - 1)
+          run_avx2_exact(out + xi * run, run, px_width_out - xi * run, v,
+                         t->chl, t->chr, t->iwl, t->iwr, factor);
+        else // last column: (s-x)P + xP, the left pixel on both sides
+          run_avx2_exact(out + xi * run, run, run, v, t->chl, t->chl, t->iwl,
+                         t->iwr, factor);
+      }
+      // scale_naive copies the source pixel instead of computing it
+      if (y == 0) {
+        for (size_t xi = 0; xi < width - 1; xi++)
+          memcpy(out + xi * run, row0 + 3 * xi, 3);
+      }
+    }
+  }
+
+  if (eta_end == height) {
+    // In the last row, scale_naive weighs the same pixel with (s-y) and y
+    const uint8_t *last_line = img + (height - 1) * px_width;
+    uint8_t *out = result + (height - 1) * scale_factor * px_width_out;
+    const __m256i ss = _mm256_set1_epi32(scale_factor);
+    for (size_t xi = 0; xi < width - 1; xi++) {
+      __m256i v = _mm256_mullo_epi32(
+          _mm256_cvtepu8_epi32(_mm_loadu_si64(last_line + 3 * xi)), ss);
+      run_avx2_exact(out + xi * run, run, px_width_out - xi * run, v, t->chl,
+                     t->chr, t->iwl, t->iwr, factor);
+    }
+    // Bottom right corner: copy the pixel
+    for (size_t x = 0; x < scale_factor; x++)
+      memcpy(out + px_width_out - run + 3 * x, last_line + px_width - 3, 3);
+    for (size_t y = 1; y < scale_factor; y++)
+      memcpy(out + y * px_width_out, out, px_width_out);
+  }
+  scale_plan_put(plan);
+}
+
+// Horizontal pass of scale8: the integer sums (s-x)P(xi) + xP(xi+1) of one
+// source row, and s*P(xi) in the last column, where there is no right
+// neighbour. Kept as int16_t for _mm_madd_epi16. The last vector of a run may
+// spill over, so h needs room for 8 more entries.
+static inline __attribute__((always_inline)) void
+scale8_hpass(const struct scale_plan_st *plan, const uint8_t *row,
+             size_t width, int16_t *h, const size_t channels) {
+  // Picks channel (b + j) % 3 of the left pixel into 16-bit lane j, for the
+  // 8 bytes starting at byte b of a run, depending on b % 3. Adding 3 to every
+  // index picks the right pixel instead.
+  static const int8_t lanes3[3][16] = {
+      {0, -1, 1, -1, 2, -1, 0, -1, 1, -1, 2, -1, 0, -1, 1, -1},
+      {1, -1, 2, -1, 0, -1, 1, -1, 2, -1, 0, -1, 1, -1, 2, -1},
+      {2, -1, 0, -1, 1, -1, 2, -1, 0, -1, 1, -1, 2, -1, 0, -1}};
+  // With 1 or 4 channels, every vector of 8 bytes starts with channel 0: 8
+  // times the grey value, or two whole RGBA pixels
+  static const int8_t lanes1[16] = {0, -1, 0, -1, 0, -1, 0, -1,
+                                    0, -1, 0, -1, 0, -1, 0, -1};
+  static const int8_t lanes4[16] = {0, -1, 1, -1, 2, -1, 3, -1,
+                                    0, -1, 1, -1, 2, -1, 3, -1};
+  const __m128i next = _mm_set1_epi16(channels);
+  const size_t scale_factor = plan->scale_factor;
+  const size_t run = channels * scale_factor;
+  const int16_t *hwl = plan->hwl[channels], *hwr = plan->hwr[channels];
+
+  for (size_t xi = 0; xi < width - 1; xi++) {
+    const __m128i px =
+        _mm_loadl_epi64((const __m128i *)(row + channels * xi));
+    int16_t *out = h + xi * run;
+    for (size_t b = 0; b < run; b += 8) {
+      const int8_t *lanes = channels == 1   ? lanes1
+                            : channels == 4 ? lanes4
+                                            : lanes3[b % 3];
+      const __m128i lmask = _mm_loadu_si128((const __m128i *)lanes);
+      __m128i left = _mm_shuffle_epi8(px, lmask);
+      __m128i right = _mm_shuffle_epi8(px, _mm_add_epi16(lmask, next));
+      __m128i sum = _mm_add_epi16(
+          _mm_mullo_epi16(left, _mm_loadu_si128((const __m128i *)(hwl + b))),
+          _mm_mullo_epi16(right, _mm_loadu_si128((const __m128i *)(hwr + b))));
+      _mm_storeu_si128((__m128i *)(out + b), sum);
+    }
+  }
+  for (size_t x = 0; x < scale_factor; x++) {
+    for (size_t i = 0; i < channels; i++) {
+      h[(width - 1) * run + channels * x + i] =
+          scale_factor * row[channels * (width - 1) + i];
+    }
+  }
+}
+
+// Vertical pass of scale8: out[i] = (w0 * h0[i] + w1 * h1[i]) * s2inv for n
+// bytes. The sums are exact 32-bit integers and the multiplication is done in
+// double precision, the same way scale_naive does it.
+static void scale8_vpass(uint8_t *out, size_t n, const int16_t *h0,
+                         const int16_t *h1, int16_t w0, int16_t w1,
+                         double s2inv) {
+  // _mm_madd_epi16 multiplies pairs and adds them up: (h0, h1) . (w0, w1)
+  const __m128i weights = _mm_set_epi16(w1, w0, w1, w0, w1, w0, w1, w0);
+  const __m128d factor = _mm_set1_pd(s2inv);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(h0 + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(h1 + i));
+    __m128i sums[2] = {_mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights),
+                       _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights)};
+    for (int k = 0; k < 2; k++) {
+      // Two doubles per register, so convert the four sums in two steps
+      __m128i q0 =
+          _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(sums[k]), factor));
+      __m128i q1 = _mm_cvttpd_epi32(
+          _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(sums[k], 8)), factor));
+      sums[k] = _mm_unpacklo_epi64(q0, q1);
+    }
+    __m128i packed = _mm_packus_epi32(sums[0], sums[1]);
+    packed = _mm_packus_epi16(packed, packed);
+    _mm_storel_epi64((__m128i *)(out + i), packed);
+  }
+  for (; i < n; i++)
+    out[i] = (uint8_t)(s2inv * (w0 * h0[i] + w1 * h1[i]));
+}
+
+// Separable implementation: each output row is a linear blend of two
+// horizontally interpolated source rows,
+//   (s-y)[(s-x)P00 + xP01] + y[(s-x)P10 + xP11]
+// so every source row is interpolated horizontally only once, into a ring
+// buffer of two rows, and the scale_factor output rows between two source rows
+// are just two-term blends of those. Bit-exact with scale_naive.
+// NOTE: Works only with scale_factor <= SCALE8_MAX_FACTOR
+void scale8(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result) {
+  scale8_band(img, width, height, scale_factor, result, 0, height);
+}
+
+// scale8_band() for pixels of <channels> bytes, inlined like
+// scale1_band_channels()
+static inline __attribute__((always_inline)) void
+scale8_band_channels(const uint8_t *img, size_t width, size_t height,
+                     size_t scale_factor, uint8_t *result, size_t eta_begin,
+                     size_t eta_end, const size_t channels) {
+  const size_t px_width = channels * width;
+  const size_t run = channels * scale_factor;
+  const size_t px_width_out = px_width * scale_factor;
+  const size_t eta_stop = eta_end < height - 1 ? eta_end : height - 1;
+  const double s2inv = 1.0 / (scale_factor * scale_factor);
+
+  struct scale_plan_st *plan = scale_plan(scale_factor, plan_scale8(channels));
+  if (!plan)
+    return;
+  int16_t *ring = malloc(2 * (px_width_out + 8) * sizeof(int16_t));
+  if (!ring) {
+    scale_plan_put(plan);
+    errno = ENOMEM;
+    return;
+  }
+  // Row eta lives in h[eta % 2]
+  int16_t *h[2] = {ring, ring + px_width_out + 8};
+
+  scale8_hpass(plan, img + eta_begin * px_width, width, h[eta_begin % 2],
+               channels);
+  for (size_t eta = eta_begin; eta < eta_stop; eta++) {
+    scale8_hpass(plan, img + (eta + 1) * px_width, width, h[(eta + 1) % 2],
+                 channels);
+    for (size_t y = 0; y < scale_factor; y++) {
+      uint8_t *out = result + (eta * scale_factor + y) * px_width_out;
+      scale8_vpass(out, px_width_out, h[eta % 2], h[(eta + 1) % 2],
+                   scale_factor - y, y, s2inv);
+      // scale_naive copies the source pixel instead of computing it
+      if (y == 0) {
+        for (size_t xi = 0; xi < width - 1; xi++)
+          memcpy(out + xi * run, img + eta * px_width + channels * xi,
+                 channels);
+      }
+    }
+  }
+
+  if (eta_end == height) {
+    // In the last row, there is nothing to interpolate vertically; scale_naive
+    // weighs the same row with (s-y) and y, i.e. with s.
+    const uint8_t *last_line = img + (height - 1) * px_width;
+    uint8_t *out = result + (height - 1) * scale_factor * px_width_out;
+    scale8_vpass(out, px_width_out, h[(height - 1) % 2], h[(height - 1) % 2],
+                 scale_factor, 0, s2inv);
+    // Bottom right corner: copy the pixel
+    for (size_t x = 0; x < scale_factor; x++)
+      memcpy(out + px_width_out - run + channels * x,
+             last_line + px_width - channels, channels);
+    for (size_t y = 1; y < scale_factor; y++)
+      memcpy(out + y * px_width_out, out, px_width_out);
+  }
+  free(ring);
+  scale_plan_put(plan);
+}
+
+void scale8_band(const uint8_t *img, size_t width, size_t height,
+                 size_t scale_factor, uint8_t *result, size_t eta_begin,
+                 size_t eta_end) {
+  scale8_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, CHANNELS);
+}
+
+void scale8_band_grey(const uint8_t *img, size_t width, size_t height,
+                      size_t scale_factor, uint8_t *result, size_t eta_begin,
+                      size_t eta_end) {
+  scale8_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 1);
+}
+
+void scale8_band_rgba(const uint8_t *img, size_t width, size_t height,
+                      size_t scale_factor, uint8_t *result, size_t eta_begin,
+                      size_t eta_end) {
+  scale8_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 4);
+}
+
+// Horizontal pass of scale9 for one channel of a source row:
+//   (s-x)P(xi) + xP(xi+1) = sP(xi) + x(P(xi+1) - P(xi))
+// for the runs of s entries each pixel expands to, and sP(xi) in the last
+// column. Runs are written 4 entries at a time, so h needs room for 3 more.
+static void scale9_hpass(const uint8_t *row, size_t width,
+                         size_t scale_factor, int32_t *h) {
+  const int32_t s = scale_factor;
+  const __m128i ramp = _mm_setr_epi32(0, 1, 2, 3);
+  for (size_t xi = 0; xi < width - 1; xi++) {
+    const int32_t p = row[xi];
+    const int32_t d = row[xi + 1] - p;
+    __m128i v = _mm_add_epi32(_mm_set1_epi32(s * p),
+                              _mm_mullo_epi32(_mm_set1_epi32(d), ramp));
+    const __m128i step = _mm_set1_epi32(4 * d);
+    int32_t *out = h + xi * scale_factor;
+    for (size_t x = 0; x < scale_factor; x += 4) {
+      _mm_storeu_si128((__m128i *)(out + x), v);
+      v = _mm_add_epi32(v, step);
+    }
+  }
+  const __m128i last = _mm_set1_epi32(s * row[width - 1]);
+  int32_t *out = h + (width - 1) * scale_factor;
+  for (size_t x = 0; x < scale_factor; x += 4)
+    _mm_storeu_si128((__m128i *)(out + x), last);
+}
+
+// One output row of one channel of scale9: out[i] = acc[i] * s2inv, truncated
+// the way scale_naive does it, then acc[i] += dlt[i] for the next row. Writes
+// n bytes rounded up to a multiple of 8.
+static void scale9_vstep(uint8_t *out, size_t n, int32_t *acc,
+                         const int32_t *dlt, double s2inv) {
+  const __m128d factor = _mm_set1_pd(s2inv);
+  for (size_t i = 0; i < n; i += 8) {
+    __m128i q[2];
+    for (int k = 0; k < 2; k++) {
+      __m128i *a = (__m128i *)(acc + i + 4 * k);
+      __m128i sum = _mm_loadu_si128(a);
+      _mm_storeu_si128(
+          a, _mm_add_epi32(sum, _mm_loadu_si128((const __m128i *)(dlt + i +
+                                                                  4 * k))));
+      // Two doubles per register, so convert the four sums in two steps
+      __m128i q0 = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(sum), factor));
+      __m128i q1 = _mm_cvttpd_epi32(
+          _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(sum, 8)), factor));
+      q[k] = _mm_unpacklo_epi64(q0, q1);
+    }
+    __m128i packed = _mm_packus_epi32(q[0], q[1]);
+    _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(packed, packed));
+  }
+}
+
+// Same as scale9_vstep(), with AVX2
+__attribute__((target("avx2"))) static void
+scale9_vstep_avx2(uint8_t *out, size_t n, int32_t *acc, const int32_t *dlt,
+                  double s2inv) {
+  const __m256d factor = _mm256_set1_pd(s2inv);
+  for (size_t i = 0; i < n; i += 8) {
+    __m256i *a = (__m256i *)(acc + i);
+    __m256i sum = _mm256_loadu_si256(a);
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dlt + i));
+    _mm256_storeu_si256(a, _mm256_add_epi32(sum, d));
+    __m128i q0 = _mm256_cvttpd_epi32(
+        _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)), factor));
+    __m128i q1 = _mm256_cvttpd_epi32(_mm256_mul_pd(
+        _mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)), factor));
+    __m128i packed = _mm_packus_epi32(q0, q1);
+    _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(packed, packed));
+  }
+}
+
+// One output row of one channel for scale9_band_channels(): vstep for n bytes,
+// straight to out. vstep writes whole vectors of 8, which would spill into the
+// next row (possibly another band's), so the last n % 8 bytes go through tmp.
+static inline void scale9_vstep_to(
+    void (*vstep)(uint8_t *, size_t, int32_t *, const int32_t *, double),
+    uint8_t *out, uint8_t *tmp, size_t n, int32_t *acc, const int32_t *dlt,
+    double s2inv) {
+  const size_t whole = n / 8 * 8;
+  vstep(out, whole, acc, dlt, s2inv);
+  if (whole < n) {
+    vstep(tmp, n - whole, acc + whole, dlt + whole, s2inv);
+    memcpy(out + whole, tmp, n - whole);
+  }
+}
+
+// Copies n bytes from src to dst with non-temporal stores: they go to memory
+// without reading the destination's cache lines first, and without evicting
+// anything from the cache. The stores need aligned addresses, so the bytes up
+// to the first 16-byte boundary of dst (and the remainder at the end) are
+// copied normally. The caller needs an _mm_sfence() before others may read
+// dst.
+static void stream_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+  size_t head = -(uintptr_t)dst & 15;
+  if (head > n)
+    head = n;
+  memcpy(dst, src, head);
+  size_t i = head;
+  for (; i + 16 <= n; i += 16)
+    _mm_stream_si128((__m128i *)(dst + i),
+                     _mm_loadu_si128((const __m128i *)(src + i)));
+  memcpy(dst + i, src + i, n - i);
+}
+
+// Same as stream_copy(), 32 bytes at a time with AVX2
+__attribute__((target("avx2"))) static void
+stream_copy_avx2(uint8_t *dst, const uint8_t *src, size_t n) {
+  size_t head = -(uintptr_t)dst & 31;
+  if (head > n)
+    head = n;
+  memcpy(dst, src, head);
+  size_t i = head;
+  for (; i + 32 <= n; i += 32)
+    _mm256_stream_si256((__m256i *)(dst + i),
+                        _mm256_loadu_si256((const __m256i *)(src + i)));
+  memcpy(dst + i, src + i, n - i);
+}
+
+// Planar implementation for large factors: the band's source rows are split
+// into one plane per channel first (see planar.h), and everything after that
+// works on a single channel with contiguous loads and stores - no shuffling
+// of RGB lanes. Per source row, the horizontal pass produces
+// h(X) = (s-x)P(xi) + xP(xi+1) for every output column X; the output rows
+// between source rows eta and eta+1 are then
+//   (s-y)h_eta + y h_eta+1 = s h_eta + y(h_eta+1 - h_eta)
+// i.e. one addition per output byte and row. Each output row is interleaved
+// back into RGB right after it is computed, while it is still in the cache.
+// A grey image needs neither step: it already is a plane, and its output rows
+// are written directly.
+// The sums are kept in int32_t and multiplied with 1/s^2 in double precision
+// like scale_naive does, with the same boundary handling, so the results are
+// identical to scale_naive up to SCALE9_MAX_FACTOR. Only needs SSE4.1, but
+// converts twice as many sums at a time if the CPU has AVX2.
+void scale9(const uint8_t *img, size_t width, size_t height,
+            size_t scale_factor, uint8_t *result) {
+  scale9_band(img, width, height, scale_factor, result, 0, height);
+}
+
+// scale9_band() for pixels of <channels> bytes, inlined like
+// scale1_band_channels(). The output rows between two source rows are
+// produced in tiles of <tile> columns (a multiple of 8), see scale10; 0 means
+// a single tile of whole rows. If stream is true, each piece of an output row
+// is put together in a buffer first and then written with non-temporal
+// stores, see scale11.
+static inline __attribute__((always_inline)) void
+scale9_band_channels(const uint8_t *img, size_t width, size_t height,
+                     size_t scale_factor, uint8_t *result, size_t eta_begin,
+                     size_t eta_end, const size_t channels, size_t tile,
+                     const bool stream) {
+  if (eta_begin >= height)
+    return;
+  const size_t px_width = channels * width;
+  const size_t width_out = width * scale_factor;
+  const size_t px_width_out = px_width * scale_factor;
+  const size_t eta_stop = eta_end < height - 1 ? eta_end : height - 1;
+  const double s2inv = 1.0 / (scale_factor * scale_factor);
+  const bool avx2 = __builtin_cpu_supports("avx2");
+  void (*vstep)(uint8_t *, size_t, int32_t *, const int32_t *, double) =
+      avx2 ? scale9_vstep_avx2 : scale9_vstep;
+  void (*copy_out)(uint8_t *, const uint8_t *, size_t) =
+      avx2 ? stream_copy_avx2 : stream_copy;
+  // Row length of the buffers: whole vectors of 8 plus the 3 entries the
+  // horizontal pass may write beyond that
+  const size_t len = (width_out + 7) / 8 * 8 + 8;
+  if (tile == 0 || tile > width_out)
+    tile = width_out;
+
+  // Source rows eta_begin to eta_stop, one plane per channel
+  struct planar_st src = {.plane = {NULL}};
+  const uint8_t *plane[4];
+  size_t stride = width;
+  if (channels == 1) {
+    plane[0] = img + eta_begin * width;
+  } else {
+    if (planar_alloc(&src, width, eta_stop - eta_begin + 1, channels))
+      return;
+    planar_from_interleaved(&src, img + eta_begin * px_width);
+    for (size_t c = 0; c < channels; c++)
+      plane[c] = src.plane[c];
+    stride = src.stride;
+  }
+
+  // Per channel: h of two source rows (row eta in h[eta % 2]), the running
+  // sums acc and one row of output; and an interleaved output row for
+  // streaming
+  int32_t *bufs = malloc(channels * 3 * len * sizeof(int32_t) +
+                         2 * channels * len * sizeof(uint8_t));
+  if (!bufs) {
+    planar_free(&src);
+    errno = ENOMEM;
+    return;
+  }
+  int32_t *h[4][2], *acc[4];
+  uint8_t *row_out[4];
+  for (size_t c = 0; c < channels; c++) {
+    h[c][0] = bufs + 3 * c * len;
+    h[c][1] = h[c][0] + len;
+    acc[c] = h[c][1] + len;
+    row_out[c] = (uint8_t *)(bufs + channels * 3 * len) + c * len;
+  }
+  uint8_t *line = (uint8_t *)(bufs + channels * 3 * len) + channels * len;
+
+  for (size_t c = 0; c < channels; c++)
+    scale9_hpass(plane[c], width, scale_factor, h[c][eta_begin % 2]);
+  for (size_t eta = eta_begin; eta < eta_stop; eta++) {
+    const uint8_t *src_row = img + eta * px_width;
+    for (size_t c = 0; c < channels; c++)
+      scale9_hpass(plane[c] + (eta + 1 - eta_begin) * stride, width,
+                   scale_factor, h[c][(eta + 1) % 2]);
+    for (size_t x0 = 0; x0 < width_out; x0 += tile) {
+      const size_t n = width_out - x0 < tile ? width_out - x0 : tile;
+      int32_t *dlt[4];
+      for (size_t c = 0; c < channels; c++) {
+        int32_t *h0 = h[c][eta % 2] + x0, *h1 = h[c][(eta + 1) % 2] + x0;
+        // acc = s h0, and h0 becomes the difference to the next source row
+        for (size_t i = 0; i < n; i++) {
+          acc[c][x0 + i] = (int32_t)scale_factor * h0[i];
+          h0[i] = h1[i] - h0[i];
+        }
+        dlt[c] = h0;
+      }
+      for (size_t y = 0; y < scale_factor; y++) {
+        uint8_t *out =
+            result + (eta * scale_factor + y) * px_width_out + channels * x0;
+        uint8_t *dst = stream ? line : out;
+        if (channels == 1 && stream) {
+          vstep(dst, n, acc[0] + x0, dlt[0], s2inv);
+        } else if (channels == 1) {
+          scale9_vstep_to(vstep, dst, row_out[0], n, acc[0] + x0, dlt[0],
+                          s2inv);
+        } else {
+          for (size_t c = 0; c < channels; c++)
+            vstep(row_out[c], n, acc[c] + x0, dlt[c], s2inv);
+          if (channels == 4)
+            interleave_rgba(row_out[0], row_out[1], row_out[2], row_out[3], n,
+                            dst);
+          else
+            interleave_rgb(row_out[0], row_out[1], row_out[2], n, dst);
+        }
+        // scale_naive copies the source pixel instead of computing it
+        if (y == 0) {
+          const size_t xi_end = (x0 + n + scale_factor - 1) / scale_factor;
+          for (size_t xi = (x0 + scale_factor - 1) / scale_factor;
+               xi < xi_end && xi < width - 1; xi++)
+            memcpy(dst + channels * (scale_factor * xi - x0),
+                   src_row + channels * xi, channels);
+        }
+        if (stream)
+          copy_out(out, line, channels * n);
+      }
+    }
+  }
+
+  if (eta_end == height) {
+    // In the last row, there is nothing to interpolate vertically; scale_naive
+    // weighs the same row with (s-y) and y, i.e. with s.
+    const uint8_t *last_line = img + (height - 1) * px_width;
+    uint8_t *out = result + (height - 1) * scale_factor * px_width_out;
+    uint8_t *dst = stream ? line : out;
+    for (size_t c = 0; c < channels; c++) {
+      int32_t *hl = h[c][(height - 1) % 2];
+      for (size_t i = 0; i < width_out; i++) {
+        acc[c][i] = (int32_t)scale_factor * hl[i];
+        hl[i] = 0;
+      }
+      if (channels == 1 && stream)
+        vstep(dst, width_out, acc[0], hl, s2inv);
+      else if (channels == 1)
+        scale9_vstep_to(vstep, dst, row_out[0], width_out, acc[0], hl, s2inv);
+      else
+        vstep(row_out[c], width_out, acc[c], hl, s2inv);
+    }
+    if (channels == 4)
+      interleave_rgba(row_out[0], row_out[1], row_out[2], row_out[3],
+                      width_out, dst);
+    else if (channels == 3)
+      interleave_rgb(row_out[0], row_out[1], row_out[2], width_out, dst);
+    // Bottom right corner: copy the pixel
+    for (size_t x = 0; x < scale_factor; x++)
+      memcpy(dst + px_width_out - channels * (scale_factor - x),
+             last_line + px_width - channels, channels);
+    for (size_t y = stream ? 0 : 1; y < scale_factor; y++) {
+      if (stream)
+        copy_out(out + y * px_width_out, line, px_width_out);
+      else
+        memcpy(out + y * px_width_out, out, px_width_out);
+    }
+  }
+  if (stream)
+    _mm_sfence();
+  free(bufs);
+  planar_free(&src);
+}
+
+void scale9_band(const uint8_t *img, size_t width, size_t height,
+                 size_t scale_factor, uint8_t *result, size_t eta_begin,
+                 size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, CHANNELS, 0, false);
+}
+
+void scale9_band_grey(const uint8_t *img, size_t width, size_t height,
+                      size_t scale_factor, uint8_t *result, size_t eta_begin,
+                      size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 1, 0, false);
+}
+
+void scale9_band_rgba(const uint8_t *img, size_t width, size_t height,
+                      size_t scale_factor, uint8_t *result, size_t eta_begin,
+                      size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 4, 0, false);
+}
+
+// Cache budget of scale10's tiles in bytes, 0 for half the L2 cache
+static size_t tile_bytes;
+
+void scale_set_tile_bytes(size_t bytes) { tile_bytes = bytes; }
+
+// Tile width in output columns for pixels of <channels> bytes: per column
+// and channel, the sums and differences take 8 bytes, the row buffer and the
+// output 1 each
+static size_t scale10_tile(size_t channels) {
+  const size_t budget = tile_bytes ? tile_bytes : l2_cache_size() / 2;
+  const size_t tile = budget / (10 * channels) / 16 * 16;
+  return tile < 64 ? 64 : tile;
+}
+
+// Cache-blocked scale9. Between two source rows, scale9 produces s whole
+// output rows, and each of them streams the running sums and differences of
+// the whole row (8 bytes per output column and channel) through the cache.
+// Once those no longer fit into L2, every output row fetches them from
+// further away again. scale10 splits the output rows into tiles of columns
+// instead, and produces all s rows of a tile before moving on to the next
+// one, so the sums of a tile stay in L2 for s rows. The tiles are sized to
+// fill about half of it (see scale_set_tile_bytes()). The output is the same
+// as scale9's.
+void scale10(const uint8_t *img, size_t width, size_t height,
+             size_t scale_factor, uint8_t *result) {
+  scale10_band(img, width, height, scale_factor, result, 0, height);
+}
+
+void scale10_band(const uint8_t *img, size_t width, size_t height,
+                  size_t scale_factor, uint8_t *result, size_t eta_begin,
+                  size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, CHANNELS, scale10_tile(CHANNELS), false);
+}
+
+void scale10_band_grey(const uint8_t *img, size_t width, size_t height,
+                       size_t scale_factor, uint8_t *result, size_t eta_begin,
+                       size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 1, scale10_tile(1), false);
+}
+
+void scale10_band_rgba(const uint8_t *img, size_t width, size_t height,
+                       size_t scale_factor, uint8_t *result, size_t eta_begin,
+                       size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 4, scale10_tile(4), false);
+}
+
+// scale10 with non-temporal stores: every output row is written exactly once
+// and not read again by the kernel, so there is no point in fetching its
+// cache lines before overwriting them (the read for ownership a normal store
+// does), or in keeping them in the cache afterwards. Each piece of a row is
+// assembled in a small buffer that stays in L1 and then streamed out. Pays
+// off when the output is much larger than the caches; see outbuf.h for the
+// other half, avoiding TLB misses on the output.
+void scale11(const uint8_t *img, size_t width, size_t height,
+             size_t scale_factor, uint8_t *result) {
+  scale11_band(img, width, height, scale_factor, result, 0, height);
+}
+
+void scale11_band(const uint8_t *img, size_t width, size_t height,
+                  size_t scale_factor, uint8_t *result, size_t eta_begin,
+                  size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, CHANNELS, scale10_tile(CHANNELS), true);
+}
+
+void scale11_band_grey(const uint8_t *img, size_t width, size_t height,
+                       size_t scale_factor, uint8_t *result, size_t eta_begin,
+                       size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 1, scale10_tile(1), true);
+}
+
+void scale11_band_rgba(const uint8_t *img, size_t width, size_t height,
+                       size_t scale_factor, uint8_t *result, size_t eta_begin,
+                       size_t eta_end) {
+  scale9_band_channels(img, width, height, scale_factor, result, eta_begin,
+                       eta_end, 4, scale10_tile(4), true);
+}
+
+// scale9 for 16-bit samples. The structure is the same as in
+// scale9_band_channels(), with wider types: h holds up to 65535 * s, which
+// fits an int32_t, but the running sums reach 65535 * s^2 and are kept in
+// uint32_t instead, which limits the factor to SCALE9_16_MAX_FACTOR. The
+// differences between rows may be negative; they wrap around modulo 2^32, and
+// so do the additions, so the sums still come out right. The planes are
+// uint16_t and only live in this function, which splits and merges the
+// channels with plain loops - the shuffles of planar.h are for bytes.
+
+// scale9_hpass() for a row of 16-bit samples
+static void scale9_hpass16(const uint16_t *row, size_t width,
+                           size_t scale_factor, int32_t *h) {
+  const int32_t s = scale_factor;
+  const __m128i ramp = _mm_setr_epi32(0, 1, 2, 3);
+  for (size_t xi = 0; xi < width - 1; xi++) {
+    const int32_t p = row[xi];
+    const int32_t d = row[xi + 1] - p;
+    __m128i v = _mm_add_epi32(_mm_set1_epi32(s * p),
+                              _mm_mullo_epi32(_mm_set1_epi32(d), ramp));
+    const __m128i step = _mm_set1_epi32(4 * d);
+    int32_t *out = h + xi * scale_factor;
+    for (size_t x = 0; x < scale_factor; x += 4) {
+      _mm_storeu_si128((__m128i *)(out + x), v);
+      v = _mm_add_epi32(v, step);
+    }
+  }
+  const __m128i last = _mm_set1_epi32(s * row[width - 1]);
+  int32_t *out = h + (width - 1) * scale_factor;
+  for (size_t x = 0; x < scale_factor; x += 4)
+    _mm_storeu_si128((__m128i *)(out + x), last);
+}
+
+// Converts two uint32_t sums (the low half of v) to double: flipping the top
+// bit maps them onto int32_t, which cvtepi32 handles, and adding 2^31 undoes
+// that.
+static inline __m128d u32_to_pd(__m128i v) {
+  return _mm_add_pd(
+      _mm_cvtepi32_pd(_mm_xor_si128(v, _mm_set1_epi32(INT32_MIN))),
+      _mm_set1_pd(2147483648.0));
+}
+
+// scale9_vstep() for 16-bit output: writes n samples rounded up to a multiple
+// of 8
+static void scale9_vstep16(uint16_t *out, size_t n, int32_t *acc,
+                           const int32_t *dlt, double s2inv) {
+  const __m128d factor = _mm_set1_pd(s2inv);
+  for (size_t i = 0; i < n; i += 8) {
+    __m128i q[2];
+    for (int k = 0; k < 2; k++) {
+      __m128i *a = (__m128i *)(acc + i + 4 * k);
+      __m128i sum = _mm_loadu_si128(a);
+      _mm_storeu_si128(
+          a, _mm_add_epi32(sum, _mm_loadu_si128((const __m128i *)(dlt + i +
+                                                                  4 * k))));
+      __m128i q0 = _mm_cvttpd_epi32(_mm_mul_pd(u32_to_pd(sum), factor));
+      __m128i q1 = _mm_cvttpd_epi32(
+          _mm_mul_pd(u32_to_pd(_mm_srli_si128(sum, 8)), factor));
+      q[k] = _mm_unpacklo_epi64(q0, q1);
+    }
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi32(q[0], q[1]));
+  }
+}
+
+// Same as scale9_vstep16(), with AVX2
+__attribute__((target("avx2"))) static void
+scale9_vstep16_avx2(uint16_t *out, size_t n, int32_t *acc, const int32_t *dlt,
+                    double s2inv) {
+  const __m256d factor = _mm256_set1_pd(s2inv);
+  const __m256d bias = _mm256_set1_pd(2147483648.0);
+  const __m256i flip = _mm256_set1_epi32(INT32_MIN);
+  for (size_t i = 0; i < n; i += 8) {
+    __m256i *a = (__m256i *)(acc + i);
+    __m256i sum = _mm256_loadu_si256(a);
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dlt + i));
+    _mm256_storeu_si256(a, _mm256_add_epi32(sum, d));
+    sum = _mm256_xor_si256(sum, flip);
+    __m256d lo = _mm256_add_pd(
+        _mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)), bias);
+    __m256d hi = _mm256_add_pd(
+        _mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)), bias);
+    __m128i q0 = _mm256_cvttpd_epi32(_mm256_mul_pd(lo, factor));
+    __m128i q1 = _mm256_cvttpd_epi32(_mm256_mul_pd(hi, factor));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi32(q0, q1));
+  }
+}
+
+static inline __attribute__((always_inline)) void
+scale9_band16_channels(const uint8_t *img8, size_t width, size_t height,
+                       size_t scale_factor, uint8_t *result8, size_t eta_begin,
+                       size_t eta_end, const size_t channels) {
+  if (eta_begin >= height)
+    return;
+  const uint16_t *img = (const uint16_t *)img8;
+  uint16_t *result = (uint16_t *)result8;
+  const size_t px_width = channels * width;
+  const size_t width_out = width * scale_factor;
+  const size_t px_width_out = px_width * scale_factor;
+  const size_t eta_stop = eta_end < height - 1 ? eta_end : height - 1;
+  const size_t rows = eta_stop - eta_begin + 1;
+  const double s2inv = 1.0 / (scale_factor * scale_factor);
+  void (*vstep)(uint16_t *, size_t, int32_t *, const int32_t *, double) =
+      __builtin_cpu_supports("avx2") ? scale9_vstep16_avx2 : scale9_vstep16;
+  const size_t len = (width_out + 7) / 8 * 8 + 8;
+
+  // Per channel: h of two source rows, the running sums acc, one row of
+  // output, and (unless the image is grey) the plane of the band's source
+  // rows
+  const size_t plane_len = channels == 1 ? 0 : rows * width;
+  int32_t *bufs = malloc(channels * 3 * len * sizeof(int32_t) +
+                         channels * (len + plane_len) * sizeof(uint16_t));
+  if (!bufs) {
+    errno = ENOMEM;
+    return;
+  }
+  int32_t *h[4][2], *acc[4];
+  uint16_t *row_out[4];
+  const uint16_t *plane[4];
+  uint16_t *planes = (uint16_t *)(bufs + channels * 3 * len) + channels * len;
+  for (size_t c = 0; c < channels; c++) {
+    h[c][0] = bufs + 3 * c * len;
+    h[c][1] = h[c][0] + len;
+    acc[c] = h[c][1] + len;
+    row_out[c] = (uint16_t *)(bufs + channels * 3 * len) + c * len;
+    plane[c] = planes + c * plane_len;
+  }
+  if (channels == 1) {
+    plane[0] = img + eta_begin * width;
+  } else {
+    const uint16_t *src = img + eta_begin * px_width;
+    for (size_t i = 0; i < rows * width; i++)
+      for (size_t c = 0; c < channels; c++)
+        planes[c * plane_len + i] = src[channels * i + c];
+  }
+
+  for (size_t c = 0; c < channels; c++)
+    scale9_hpass16(plane[c], width, scale_factor, h[c][eta_begin % 2]);
+  for (size_t eta = eta_begin; eta < eta_stop; eta++) {
+    const uint16_t *src_row = img + eta * px_width;
+    for (size_t c = 0; c < channels; c++) {
+      int32_t *h0 = h[c][eta % 2], *h1 = h[c][(eta + 1) % 2];
+      scale9_hpass16(plane[c] + (eta + 1 - eta_begin) * width, width,
+                     scale_factor, h1);
+      for (size_t i = 0; i < width_out; i++) {
+        acc[c][i] = (uint32_t)scale_factor * (uint32_t)h0[i];
+        h0[i] = (int32_t)((uint32_t)h1[i] - (uint32_t)h0[i]);
+      }
+    }
+    for (size_t y = 0; y < scale_factor; y++) {
+      uint16_t *out = result + (eta * scale_factor + y) * px_width_out;
+      for (size_t c = 0; c < channels; c++)
+        vstep(row_out[c], width_out, acc[c], h[c][eta % 2], s2inv);
+      for (size_t i = 0; i < width_out; i++)
+        for (size_t c = 0; c < channels; c++)
+          out[channels * i + c] = row_out[c][i];
+      if (y == 0) {
+        for (size_t xi = 0; xi < width - 1; xi++)
+          memcpy(out + channels * scale_factor * xi, src_row + channels * xi,
+                 2 * channels);
+      }
+    }
+  }
+
+  if (eta_end == height) {
+    const uint16_t *last_line = img + (height - 1) * px_width;
+    uint16_t *out = result + (height - 1) * scale_factor * px_width_out;
+    for (size_t c = 0; c < channels; c++) {
+      int32_t *hl = h[c][(height - 1) % 2];
+      for (size_t i = 0; i < width_out; i++) {
+        acc[c][i] = (uint32_t)scale_factor * (uint32_t)hl[i];
+        hl[i] = 0;
+      }
+      vstep(row_out[c], width_out, acc[c], hl, s2inv);
+    }
+    for (size_t i = 0; i < width_out; i++)
+      for (size_t c = 0; c < channels; c++)
+        out[channels * i + c] = row_out[c][i];
+    for (size_t x = 0; x < scale_factor; x++)
+      memcpy(out + px_width_out - channels * (scale_factor - x),
+             last_line + px_width - channels, 2 * channels);
+    for (size_t y = 1; y < scale_factor; y++)
+      memcpy(out + y * px_width_out, out, 2 * px_width_out);
+  }
+  free(bufs);
+}
+
+void scale9_band16(const uint8_t *img, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result, size_t eta_begin,
+                   size_t eta_end) {
+  scale9_band16_channels(img, width, height, scale_factor, result, eta_begin,
+                         eta_end, CHANNELS);
+}
+
+void scale9_band16_grey(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result,
+                        size_t eta_begin, size_t eta_end) {
+  scale9_band16_channels(img, width, height, scale_factor, result, eta_begin,
+                         eta_end, 1);
+}
+
+void scale9_band16_rgba(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result,
+                        size_t eta_begin, size_t eta_end) {
+  scale9_band16_channels(img, width, height, scale_factor, result, eta_begin,
+                         eta_end, 4);
+}
+
+bool scale_supported(size_t version) {
+  switch (version) {
+  case 5:
+  case 7:
+    return __builtin_cpu_supports("avx2");
+  case 6:
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vl");
+  default:
+    return true;
+  }
+}
+
+size_t scale_max_factor(size_t version, size_t sample_size) {
+  switch (version) {
+  case 4:
+    return 16;
+  case 5:
+    return SCALE5_MAX_FACTOR;
+  case 6:
+    return SCALE6_MAX_FACTOR;
+  case 7:
+    return SCALE7_MAX_FACTOR;
+  case 8:
+    return SCALE8_MAX_FACTOR;
+  case 9:
+    return sample_size == 2 ? SCALE9_16_MAX_FACTOR : SCALE9_MAX_FACTOR;
+  case 10:
+    return SCALE10_MAX_FACTOR;
+  case 11:
+    return SCALE11_MAX_FACTOR;
+  default:
+    return SIZE_MAX;
+  }
+}
+
+bool scale_usable(size_t version, size_t scale_factor, size_t width,
+                  size_t channels, size_t sample_size) {
+  return scale_band_fun(version, channels, sample_size) &&
+         scale_factor <= scale_max_factor(version, sample_size) &&
+         (width > 1 || version < 4 || version > 6) &&
+         scale_supported(version);
+}
+
+void (*scale_band_fun(size_t version, size_t channels, size_t sample_size))(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t, size_t) {
+  if (version == 0 || version > MAX_IMPLEMENTATION)
+    return NULL;
+  const bool wide = sample_size == 2;
+  if (sample_size != 1 && !wide)
+    return NULL;
+  switch (channels) {
+  case 1:
+    return (wide ? scale_band_funs16_grey : scale_band_funs_grey)[version - 1];
+  case CHANNELS:
+    return (wide ? scale_band_funs16 : scale_band_funs)[version - 1];
+  case 4:
+    return (wide ? scale_band_funs16_rgba : scale_band_funs_rgba)[version - 1];
+  default:
+    return NULL;
+  }
+}
+
+void report_unusable(size_t version, size_t scale_factor, size_t channels,
+                     size_t sample_size) {
+  if (!scale_band_fun(version, channels, sample_size))
+    fprintf(stderr,
+            "Error: Implementation -V%zu doesn't support images with %zu "
+            "channel(s) of %zu bit.\n",
+            version, channels, 8 * sample_size);
+  else if (!scale_supported(version))
+    fprintf(stderr, "Error: Implementation -V%zu needs instructions this CPU "
+                    "doesn't have.\n",
+            version);
+  else if (scale_factor > scale_max_factor(version, sample_size))
+    fprintf(stderr,
+            "Error: Implementation -V%zu doesn't support scale factors above "
+            "%zu for %zu-bit images.\n",
+            version, scale_max_factor(version, sample_size), 8 * sample_size);
+  else
+    fprintf(stderr, "Error: Implementation -V%zu can't scale a single column "
+                    "of pixels.\n",
+            version);
+}
+
+size_t default_version(size_t scale_factor, size_t width, size_t channels,
+                       size_t sample_size) {
+  if (sample_size == 2) {
+    return scale_factor <= SCALE9_16_MAX_FACTOR ? 9 : 1;
+  } else if (channels != CHANNELS) {
+    // Only scale1, scale8 and scale9 have grey and RGBA variants. For RGBA
+    // at small factors, scale8 is ahead even with AVX2: two pixels fill its
+    // vectors exactly, and there is little output to amortize scale9's
+    // conversion to planes.
+    const bool avx2 = __builtin_cpu_supports("avx2");
+    if (scale_factor <= SCALE8_MAX_FACTOR &&
+        (!avx2 || (channels == 4 && scale_factor <= 4)))
+      return 8;
+    else if (scale_factor <= SCALE9_MAX_FACTOR)
+      return 9;
+    else
+      return 1;
+  } else if (scale_factor <= 16 && width > 1) {
+    // Fast implementations, but only work for scale_factor <= 16.
+    // Take the one with the widest registers this CPU supports.
+    if (scale_supported(6))
+      return 6;
+    else if (scale_supported(5))
+      return 5;
+    else
+      return 4;
+  } else if (scale_factor <= SCALE8_MAX_FACTOR &&
+             !__builtin_cpu_supports("avx2")) {
+    // Large factor (or a single column): exact, but still vectorized
+    return 8;
+  } else if (scale_factor <= SCALE9_MAX_FACTOR) {
+    // Exact as well; ahead of scale7 and scale8 with AVX2
+    return 9;
+  } else {
+    return 1;
+  }
+}
+
+size_t pick_version(size_t scale_factor, size_t width, size_t channels,
+                    size_t sample_size) {
+  size_t version =
+      default_version(scale_factor, width, channels, sample_size);
+  // scale9 keeps about 10 bytes per output column and channel in flight
+  // while it writes a row (see scale10). If that doesn't fit into L2, the
+  // tiled variant is faster, and the output is so large that streaming it
+  // past the cache (scale11) pays off as well.
+  //
+  // This deliberately leaves the scale4 family and scale8 alone, however wide
+  // the rows: they stay ahead of scale10 and scale11 on wide rows too (e.g.
+  // 20000 pixels wide at factor 4: scale4 2.2x and, for RGBA, scale8 1.7x
+  // faster), and the scale4 family rounds differently from scale9 to scale11
+  // at some factors (7, 14), so switching would change the output.
+  if (version == 9 && sample_size == 1 &&
+      width * scale_factor * channels * 10 > l2_cache_size())
+    version = 11;
+  return version;
+}
+
 void scale_naive(const uint8_t *img, size_t width, size_t height,
                  size_t scale_factor, uint8_t *result) {
+  scale_naive_channels(img, width, height, scale_factor, result, CHANNELS);
+}
+
+void scale_naive_channels(const uint8_t *img, size_t width, size_t height,
+                          size_t scale_factor, uint8_t *result,
+                          size_t channels) {
   double s2inv = 1.0 / (scale_factor * scale_factor);
   size_t width_out = width * scale_factor;
   for (size_t eta = 0; eta < height - 1; eta++) {
@@ -597,22 +2205,22 @@ void scale_naive(const uint8_t *img, size_t width, size_t height,
       for (size_t y = 0; y < scale_factor; y++) {
         for (size_t x = 0; x < scale_factor; x++) {
           if (x == 0 && y == 0) {
-            for (size_t i = 0; i < CHANNELS; i++) {
-              result[CHANNELS * ((eta * scale_factor + y) * width_out +
+            for (size_t i = 0; i < channels; i++) {
+              result[channels * ((eta * scale_factor + y) * width_out +
                                  (xi * scale_factor + x)) +
-                     i] = img[CHANNELS * (eta * width + xi) + i];
+                     i] = img[channels * (eta * width + xi) + i];
             }
           } else {
-            for (size_t i = 0; i < CHANNELS; i++) {
-              int p0 = img[CHANNELS * (eta * width + xi) + i];
-              int p1 = img[CHANNELS * (eta * width + xi + 1) + i];
-              int p2 = img[CHANNELS * ((eta + 1) * width + xi) + i];
-              int p3 = img[CHANNELS * ((eta + 1) * width + xi + 1) + i];
+            for (size_t i = 0; i < channels; i++) {
+              int p0 = img[channels * (eta * width + xi) + i];
+              int p1 = img[channels * (eta * width + xi + 1) + i];
+              int p2 = img[channels * ((eta + 1) * width + xi) + i];
+              int p3 = img[channels * ((eta + 1) * width + xi + 1) + i];
               int c0 = (scale_factor - y) * (scale_factor - x);
               int c1 = (scale_factor - y) * x;
               int c2 = y * (scale_factor - x);
               int c3 = x * y;
-              result[CHANNELS * ((eta * scale_factor + y) * width_out +
+              result[channels * ((eta * scale_factor + y) * width_out +
                                  (xi * scale_factor + x)) +
                      i] = s2inv * (c0 * p0 + c1 * p1 + c2 * p2 + c3 * p3);
             }
@@ -623,15 +2231,15 @@ void scale_naive(const uint8_t *img, size_t width, size_t height,
     // last column
     for (size_t y = 0; y < scale_factor; y++) {
       for (size_t x = 0; x < scale_factor; x++) {
-        for (size_t i = 0; i < CHANNELS; i++) {
+        for (size_t i = 0; i < channels; i++) {
           int c0 = (scale_factor - y) * (scale_factor - x);
           int c1 = (scale_factor - y) * x;
           int c2 = y * (scale_factor - x);
           int c3 = x * y;
-          int p0 = img[CHANNELS * (eta * width + (width - 1)) + i];
-          int p2 = img[CHANNELS * ((eta + 1) * width + (width - 1)) + i];
+          int p0 = img[channels * (eta * width + (width - 1)) + i];
+          int p2 = img[channels * ((eta + 1) * width + (width - 1)) + i];
 
-          result[CHANNELS * (scale_factor * (width_out * eta + width - 1) +
+          result[channels * (scale_factor * (width_out * eta + width - 1) +
                              width_out * y + x) +
                  i] =
               (uint8_t)(s2inv * (c0 * p0 + c1 * p0 + c2 * p2 + c3 * p2));
@@ -643,15 +2251,15 @@ void scale_naive(const uint8_t *img, size_t width, size_t height,
   for (size_t xi = 0; xi < width - 1; xi++) {
     for (size_t y = 0; y < scale_factor; y++) {
       for (size_t x = 0; x < scale_factor; x++) {
-        for (size_t i = 0; i < CHANNELS; i++) {
+        for (size_t i = 0; i < channels; i++) {
           int c0 = (scale_factor - y) * (scale_factor - x);
           int c1 = (scale_factor - y) * x;
           int c2 = y * (scale_factor - x);
           int c3 = x * y;
-          int p0 = img[CHANNELS * ((height - 1) * width + xi) + i];
-          int p1 = img[CHANNELS * ((height - 1) * width + xi + 1) + i];
+          int p0 = img[channels * ((height - 1) * width + xi) + i];
+          int p1 = img[channels * ((height - 1) * width + xi + 1) + i];
 
-          result[CHANNELS * (scale_factor * (width_out * (height - 1) + xi) +
+          result[channels * (scale_factor * (width_out * (height - 1) + xi) +
                              width_out * y + x) +
                  i] =
               (uint8_t)(s2inv * (c0 * p0 + c1 * p1 + c2 * p0 + c3 * p1));
@@ -662,9 +2270,9 @@ void scale_naive(const uint8_t *img, size_t width, size_t height,
   // bottom right corner
   for (size_t y = 0; y < scale_factor; y++) {
     for (size_t x = 0; x < scale_factor; x++) {
-      for (size_t i = 0; i < CHANNELS; i++) {
-        int p0 = img[CHANNELS * ((height - 1) * width + (width - 1)) + i];
-        result[CHANNELS *
+      for (size_t i = 0; i < channels; i++) {
+        int p0 = img[channels * ((height - 1) * width + (width - 1)) + i];
+        result[channels *
                    (scale_factor * (width_out * (height - 1) + (width - 1)) +
                     width_out * y + x) +
                i] = p0;
@@ -672,3 +2280,43 @@ void scale_naive(const uint8_t *img, size_t width, size_t height,
     }
   }
 }
+
+void scale_naive16(const uint8_t *img8, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result8, size_t channels) {
+  const uint16_t *img = (const uint16_t *)img8;
+  uint16_t *result = (uint16_t *)result8;
+  const size_t s = scale_factor;
+  const double s2inv = 1.0 / ((double)s * s);
+  const size_t width_out = width * s;
+  for (size_t eta = 0; eta < height; eta++) {
+    // Beyond the last row and column, the neighbours are the pixel itself
+    const size_t eta1 = eta < height - 1 ? eta + 1 : eta;
+    for (size_t xi = 0; xi < width; xi++) {
+      const size_t xi1 = xi < width - 1 ? xi + 1 : xi;
+      const bool interior = eta1 != eta && xi1 != xi;
+      const bool corner = eta1 == eta && xi1 == xi;
+      const uint16_t *p0 = img + channels * (eta * width + xi);
+      const uint16_t *p1 = img + channels * (eta * width + xi1);
+      const uint16_t *p2 = img + channels * (eta1 * width + xi);
+      const uint16_t *p3 = img + channels * (eta1 * width + xi1);
+      for (size_t y = 0; y < s; y++) {
+        for (size_t x = 0; x < s; x++) {
+          uint16_t *out =
+              result + channels * ((eta * s + y) * width_out + xi * s + x);
+          if (corner || (interior && x == 0 && y == 0)) {
+            memcpy(out, p0, 2 * channels);
+            continue;
+          }
+          const uint64_t c0 = (uint64_t)(s - y) * (s - x);
+          const uint64_t c1 = (uint64_t)(s - y) * x;
+          const uint64_t c2 = (uint64_t)y * (s - x);
+          const uint64_t c3 = (uint64_t)y * x;
+          for (size_t i = 0; i < channels; i++) {
+            uint64_t sum = c0 * p0[i] + c1 * p1[i] + c2 * p2[i] + c3 * p3[i];
+            out[i] = (uint16_t)(s2inv * (double)sum);
+          }
+        }
+      }
+    }
+  }
+}
@@ -1,3 +1,6 @@
+// Bytes per pixel of the RGB images all implementations handle. scale1,
+// scale8 and scale9 also come in variants for grey (1 channel) and RGBA (4
+// channels) images, see scale_band_fun().
 #ifndef CHANNELS
 #define CHANNELS 3
 #endif
@@ -10,17 +13,250 @@ extern void scale3(const uint8_t *img, size_t width, size_t height,
                    size_t scale_factor, uint8_t *result);
 extern void scale4(const uint8_t *img, size_t width, size_t height,
                    size_t scale_factor, uint8_t *result);
+extern void scale5(const uint8_t *img, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result);
+extern void scale6(const uint8_t *img, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result);
+extern void scale7(const uint8_t *img, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result);
+extern void scale8(const uint8_t *img, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result);
+extern void scale9(const uint8_t *img, size_t width, size_t height,
+                   size_t scale_factor, uint8_t *result);
+extern void scale10(const uint8_t *img, size_t width, size_t height,
+                    size_t scale_factor, uint8_t *result);
+extern void scale11(const uint8_t *img, size_t width, size_t height,
+                    size_t scale_factor, uint8_t *result);
 extern void scale_naive(const uint8_t *img, size_t width, size_t height,
                         size_t scale_factor, uint8_t *result);
+// scale_naive for pixels of any number of channels
+extern void scale_naive_channels(const uint8_t *img, size_t width,
+                                 size_t height, size_t scale_factor,
+                                 uint8_t *result, size_t channels);
+// scale_naive_channels for 16-bit samples (uint16_t in host byte order, see
+// struct img_st)
+extern void scale_naive16(const uint8_t *img, size_t width, size_t height,
+                          size_t scale_factor, uint8_t *result,
+                          size_t channels);
+
+// Band variants of the above: they only produce the output that belongs to the
+// source rows eta_begin <= eta < eta_end. The last row and the bottom right
+// corner are produced by the band that contains eta == height - 1, so
+// scaleN(...) is the same as scaleN_band(..., 0, height).
+extern void scale1_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale2_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale3_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale4_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale5_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale6_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale7_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+
+extern void scale8_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale9_band(const uint8_t *img, size_t width, size_t height,
+                        size_t scale_factor, uint8_t *result, size_t eta_begin,
+                        size_t eta_end);
+extern void scale10_band(const uint8_t *img, size_t width, size_t height,
+                         size_t scale_factor, uint8_t *result,
+                         size_t eta_begin, size_t eta_end);
+extern void scale11_band(const uint8_t *img, size_t width, size_t height,
+                         size_t scale_factor, uint8_t *result,
+                         size_t eta_begin, size_t eta_end);
+
+// The same for grey and RGBA images
+extern void scale1_band_grey(const uint8_t *img, size_t width, size_t height,
+                             size_t scale_factor, uint8_t *result,
+                             size_t eta_begin, size_t eta_end);
+extern void scale1_band_rgba(const uint8_t *img, size_t width, size_t height,
+                             size_t scale_factor, uint8_t *result,
+                             size_t eta_begin, size_t eta_end);
+extern void scale8_band_grey(const uint8_t *img, size_t width, size_t height,
+                             size_t scale_factor, uint8_t *result,
+                             size_t eta_begin, size_t eta_end);
+extern void scale8_band_rgba(const uint8_t *img, size_t width, size_t height,
+                             size_t scale_factor, uint8_t *result,
+                             size_t eta_begin, size_t eta_end);
+extern void scale9_band_grey(const uint8_t *img, size_t width, size_t height,
+                             size_t scale_factor, uint8_t *result,
+                             size_t eta_begin, size_t eta_end);
+extern void scale9_band_rgba(const uint8_t *img, size_t width, size_t height,
+                             size_t scale_factor, uint8_t *result,
+                             size_t eta_begin, size_t eta_end);
+extern void scale10_band_grey(const uint8_t *img, size_t width, size_t height,
+                              size_t scale_factor, uint8_t *result,
+                              size_t eta_begin, size_t eta_end);
+extern void scale10_band_rgba(const uint8_t *img, size_t width, size_t height,
+                              size_t scale_factor, uint8_t *result,
+                              size_t eta_begin, size_t eta_end);
+extern void scale11_band_grey(const uint8_t *img, size_t width, size_t height,
+                              size_t scale_factor, uint8_t *result,
+                              size_t eta_begin, size_t eta_end);
+extern void scale11_band_rgba(const uint8_t *img, size_t width, size_t height,
+                              size_t scale_factor, uint8_t *result,
+                              size_t eta_begin, size_t eta_end);
+
+// The same for 16-bit samples, in RGB, grey and RGBA. img and result hold
+// uint16_t (and must be aligned for it); the parameters still count pixels.
+extern void scale1_band16(const uint8_t *img, size_t width, size_t height,
+                          size_t scale_factor, uint8_t *result,
+                          size_t eta_begin, size_t eta_end);
+extern void scale1_band16_grey(const uint8_t *img, size_t width,
+                               size_t height, size_t scale_factor,
+                               uint8_t *result, size_t eta_begin,
+                               size_t eta_end);
+extern void scale1_band16_rgba(const uint8_t *img, size_t width,
+                               size_t height, size_t scale_factor,
+                               uint8_t *result, size_t eta_begin,
+                               size_t eta_end);
+extern void scale9_band16(const uint8_t *img, size_t width, size_t height,
+                          size_t scale_factor, uint8_t *result,
+                          size_t eta_begin, size_t eta_end);
+extern void scale9_band16_grey(const uint8_t *img, size_t width,
+                               size_t height, size_t scale_factor,
+                               uint8_t *result, size_t eta_begin,
+                               size_t eta_end);
+extern void scale9_band16_rgba(const uint8_t *img, size_t width,
+                               size_t height, size_t scale_factor,
+                               uint8_t *result, size_t eta_begin,
+                               size_t eta_end);
+
+// scale5 and scale6 compute in float, which is exact while the weighted sums,
+// up to 255 * scale_factor^2, stay below 2^24
+#define SCALE5_MAX_FACTOR 256
+#define SCALE6_MAX_FACTOR SCALE5_MAX_FACTOR
+// scale7 keeps 255 * scale_factor^2 in an int32_t (just like scale_naive)
+#define SCALE7_MAX_FACTOR 2901
+// scale8 keeps 255 * scale_factor in an int16_t
+#define SCALE8_MAX_FACTOR 128
+// scale9 keeps 255 * scale_factor^2 in an int32_t, like scale7
+#define SCALE9_MAX_FACTOR 2901
+// Its 16-bit variant keeps 65535 * scale_factor^2 in a uint32_t
+#define SCALE9_16_MAX_FACTOR 256
+// scale10 is scale9 in tiles, and scale11 adds streaming stores, with the
+// same limit
+#define SCALE10_MAX_FACTOR SCALE9_MAX_FACTOR
+#define SCALE11_MAX_FACTOR SCALE9_MAX_FACTOR
+
+// Sets how many bytes of cache scale10's tiles may fill, which determines
+// their width; 0 (the default) means half of the L2 cache. For tests and
+// tuning - not safe while scale10 runs on another thread.
+extern void scale_set_tile_bytes(size_t bytes);
+
+// Whether the CPU we're running on has the instructions that implementation
+// number <version> (1-based, like --version) needs. scale5 and scale7 need
+// AVX2, scale6 needs AVX-512F/BW/VL; the others only need the SSE4.1 we
+// compile with.
+extern bool scale_supported(size_t version);
+
+// Builds the tables the implementations precompute for scale_factor, unless
+// they exist already. They are shared by all threads, and the tables of the
+// last few factors are cached; the implementations build the ones they need
+// on first use themselves, this is only needed to keep that out of a
+// measurement, so it builds the tables of all implementations.
+// Return value:
+//   0 on success
+//   1 if allocating memory failed (errno is set to ENOMEM)
+extern int scale_prepare(size_t scale_factor);
+
+// Frees the cached tables. Tables an implementation is still using are freed
+// when it is done with them, so this may run while other threads scale.
+extern void scale_plans_free(void);
+
+// The band function of implementation <version> for pixels of <channels>
+// samples of <sample_size> bytes (1 or 2, see img_sample_size()), i.e. an
+// entry of scale_band_funs, scale_band_funs_grey, scale_band_funs_rgba or
+// their 16-bit counterparts. NULL if there is no such implementation, or if
+// it only handles 8-bit RGB.
+extern void (*scale_band_fun(size_t version, size_t channels,
+                             size_t sample_size))(const uint8_t *, size_t,
+                                                  size_t, size_t, uint8_t *,
+                                                  size_t, size_t);
+
+// The largest scale factor implementation <version> handles for samples of
+// <sample_size> bytes, see the *_MAX_FACTOR above; SIZE_MAX if it has no
+// limit.
+extern size_t scale_max_factor(size_t version, size_t sample_size);
+
+// Whether implementation <version> can scale an image <width> pixels wide,
+// with pixels of <channels> samples of <sample_size> bytes, by <scale_factor>
+// on this CPU: it has a variant for the pixels (see scale_band_fun()), the
+// factor is within scale_max_factor(), the image is at least two pixels wide
+// for scale4 to scale6, and scale_supported(). Anything else produces wrong
+// pixels or crashes.
+extern bool scale_usable(size_t version, size_t scale_factor, size_t width,
+                         size_t channels, size_t sample_size);
+
+// Prints why scale_usable() is false for these arguments to stderr, as an
+// "Error: " line.
+extern void report_unusable(size_t version, size_t scale_factor,
+                            size_t channels, size_t sample_size);
+
+// Picks the implementation to use if none was given with --version
+extern size_t default_version(size_t scale_factor, size_t width,
+                              size_t channels, size_t sample_size);
+// default_version(), but switches from scale9 to scale11 where the output
+// rows are too large for the cache; what the CLI and interp_scale() use.
+extern size_t pick_version(size_t scale_factor, size_t width,
+                           size_t channels, size_t sample_size);
 
 // Change these when adding a new scale() implementation:
 //  - increment MAX_IMPLEMENTATION
-//  - Add the implementation to the two arrays
+//  - Add the implementation to the two arrays, and to the grey, RGBA and
+//    16-bit ones if it has such variants (NULL otherwise)
 #ifndef MAX_IMPLEMENTATION
-#define MAX_IMPLEMENTATION 4
+#define MAX_IMPLEMENTATION 11
 #endif
 
 __attribute__((unused)) static void (*scale_funs[])(const uint8_t *, size_t,
                                                     size_t, size_t,
                                                     uint8_t *) = {
-    scale1, scale2, scale3, scale4};
+    scale1, scale2, scale3, scale4, scale5,
+    scale6, scale7, scale8, scale9, scale10, scale11};
+
+__attribute__((unused)) static void (*scale_band_funs[])(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+    size_t) = {scale1_band, scale2_band, scale3_band,
+               scale4_band, scale5_band, scale6_band, scale7_band,
+               scale8_band, scale9_band, scale10_band, scale11_band};
+
+__attribute__((unused)) static void (*scale_band_funs_grey[])(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+    size_t) = {scale1_band_grey, NULL, NULL, NULL, NULL, NULL, NULL,
+               scale8_band_grey, scale9_band_grey, scale10_band_grey,
+               scale11_band_grey};
+
+__attribute__((unused)) static void (*scale_band_funs_rgba[])(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+    size_t) = {scale1_band_rgba, NULL, NULL, NULL, NULL, NULL, NULL,
+               scale8_band_rgba, scale9_band_rgba, scale10_band_rgba,
+               scale11_band_rgba};
+
+__attribute__((unused)) static void (*scale_band_funs16[])(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+    size_t) = {scale1_band16, NULL, NULL, NULL, NULL, NULL, NULL,
+               NULL, scale9_band16, NULL, NULL};
+
+__attribute__((unused)) static void (*scale_band_funs16_grey[])(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+    size_t) = {scale1_band16_grey, NULL, NULL, NULL, NULL, NULL, NULL,
+               NULL, scale9_band16_grey, NULL, NULL};
+
+__attribute__((unused)) static void (*scale_band_funs16_rgba[])(
+    const uint8_t *, size_t, size_t, size_t, uint8_t *, size_t,
+    size_t) = {scale1_band16_rgba, NULL, NULL, NULL, NULL, NULL, NULL,
+               NULL, scale9_band16_rgba, NULL, NULL};
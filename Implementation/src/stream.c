@@ -0,0 +1,111 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_parsing.h"
+#include "parallel.h"
+#include "stream.h"
+#include "trace.h"
+#include "util.h"
+
+// Writes rows output rows of row_samples samples each, binary or plain
+static int write_rows(FILE *out, const uint8_t *raster, size_t row_samples,
+                      size_t rows, size_t maxval, bool plain) {
+  if (plain)
+    return write_raster_plain(out, raster, row_samples, rows, maxval);
+  return write_raster(out, raster, row_samples * rows, maxval);
+}
+
+int scale_stream(struct img_stream_st *st, FILE *out, const struct img_st *img,
+                 size_t scale_factor,
+                 void (*fun)(const uint8_t *, size_t, size_t, size_t,
+                             uint8_t *, size_t, size_t),
+                 size_t threads, bool plain) {
+  const size_t width = img->width, height = img->height;
+  const size_t channels = img->channels;
+  const size_t ss = img_sample_size(img);
+  uint8_t *window = NULL;
+  uint8_t *scaled = NULL;
+
+  if ((plain ? write_img_header_plain : write_img_header)(
+          out, width * scale_factor, height * scale_factor, channels,
+          img->maxval))
+    goto write_error;
+  if (width * height * scale_factor == 0)
+    return 0;
+
+  // Each step scales <step> source rows, plus the row below them, which is
+  // needed for interpolation and becomes the first row of the next step.
+  const size_t step = threads < height ? threads : height;
+  // In samples, which are ss bytes each
+  const size_t px_width = channels * width;
+  const size_t px_width_out = px_width * scale_factor;
+
+  // The sizes can't overflow if the ones for the whole image don't
+  errno = 0;
+  size_t window_size = input_imgsize(width, step + 1, channels * ss);
+  size_t scaled_size =
+      output_imgsize(width, step, scale_factor, channels * ss);
+  output_imgsize(width, height, scale_factor, channels * ss);
+  if (errno == ERANGE)
+    goto malloc_error;
+  uint64_t t = trace_begin();
+  window = malloc(window_size);
+  scaled = malloc(scaled_size);
+  if (!window || !scaled)
+    goto malloc_error;
+  trace_end(TRACE_ALLOC, t, window_size + scaled_size);
+
+  if (stream_read_rows(st, width, window, 1))
+    goto cleanup;
+
+  for (size_t eta = 0; eta < height - 1;) {
+    size_t rows = height - 1 - eta < step ? height - 1 - eta : step;
+    if (stream_read_rows(st, width, window + px_width * ss, rows))
+      goto cleanup;
+
+    // The window is an image of rows + 1 rows; leave out its last row, which
+    // would be scaled like the last row of the whole image.
+    errno = 0;
+    t = trace_begin();
+    scale_parallel_rows(fun, threads, window, width, rows + 1, scale_factor,
+                        scaled, 0, rows);
+    trace_end(TRACE_KERNEL, t, rows * scale_factor * px_width_out * ss);
+    if (errno == ENOMEM)
+      goto malloc_error;
+    if (write_rows(out, scaled, px_width_out, rows * scale_factor,
+                   img->maxval, plain))
+      goto write_error;
+
+    memmove(window, window + rows * px_width * ss, px_width * ss);
+    eta += rows;
+  }
+
+  // Now the window only holds the last row. As an image of height 1, it gets
+  // scaled the way the last row of the whole image needs to be.
+  errno = 0;
+  t = trace_begin();
+  fun(window, width, 1, scale_factor, scaled, 0, 1);
+  trace_end(TRACE_KERNEL, t, scale_factor * px_width_out * ss);
+  if (errno == ENOMEM)
+    goto malloc_error;
+  if (write_rows(out, scaled, px_width_out, scale_factor, img->maxval, plain))
+    goto write_error;
+
+  free(window);
+  free(scaled);
+  return 0;
+
+malloc_error:
+  fprintf(stderr, "Error allocating memory.\n");
+  goto cleanup;
+write_error:
+  fprintf(stderr, "Error writing to output file.\n");
+cleanup:
+  free(window);
+  free(scaled);
+  return 1;
+}
@@ -0,0 +1,17 @@
+// Scales the image behind st (whose header stream_open() has parsed into img)
+// and writes it to out, a few source rows at a time: only <threads> + 1 source
+// rows and the output rows produced from them are kept in memory, instead of
+// the whole input and output image.
+//
+// fun is the band function for img's channels and sample size (see
+// scale_band_fun()), threads is passed on to scale_parallel_rows(). If plain
+// is true, the output is written as plain text (see write_img_plain()).
+//
+// Return value:
+//   0 if completed without errors
+//   1 otherwise, after printing an error message
+extern int scale_stream(struct img_stream_st *st, FILE *out,
+                        const struct img_st *img, size_t scale_factor,
+                        void (*fun)(const uint8_t *, size_t, size_t, size_t,
+                                    uint8_t *, size_t, size_t),
+                        size_t threads, bool plain);
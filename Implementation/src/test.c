@@ -5,18 +5,37 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "batch.h"
 #include "file_parsing.h"
+#include "interp.h"
+#include "parallel.h"
+#include "planar.h"
+#include "resize.h"
 #include "scale.h"
+#include "stream.h"
 #include "test.h"
+#include "trace.h"
+#include "tune.h"
 #include "util.h"
 
 #define MAX_PATH_LENGTH 200
 #define MAX_NUM_IMG 4
 #define MAX_HARDCODED_SF 3
-#define BOUNDARY_CHECK(impl) (impl == 0 || impl == 3)
+// Deliberately not a divisor of the test image heights, so that the bands
+// have different sizes
+#define TEST_THREADS 3
+#define BOUNDARY_CHECK(impl) (impl == 0 || impl >= 3)
 
 int iterate_functions(size_t scale_factor, uint8_t *img, size_t width,
                       size_t height, uint8_t *expected, size_t num_img);
+int test_exact(void);
+int test_plans(void);
+int test_planar(void);
+int test_channels(void);
+int test_depth16(void);
+int test_parser_plain(void);
+int test_parser_parallel(void);
+int test_parser_trace(void);
 bool compare(uint8_t *result, uint8_t *expected, size_t height, size_t width,
              size_t scale_factor, bool check_boundary);
 
@@ -53,7 +72,8 @@ int parser_test(char *file_name, char *description, enum parse_err expect_res,
     goto failure;
   if (expect_values & 0x04) {
     if (dest.img && expect_data) {
-      if (memcmp(dest.img, expect_data, dest.width * dest.height * 3))
+      if (memcmp(dest.img, expect_data,
+                 dest.width * dest.height * dest.channels))
         goto failure;
     } else if (dest.img != expect_data)
       goto failure; // If we expect NULL and get NULL, that's valid, but not if
@@ -62,19 +82,289 @@ int parser_test(char *file_name, char *description, enum parse_err expect_res,
 
   printf("OK.\n");
   if (res == PARSE_OK)
-    free(dest.img);
+    free_img(&dest);
   fclose(fp);
   return 0;
 
 failure:
   printf("Failed.\n");
   if (res == PARSE_OK)
-    free(dest.img);
+    free_img(&dest);
   if (fp)
     fclose(fp);
   return 1;
 }
 
+// Parses file_name and checks that it has the given size, channels, maxval
+// and raster
+int parser_test_channels(const char *file_name, const char *description,
+                         size_t width, size_t height, size_t channels,
+                         size_t maxval, const uint8_t *expect_data) {
+  printf("%s... ", description);
+  struct img_st dest = {0, 0, NULL, NULL, 0, 0, 0};
+  FILE *fp = fopen(file_name, "r");
+  bool ok = fp && parse_file_h(fp, &dest) == PARSE_OK;
+  ok = ok && dest.width == width && dest.height == height &&
+       dest.channels == channels && dest.maxval == maxval &&
+       !memcmp(dest.img, expect_data,
+               width * height * channels * img_sample_size(&dest));
+  free_img(&dest);
+  if (fp)
+    fclose(fp);
+  printf(ok ? "OK.\n" : "Failed.\n");
+  return !ok;
+}
+
+// Grey and RGBA images: reading PGM and PAM, and writing them (as P5 and P7)
+// and reading them back, for a small image and for one large enough to be
+// mapped (see parse_file_mmap()).
+int test_parser_channels(void) {
+  int tf = 0;
+  const uint8_t grey[] = {255, 0, 127, 3};
+  const uint8_t rgba[] = {255, 0,   0, 255, 0,   255, 255, 128,
+                          0,   0, 255, 0,   255, 0,   255, 10};
+
+  tf += parser_test_channels("test/parse/init-p2.pgm",
+                             "Testing whether parsing a P2 file works", 2, 2,
+                             1, 255, grey);
+  tf += parser_test_channels("test/parse/init-p7.pam",
+                             "Testing whether parsing a P7 file works", 2, 2,
+                             4, 255, rgba);
+  // 16-bit samples are stored big endian in the file, in host order in memory
+  const uint16_t deep[] = {0x1234, 0xffff, 0x0001, 0x8000, 0x00ff, 0xff00};
+  tf += parser_test_channels("test/parse/p6-16bit.ppm",
+                             "Testing whether parsing a 16-bit P6 file works",
+                             2, 1, 3, 65535, (const uint8_t *)deep);
+  tf += parser_test_channels("test/parse/p3-16bit.ppm",
+                             "Testing whether parsing a 16-bit P3 file works",
+                             2, 1, 3, 65535, (const uint8_t *)deep);
+
+  const size_t big = 300;
+  uint8_t *raster = malloc(4 * big * big);
+  if (!raster) {
+    printf("Failed to allocate memory for the tests, exiting.\n");
+    return tf + 1;
+  }
+  for (size_t i = 0; i < 4 * big * big; i++)
+    raster[i] = i * 13 + i / 7;
+
+  // The 16-bit RGB image uses the same raster as 2 * big * big samples
+  const size_t channels[] = {1, 4, 3};
+  const size_t maxvals[] = {255, 255, 65535};
+  const char *names[] = {"test/out/grey.pgm", "test/out/rgba.pam",
+                         "test/out/rgb16.ppm"};
+  const char *descs[] = {"Testing whether a written P5 file parses again",
+                         "Testing whether a written P7 file parses again",
+                         "Testing whether a written 16-bit P6 file parses "
+                         "again"};
+  for (size_t i = 0; i < 3; i++) {
+    const size_t w = maxvals[i] > 255 ? big / 3 * 2 : big;
+    FILE *fp = fopen(names[i], "w");
+    if (!fp || write_img(fp, w, big, channels[i], maxvals[i], raster)) {
+      printf("Failed to write %s.\n", names[i]);
+      if (fp)
+        fclose(fp);
+      tf++;
+      continue;
+    }
+    fclose(fp);
+    tf += parser_test_channels(names[i], descs[i], w, big, channels[i],
+                               maxvals[i], raster);
+  }
+  free(raster);
+  return tf;
+}
+
+// Return value:
+//   true if no line of the file at path is longer than 70 characters
+static bool lines_short(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return false;
+  size_t len = 0;
+  int c;
+  bool ok = true;
+  while ((c = getc(fp)) != EOF) {
+    len = c == '\n' ? 0 : len + 1;
+    ok &= len <= 70;
+  }
+  fclose(fp);
+  return ok;
+}
+
+// Writing plain P2 and P3 files (with 8 and 16-bit samples) and reading them
+// back. The raster holds every 8-bit value, so every entry of the encoder's
+// digit table is used, and odd widths so rows end mid-line.
+int test_parser_plain(void) {
+  int tf = 0;
+  const size_t w = 37, h = 29;
+  uint8_t *raster = malloc(2 * 3 * w * h);
+  if (!raster) {
+    printf("Failed to allocate memory for the tests, exiting.\n");
+    return 1;
+  }
+  for (size_t i = 0; i < 2 * 3 * w * h; i++)
+    raster[i] = i * 7 + i / 5;
+
+  const size_t channels[] = {1, 3, 1, 3};
+  const size_t maxvals[] = {255, 255, 65535, 1000};
+  const char *names[] = {"test/out/plain.pgm", "test/out/plain.ppm",
+                         "test/out/plain16.pgm", "test/out/plain16.ppm"};
+  for (size_t i = 0; i < 4; i++) {
+    // Samples must not exceed maxval
+    if (maxvals[i] == 1000) {
+      uint16_t *deep = (uint16_t *)raster;
+      for (size_t j = 0; j < 3 * w * h; j++)
+        deep[j] %= 1001;
+    }
+    FILE *fp = fopen(names[i], "w");
+    if (!fp || write_img_plain(fp, w, h, channels[i], maxvals[i], raster)) {
+      printf("Failed to write %s.\n", names[i]);
+      if (fp)
+        fclose(fp);
+      tf++;
+      continue;
+    }
+    fclose(fp);
+    char desc[100];
+    snprintf(desc, sizeof(desc),
+             "Testing whether a written plain %s file (maxval %zu) parses "
+             "again",
+             channels[i] == 3 ? "P3" : "P2", maxvals[i]);
+    tf += parser_test_channels(names[i], desc, w, h, channels[i], maxvals[i],
+                               raster);
+    printf("Testing whether the lines of %s are at most 70 characters... ",
+           names[i]);
+    bool ok = lines_short(names[i]);
+    printf(ok ? "OK.\n" : "Failed.\n");
+    tf += !ok;
+  }
+  free(raster);
+  return tf;
+}
+
+// Writes a P3 file of width x height pixels to path, with sample i being
+// i % 256, except that sample bad (if < 3 * width * height) is replaced by
+// bad_text. Only the first n samples are written, followed by trailer.
+static int write_p3_text(const char *path, size_t width, size_t height,
+                         size_t n, size_t bad, const char *bad_text,
+                         const char *trailer) {
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    return 1;
+  fprintf(fp, "P3\n%zu %zu\n255\n", width, height);
+  for (size_t i = 0; i < n; i++) {
+    if (i == bad)
+      fprintf(fp, "%s%c", bad_text, i % 12 == 11 ? '\n' : ' ');
+    else
+      fprintf(fp, "%zu%c", i % 256, i % 12 == 11 ? '\n' : ' ');
+  }
+  fputs(trailer, fp);
+  return fclose(fp) != 0;
+}
+
+// Large plain-text rasters are decoded in chunks on several threads (see
+// parse_set_threads()). The results must be the same as decoding them in one
+// go, including errors: only errors before the last sample count, and missing
+// samples are an error even if they would be in another chunk.
+int test_parser_parallel(void) {
+  int tf = 0;
+  const size_t w = 512, h = 256, n = 3 * w * h;
+  uint8_t *expect = malloc(n);
+  if (!expect) {
+    printf("Failed to allocate memory for the tests, exiting.\n");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++)
+    expect[i] = i % 256;
+
+  struct {
+    const char *desc;
+    size_t n;
+    size_t bad;
+    const char *bad_text;
+    const char *trailer;
+    enum parse_err res;
+  } cases[] = {
+      {"Testing whether a large P3 file is decoded in parallel", n, n, "",
+       "\n", PARSE_OK},
+      {"Testing whether the parallel decoder takes a last sample without "
+       "whitespace after it",
+       n, n, "", "", PARSE_OK},
+      {"Testing whether the parallel decoder ignores garbage after the last "
+       "sample",
+       n, n, "", "\n-5 300 x\n", PARSE_OK},
+      {"Testing whether the parallel decoder finds an out-of-range sample",
+       n, n / 3 * 2, "256", "\n", PIXEL_OOR},
+      {"Testing whether the parallel decoder finds a character that isn't "
+       "allowed",
+       n, n / 2, "1#", "\n", PARSE_ERR},
+      {"Testing whether the parallel decoder finds a missing sample", n - 1,
+       n, "", "\n", READ_ERR},
+  };
+  parse_set_threads(TEST_THREADS);
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (write_p3_text("test/out/parallel.ppm", w, h, cases[i].n, cases[i].bad,
+                      cases[i].bad_text, cases[i].trailer)) {
+      printf("Failed to write test/out/parallel.ppm.\n");
+      tf++;
+      continue;
+    }
+    tf += parser_test("test/out/parallel.ppm", (char *)cases[i].desc,
+                      cases[i].res, cases[i].res == PARSE_OK ? 7 : 0, w, h,
+                      expect);
+  }
+  parse_set_threads(1);
+  free(expect);
+  return tf;
+}
+
+// Parses a small P3 file and writes it as P3 again while tracing, and checks
+// the spans in the Chrome trace
+int test_parser_trace(void) {
+  printf("Testing whether tracing records the stages of parsing and "
+         "writing... ");
+  const char *spans[] = {
+      "\"name\": \"header\"",
+      "\"name\": \"alloc\"", "\"name\": \"decode\"",
+      "\"name\": \"encode\"",
+      "\"name\": \"write\""};
+  struct img_st img = {0, 0, NULL, NULL, 0, 0, 0};
+  char text[4096] = "";
+  bool ok = !trace_start();
+  FILE *in = fopen("test/parse/init-p3.ppm", "r");
+  FILE *out = fopen("test/out/trace.ppm", "w");
+  FILE *json = fopen("test/out/trace.json", "w+");
+  if (!ok || !in || !out || !json || parse_file_h(in, &img) != PARSE_OK ||
+      write_img_plain(out, img.width, img.height, img.channels, img.maxval,
+                      img.img) ||
+      trace_write_chrome(json))
+    ok = false;
+  if (json) {
+    rewind(json);
+    text[fread(text, 1, sizeof(text) - 1, json)] = 0;
+  }
+  for (size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); i++)
+    ok = ok && strstr(text, spans[i]);
+  // The decode span covers the raster of 2x2 RGB pixels
+  const char *decode = strstr(text, spans[2]);
+  const char *eol = decode ? strchr(decode, '\n') : NULL;
+  const char *bytes = decode ? strstr(decode, "\"bytes\": 12}") : NULL;
+  ok = ok && eol && bytes && bytes < eol;
+  // Nothing is recorded once tracing is off
+  trace_stop();
+  ok = ok && !trace_begin();
+  free_img(&img);
+  if (in)
+    fclose(in);
+  if (out)
+    fclose(out);
+  if (json)
+    fclose(json);
+  printf(ok ? "OK.\n" : "Failed.\n");
+  return !ok;
+}
+
 int test_parser(void) {
   int tf = 0; // amount of failed tests
 
@@ -99,6 +389,18 @@ int test_parser(void) {
     goto files_error;
   fclose(fp2);
 
+  // Large P6 files are mapped instead of read. Write lena as P6, once complete
+  // and once cut short, to test that path too.
+  FILE *fp3 = fopen("test/out/lena-p6.ppm", "w");
+  if (!fp3 || write_img(fp3, 512, 512, 3, 255, lena_raster))
+    goto files_error;
+  fclose(fp3);
+  FILE *fp4 = fopen("test/out/lena-p6-short.ppm", "w");
+  if (!fp4 || write_img_header(fp4, 512, 513, 3, 255) ||
+      fwrite(lena_raster, 1, sizeof(lena_raster), fp4) < sizeof(lena_raster))
+    goto files_error;
+  fclose(fp4);
+
   tf += parser_test("test/parse/0by0-p3.ppm",
                     "Testing whether parsing a P3 file of size 0x0 works",
                     PARSE_OK, 7, 0, 0, NULL);
@@ -127,6 +429,15 @@ int test_parser(void) {
                     "Testing whether parsing lena.ppm works", PARSE_OK, 7, 512,
                     512, lena_raster);
 
+  tf += parser_test("test/out/lena-p6.ppm",
+                    "Testing whether parsing a large P6 file works", PARSE_OK,
+                    7, 512, 512, lena_raster);
+
+  tf += parser_test("test/out/lena-p6-short.ppm",
+                    "Testing whether parser can handle large P6 file having "
+                    "less pixels than the header said",
+                    READ_ERR, 0, 0, 0, NULL);
+
   tf += parser_test(
       "test/parse/inconvenient-whitespace.ppm",
       "Testing whether parser can handle arbitrary whitespace in the header",
@@ -207,6 +518,20 @@ int test_parser(void) {
                     "pixels than the header said",
                     READ_ERR, 0, 0, 0, NULL);
 
+  tf += parser_test("test/parse/pixel-oor-p3.ppm",
+                    "Testing whether parser rejects P3 sample larger than "
+                    "maxval",
+                    PIXEL_OOR, 0, 0, 0, NULL);
+
+  tf += parser_test("test/parse/pixel-oor-p3-maxval.ppm",
+                    "Testing whether parser rejects P3 sample larger than a "
+                    "maxval below 255",
+                    PIXEL_OOR, 0, 0, 0, NULL);
+
+  tf += parser_test("test/parse/maxval-too-large.ppm",
+                    "Testing whether parser rejects maxval above 65535",
+                    WRONG_DEPTH, 0, 0, 0, NULL);
+
   tf += parser_test("test/parse/overflow-split-number.ppm",
                     "Testing whether parser detects number out of range when "
                     "number is split across two fgets() calls",
@@ -215,7 +540,16 @@ int test_parser(void) {
   tf += parser_test("test/parse/nullbytes-in-header.ppm",
                     "Testing whether parser rejects null bytes in header",
                     PARSE_ERR, 0, 0, 0, NULL);
-  return tf;
+
+  tf += parser_test("test/parse/depth2.pam",
+                    "Testing whether parser rejects PAM with 2 channels",
+                    WRONG_CHANNELS, 0, 0, 0, NULL);
+
+  tf += parser_test("test/parse/pam-no-maxval.pam",
+                    "Testing whether parser rejects PAM without MAXVAL",
+                    PARSE_ERR, 0, 0, 0, NULL);
+  return tf + test_parser_channels() + test_parser_plain() +
+         test_parser_parallel() + test_parser_trace();
 
 files_error:
   printf("Failed to read a file necessary to run the tests, exiting.\n");
@@ -225,6 +559,9 @@ files_error:
 int test_batch(void) {
   printf("\nScale function tests\n");
   int fail = 0;
+  // The smallest tiles scale10 allows (64 columns), so that the test images
+  // span several of them, and the tile edges fall inside the blocks
+  scale_set_tile_bytes(1);
 
   // Scale factors to be tested
   const int sf_len = 3;
@@ -244,7 +581,7 @@ int test_batch(void) {
     }
 
     // Parse input file into buffer
-    struct img_st inimg = {0, 0, NULL};
+    struct img_st inimg = {0, 0, NULL, NULL, 0, 0, 0};
     if (parse_file(infile, &inimg)) {
       fprintf(stderr, "Test failed: Error reading input file %zu.ppm\n",
               num_img);
@@ -257,7 +594,8 @@ int test_batch(void) {
       int s = scale_factors[i];
 
       // Allocate buffer for expected result
-      size_t size_out = output_imgsize(inimg.width, inimg.height, s);
+      size_t size_out =
+          output_imgsize(inimg.width, inimg.height, s, inimg.channels);
       uint8_t *expected = malloc(size_out);
       if (errno == ERANGE || !expected) {
         fprintf(stderr,
@@ -273,15 +611,303 @@ int test_batch(void) {
       free(expected);
     }
 
-    free(inimg.img);
+    free_img(&inimg);
     fclose(infile);
   }
+  return fail + test_exact() + test_plans() + test_planar() + test_channels() +
+         test_depth16();
+}
+
+// scale1, scale7 to scale11 must match scale_naive byte for byte,
+// including at factors where scale_naive's double arithmetic truncates exact
+// multiples of scale_factor^2 one too low (see scale1_tables()). No other test
+// uses these factors, so the threads' bands all ask for a plan that isn't
+// built yet (see scale_plan()).
+int test_exact(void) {
+  const size_t exact_impls[] = {1, 7, 8, 9, 10, 11};
+  const size_t factors[] = {7, 11, 14, 29};
+  int fail = 0;
+
+  FILE *infile = fopen("test/scale/1.ppm", "r");
+  struct img_st inimg = {0, 0, NULL, NULL, 0, 0, 0};
+  if (!infile || parse_file(infile, &inimg)) {
+    fprintf(stderr, "Test failed: Error reading input file 1.ppm\n");
+    if (infile)
+      fclose(infile);
+    return 1;
+  }
+  fclose(infile);
+
+  for (size_t i = 0; i < 4; i++) {
+    const size_t s = factors[i];
+    size_t size_out =
+        output_imgsize(inimg.width, inimg.height, s, inimg.channels);
+    uint8_t *expected = malloc(size_out);
+    uint8_t *result = malloc(size_out);
+    if (!expected || !result) {
+      fprintf(stderr,
+              "Test failed: Error allocating memory for output image.\n");
+      ++fail;
+      free(expected);
+      free(result);
+      continue;
+    }
+    scale_naive(inimg.img, inimg.width, inimg.height, s, expected);
+
+    for (size_t j = 0; j < 6; j++) {
+      const size_t impl = exact_impls[j];
+      if (!scale_supported(impl))
+        continue;
+      errno = 0;
+      scale_parallel(scale_band_funs[impl - 1], TEST_THREADS, inimg.img,
+                     inimg.width, inimg.height, s, result);
+      if (errno == ENOMEM || memcmp(result, expected, size_out - 2)) {
+        printf("Test failed: Img: 1.ppm, Function: scale%zu, scale_factor: "
+               "%zu, not identical to scale_naive\n",
+               impl, s);
+        ++fail;
+      } else {
+        printf("Test passed: Img: 1.ppm, Function: scale%zu, scale_factor: "
+               "%zu, identical to scale_naive\n",
+               impl, s);
+      }
+    }
+    free(expected);
+    free(result);
+  }
+  free_img(&inimg);
+  return fail;
+}
+
+// Scaling must still give scale_naive's result with more scale factors than
+// the tables are cached for, and after scale_plans_free() dropped the cache.
+int test_plans(void) {
+  const size_t impls[] = {1, 8, 3};
+  int fail = 0;
+
+  FILE *infile = fopen("test/scale/1.ppm", "r");
+  struct img_st inimg = {0, 0, NULL, NULL, 0, 0, 0};
+  if (!infile || parse_file(infile, &inimg)) {
+    fprintf(stderr, "Test failed: Error reading input file 1.ppm\n");
+    if (infile)
+      fclose(infile);
+    return 1;
+  }
+  fclose(infile);
+
+  for (size_t s = 2; s <= 21; s++) {
+    if (s == 12)
+      scale_plans_free();
+    size_t size_out =
+        output_imgsize(inimg.width, inimg.height, s, inimg.channels);
+    uint8_t *expected = malloc(size_out);
+    uint8_t *result = malloc(size_out);
+    if (!expected || !result) {
+      fprintf(stderr,
+              "Test failed: Error allocating memory for output image.\n");
+      ++fail;
+      free(expected);
+      free(result);
+      continue;
+    }
+    // scale1 and scale8 must match scale_naive. scale3 rounds differently,
+    // its threaded result is compared with a single-threaded run instead.
+    scale_naive(inimg.img, inimg.width, inimg.height, s, expected);
+    for (size_t j = 0; j < 3; j++) {
+      const size_t impl = impls[j];
+      errno = 0;
+      if (impl == 3)
+        scale3(inimg.img, inimg.width, inimg.height, s, expected);
+      scale_parallel(scale_band_funs[impl - 1], TEST_THREADS, inimg.img,
+                     inimg.width, inimg.height, s, result);
+      if (errno == ENOMEM || memcmp(result, expected, size_out - 2)) {
+        printf("Test failed: Img: 1.ppm, Function: scale%zu, scale_factor: "
+               "%zu, wrong result with the table cache\n",
+               impl, s);
+        ++fail;
+      } else {
+        printf("Test passed: Img: 1.ppm, Function: scale%zu, scale_factor: "
+               "%zu, right result with the table cache\n",
+               impl, s);
+      }
+    }
+    free(expected);
+    free(result);
+  }
+  free_img(&inimg);
+  return fail;
+}
+
+// Splitting an image into planes and merging them again must give back the
+// same image, for RGB and RGBA. 37 pixels per row: two vectors of 16 and a
+// scalar remainder.
+int test_planar(void) {
+  const size_t width = 37, height = 3;
+  uint8_t img[4 * 37 * 3], back[4 * 37 * 3];
+  for (size_t i = 0; i < sizeof(img); i++)
+    img[i] = i * 7 + i / 3;
+  int fail = 0;
+
+  for (size_t channels = 3; channels <= 4; channels++) {
+    printf("Testing conversion of %zu channels to planar and back... ",
+           channels);
+    struct planar_st p;
+    if (planar_alloc(&p, width, height, channels)) {
+      printf("Failed: Could not allocate memory.\n");
+      fail++;
+      continue;
+    }
+    planar_from_interleaved(&p, img);
+    bool ok = p.stride % PLANAR_ALIGN == 0 && p.stride >= width + 16;
+    for (size_t y = 0; y < height; y++) {
+      for (size_t x = 0; x < width; x++) {
+        for (size_t c = 0; c < channels; c++) {
+          ok = ok && p.plane[c][y * p.stride + x] ==
+                         img[channels * (y * width + x) + c];
+        }
+      }
+    }
+    planar_to_interleaved(&p, back);
+    ok = ok && !memcmp(img, back, channels * width * height);
+    planar_free(&p);
+    printf(ok ? "OK.\n" : "Failed.\n");
+    fail += !ok;
+  }
+  return fail;
+}
+
+// The grey and RGBA variants (see scale_band_fun()) must match scale_naive
+// byte for byte, like test_exact() checks for RGB. The images are generated;
+// 37 pixels per row exercise the vector loops and their remainders.
+int test_channels(void) {
+  const size_t sizes[][2] = {{37, 5}, {1, 4}, {6, 1}};
+  const size_t factors[] = {1, 3, 7, 17, 29};
+  const size_t channels[] = {1, 4};
+  int fail = 0;
+
+  for (size_t c = 0; c < 2; c++) {
+    for (size_t i = 0; i < 3; i++) {
+      const size_t width = sizes[i][0], height = sizes[i][1];
+      uint8_t *img = malloc(input_imgsize(width, height, channels[c]));
+      if (!img) {
+        ++fail;
+        continue;
+      }
+      for (size_t k = 0; k < channels[c] * width * height; k++)
+        img[k] = k * 29 + k / 5;
+
+      for (size_t f = 0; f < 5; f++) {
+        const size_t s = factors[f];
+        size_t size_out = output_imgsize(width, height, s, channels[c]);
+        uint8_t *expected = malloc(size_out);
+        uint8_t *result = malloc(size_out);
+        if (!expected || !result) {
+          fprintf(stderr,
+                  "Test failed: Error allocating memory for output image.\n");
+          ++fail;
+          free(expected);
+          free(result);
+          continue;
+        }
+        scale_naive_channels(img, width, height, s, expected, channels[c]);
+
+        for (size_t impl = 1; impl <= MAX_IMPLEMENTATION; impl++) {
+          void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *,
+                      size_t, size_t) = scale_band_fun(impl, channels[c], 1);
+          if (!fun || !scale_supported(impl))
+            continue;
+          errno = 0;
+          scale_parallel(fun, TEST_THREADS, img, width, height, s, result);
+          if (errno == ENOMEM || memcmp(result, expected, size_out - 2)) {
+            printf("Test failed: %zux%zu, %zu channel(s), Function: scale%zu, "
+                   "scale_factor: %zu, not identical to scale_naive\n",
+                   width, height, channels[c], impl, s);
+            ++fail;
+          } else {
+            printf("Test passed: %zux%zu, %zu channel(s), Function: scale%zu, "
+                   "scale_factor: %zu, identical to scale_naive\n",
+                   width, height, channels[c], impl, s);
+          }
+        }
+        free(expected);
+        free(result);
+      }
+      free(img);
+    }
+  }
+  return fail;
+}
+
+// The same for 16-bit samples against scale_naive16, with values across the
+// whole range. The last factor is beyond SCALE9_16_MAX_FACTOR, so only scale1
+// runs there.
+int test_depth16(void) {
+  const size_t sizes[][2] = {{19, 4}, {1, 3}, {5, 1}};
+  const size_t factors[] = {1, 3, 7, 29, 257};
+  const size_t channels[] = {1, 3, 4};
+  int fail = 0;
+
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t i = 0; i < 3; i++) {
+      const size_t width = sizes[i][0], height = sizes[i][1];
+      uint16_t *img = malloc(input_imgsize(width, height, 2 * channels[c]));
+      if (!img) {
+        ++fail;
+        continue;
+      }
+      for (size_t k = 0; k < channels[c] * width * height; k++)
+        img[k] = k * 40503 + k / 3;
+
+      for (size_t f = 0; f < 5; f++) {
+        const size_t s = factors[f];
+        size_t size_out = output_imgsize(width, height, s, 2 * channels[c]);
+        uint8_t *expected = malloc(size_out);
+        uint8_t *result = malloc(size_out);
+        if (!expected || !result) {
+          fprintf(stderr,
+                  "Test failed: Error allocating memory for output image.\n");
+          ++fail;
+          free(expected);
+          free(result);
+          continue;
+        }
+        scale_naive16((uint8_t *)img, width, height, s, expected, channels[c]);
+
+        for (size_t impl = 1; impl <= MAX_IMPLEMENTATION; impl++) {
+          void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *,
+                      size_t, size_t) = scale_band_fun(impl, channels[c], 2);
+          if (!fun || (impl == 9 && s > SCALE9_16_MAX_FACTOR))
+            continue;
+          errno = 0;
+          scale_parallel(fun, TEST_THREADS, (uint8_t *)img, width, height, s,
+                         result);
+          if (errno == ENOMEM ||
+              memcmp(result, expected,
+                     2 * channels[c] * width * height * s * s)) {
+            printf("Test failed: %zux%zu, %zu channel(s), 16 bit, Function: "
+                   "scale%zu, scale_factor: %zu, not identical to "
+                   "scale_naive16\n",
+                   width, height, channels[c], impl, s);
+            ++fail;
+          } else {
+            printf("Test passed: %zux%zu, %zu channel(s), 16 bit, Function: "
+                   "scale%zu, scale_factor: %zu, identical to scale_naive16\n",
+                   width, height, channels[c], impl, s);
+          }
+        }
+        free(expected);
+        free(result);
+      }
+      free(img);
+    }
+  }
   return fail;
 }
 
 int test_hard_coded() {
-  // Image that will be scaled
-  uint8_t img[12] = {255, 0, 0, 0, 255, 255, 0, 0, 255, 255, 0, 255};
+  // Image that will be scaled. The SIMD implementations read past the last
+  // pixel, so pad it the same way input_imgsize() pads parsed images.
+  uint8_t img[48] = {255, 0, 0, 0, 255, 255, 0, 0, 255, 255, 0, 255};
 
   // Expected results for hardcoded test for each scale_factor (sf=1, sf=2,
   // sf=3)
@@ -368,10 +994,11 @@ int iterate_functions(size_t scale_factor, uint8_t *img, size_t width,
   char path_out[MAX_PATH_LENGTH];
   int fail = 0;
 
-  // Allocate buffer for results of the scale functions
-  size_t size_out = output_imgsize(width, height, scale_factor);
+  // Allocate buffers for results of the scale functions
+  size_t size_out = output_imgsize(width, height, scale_factor, CHANNELS);
   uint8_t *result = malloc(size_out);
-  if (!result) {
+  uint8_t *threaded = malloc(size_out);
+  if (!result || !threaded) {
     fprintf(stderr, "Test failed: Error allocating memory for output image.\n");
     ++fail;
     goto cleanup;
@@ -382,6 +1009,25 @@ int iterate_functions(size_t scale_factor, uint8_t *img, size_t width,
     // scale4 only handles scale_factors up to 16
     if (j == 3 && scale_factor > 16)
       continue;
+    if (j == 4 && scale_factor > SCALE5_MAX_FACTOR)
+      continue;
+    if (j == 5 && scale_factor > SCALE6_MAX_FACTOR)
+      continue;
+    if (j == 7 && scale_factor > SCALE8_MAX_FACTOR)
+      continue;
+    if (j == 8 && scale_factor > SCALE9_MAX_FACTOR)
+      continue;
+    if (j == 9 && scale_factor > SCALE10_MAX_FACTOR)
+      continue;
+    if (j == 10 && scale_factor > SCALE11_MAX_FACTOR)
+      continue;
+    // Can't test what the CPU can't run
+    if (!scale_supported(j + 1)) {
+      printf("Test skipped: Img: %zu.ppm, Function: scale%d, not supported "
+             "by this CPU\n",
+             num_img, j + 1);
+      continue;
+    }
 
     errno = 0;
     scale_funs[j](img, width, height, scale_factor, result);
@@ -394,6 +1040,20 @@ int iterate_functions(size_t scale_factor, uint8_t *img, size_t width,
       continue;
     }
 
+    // Splitting the work across threads must not change a single byte.
+    // Do this before compare(), which paints over result.
+    errno = 0;
+    scale_parallel(scale_band_funs[j], TEST_THREADS, img, width, height,
+                   scale_factor, threaded);
+    if (errno == ENOMEM ||
+        memcmp(result, threaded, size_out - 2)) { // -2: see output_imgsize()
+      printf("Test failed: Img: %zu.ppm, Function: scale%d, scale_factor: "
+             "%zu, threads: %d\n",
+             num_img, j + 1, scale_factor, TEST_THREADS);
+      ++fail;
+      continue;
+    }
+
     bool check_boundary = BOUNDARY_CHECK(j);
 
     // Compare actual and expected results, write image produced by compare() if
@@ -415,7 +1075,7 @@ int iterate_functions(size_t scale_factor, uint8_t *img, size_t width,
 
       size_t width_out = width * scale_factor;
       size_t height_out = height * scale_factor;
-      if (write_img(outfile, width_out, height_out, result)) {
+      if (write_img(outfile, width_out, height_out, CHANNELS, 255, result)) {
         fprintf(stderr, "Error writing to output file.\n");
         printf("Test failed: Img: %zu, Function: scale%d, scale_factor: %zu\n",
                num_img, j + 1, scale_factor);
@@ -438,5 +1098,715 @@ int iterate_functions(size_t scale_factor, uint8_t *img, size_t width,
 cleanup:
   if (result)
     free(result);
+  if (threaded)
+    free(threaded);
+  return fail;
+}
+
+// Return value:
+//   true if the files at paths a and b have the same contents
+static bool files_equal(const char *a, const char *b) {
+  FILE *fa = fopen(a, "r");
+  FILE *fb = fopen(b, "r");
+  bool equal = fa && fb;
+  while (equal) {
+    int ca = getc(fa);
+    equal = ca == getc(fb);
+    if (ca == EOF)
+      break;
+  }
+  if (fa)
+    fclose(fa);
+  if (fb)
+    fclose(fb);
+  return equal;
+}
+
+// Scales the image at path_in by scale_factor as a whole, with the
+// implementation pick_version() picks, and writes it to path_out.
+// Return value:
+//   0 if successful
+//   1 otherwise
+static int write_scaled(const char *path_in, size_t scale_factor,
+                        const char *path_out) {
+  struct img_st img = {0, 0, NULL, NULL, 0, 0, 0};
+  uint8_t *result = NULL;
+  int res = 1;
+  FILE *fp = fopen(path_in, "r");
+  if (!fp || parse_file(fp, &img))
+    goto cleanup;
+  fclose(fp);
+  fp = NULL;
+
+  const size_t ss = img_sample_size(&img);
+  if (img.width * img.height != 0) {
+    result = malloc(output_imgsize(img.width, img.height, scale_factor,
+                                   img.channels * ss));
+    if (!result)
+      goto cleanup;
+    scale_parallel(
+        scale_band_fun(pick_version(scale_factor, img.width, img.channels, ss),
+                       img.channels, ss),
+        TEST_THREADS, img.img, img.width, img.height, scale_factor, result);
+  }
+  fp = fopen(path_out, "w");
+  if (fp && !write_img(fp, img.width * scale_factor,
+                       img.height * scale_factor, img.channels, img.maxval,
+                       result))
+    res = 0;
+
+cleanup:
+  if (fp && fclose(fp))
+    res = 1;
+  free(result);
+  free_img(&img);
+  return res;
+}
+
+// Return value:
+//   the size of the file at path, or -1 if it can't be opened
+static long file_size(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  long size = fseek(fp, 0, SEEK_END) ? -1 : ftell(fp);
+  fclose(fp);
+  return size;
+}
+
+int test_batch_mode() {
+  printf("\nBatch mode tests\n");
+  int fail = 0;
+
+  const char *templates[] = {"out/%s.ppm", "out", "out/", "%s-%s"};
+  const char *expected[] = {"out/lena.ppm", "out/lena.ppm", "out/lena.ppm",
+                            "lena-lena"};
+  printf("Testing output file names... ");
+  for (size_t i = 0; i < 4; i++) {
+    char *name = batch_out_name(templates[i], "test/parse/lena.ppm");
+    if (!name || strcmp(name, expected[i]))
+      fail++;
+    free(name);
+  }
+  printf(fail ? "Failed.\n" : "OK.\n");
+
+  // A missing file must not keep the others from being scaled, and each
+  // output must be what scaling its input alone gives. The formats are
+  // written by test_parser(); the mapped large P6 file too.
+  char *names[] = {"test/parse/comments.ppm", "test/parse/nonexistent.ppm",
+                   "test/parse/header-spaced-p6.ppm", "test/out/grey.pgm",
+                   "test/out/rgba.pam", "test/out/rgb16.ppm",
+                   "test/out/lena-p6.ppm"};
+  const char *outs[] = {"test/out/batch_comments.ppm", NULL,
+                        "test/out/batch_header-spaced-p6.ppm",
+                        "test/out/batch_grey.pgm.ppm",
+                        "test/out/batch_rgba.pam.ppm",
+                        "test/out/batch_rgb16.ppm",
+                        "test/out/batch_lena-p6.ppm"};
+  const size_t n = sizeof(names) / sizeof(names[0]);
+  const char *expected_path = "test/out/batch-expected.ppm";
+  for (size_t i = 0; i < n; i++) {
+    if (outs[i])
+      remove(outs[i]);
+  }
+  printf("Testing whether a failing file doesn't stop the batch... ");
+  size_t failed = scale_batch(names, n, "test/out/batch_%s.ppm", 3, 0,
+                              TEST_THREADS);
+  bool ok = failed == 1;
+  for (size_t i = 0; i < n; i++) {
+    if (outs[i] && file_size(outs[i]) < 0)
+      ok = false;
+  }
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+  for (size_t i = 0; i < n; i++) {
+    if (!outs[i])
+      continue;
+    printf("Testing whether the batch output of %s matches scaling it "
+           "alone... ",
+           names[i]);
+    ok = !write_scaled(names[i], 3, expected_path) &&
+         files_equal(outs[i], expected_path);
+    printf(ok ? "OK.\n" : "Failed.\n");
+    fail += !ok;
+  }
+
+  // Writing the output would truncate the (mapped) input while it's read
+  printf("Testing whether a batch refuses to overwrite its input... ");
+  const long size = file_size("test/out/lena-p6.ppm");
+  char *self[] = {"test/out/lena-p6.ppm"};
+  failed = scale_batch(self, 1, "test/out", 2, 0, TEST_THREADS);
+  ok = failed == 1 && size > 0 && file_size("test/out/lena-p6.ppm") == size;
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  // Two inputs of the same base name would be written to the same output;
+  // only the first one may be
+  printf("Testing whether a batch refuses outputs of the same name... ");
+  const uint8_t other[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+  FILE *fp = fopen("test/out/comments.ppm", "w");
+  ok = fp && !write_img(fp, 2, 2, 3, 255, other);
+  if (fp && fclose(fp))
+    ok = false;
+  char *same[] = {"test/parse/comments.ppm", "test/out/comments.ppm"};
+  remove("test/out/batch_comments.ppm");
+  failed = scale_batch(same, 2, "test/out/batch_%s.ppm", 2, 0, TEST_THREADS);
+  ok = ok && failed == 1 &&
+       !write_scaled("test/parse/comments.ppm", 2, expected_path) &&
+       files_equal("test/out/batch_comments.ppm", expected_path);
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  // Like a single file, -V4 beyond factor 16 or on a single column must be
+  // refused instead of writing wrong pixels
+  printf("Testing whether a batch refuses an implementation beyond its "
+         "limits... ");
+  char *limited[] = {"test/parse/comments.ppm", "test/scale/4.ppm"};
+  const size_t limited_factors[] = {17, 2};
+  ok = true;
+  for (size_t i = 0; i < 2; i++) {
+    remove("test/out/batch-limit_comments.ppm");
+    remove("test/out/batch-limit_4.ppm");
+    failed = scale_batch(&limited[i], 1, "test/out/batch-limit_%s.ppm",
+                         limited_factors[i], 4, TEST_THREADS);
+    if (failed != 1 || file_size("test/out/batch-limit_comments.ppm") >= 0 ||
+        file_size("test/out/batch-limit_4.ppm") >= 0)
+      ok = false;
+  }
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  return fail;
+}
+
+// Scales the file at path with scale_stream() into path_out, with the
+// implementation pick_version() picks.
+// Return value:
+//   0 if successful
+//   1 otherwise, after printing an error message
+static int stream_file(const char *path, const char *path_out,
+                       size_t scale_factor, size_t threads, bool plain) {
+  FILE *in = fopen(path, "r");
+  FILE *out = fopen(path_out, "w");
+  int res = 1;
+  if (in && out) {
+    struct img_st img;
+    struct img_stream_st *st = stream_open(in, &img);
+    if (st) {
+      const size_t ss = img_sample_size(&img);
+      res = scale_stream(
+          st, out, &img, scale_factor,
+          scale_band_fun(pick_version(scale_factor, img.width, img.channels,
+                                      ss),
+                         img.channels, ss),
+          threads, plain);
+      stream_close(st);
+    }
+  }
+  if (in)
+    fclose(in);
+  if (out && fclose(out))
+    res = 1;
+  return res;
+}
+
+// Streaming (see stream.h) must write the same bytes as scaling the whole
+// image with scale_parallel() and writing it with write_img() or
+// write_img_plain(), for every pixel format, any number of threads (which is
+// the number of rows per step) and scale factor. Truncated input must fail.
+int test_stream() {
+  printf("\nStream tests\n");
+  int fail = 0;
+  const char *expected_path = "test/out/stream-expected.ppm";
+  const char *stream_path = "test/out/stream.ppm";
+
+  // Some of these are written by test_parser()
+  const char *names[] = {
+      "test/scale/0.ppm",      "test/scale/1.ppm",
+      "test/scale/4.ppm",      "test/parse/init-p3.ppm",
+      "test/parse/0by5.ppm",   "test/out/grey.pgm",
+      "test/out/rgba.pam",     "test/out/rgb16.ppm",
+      "test/out/plain.pgm",    "test/out/plain16.ppm",
+      "test/out/plain16.pgm"};
+  const size_t factors[] = {1, 2, 3};
+  const size_t threads[] = {1, 2, TEST_THREADS};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    printf("Testing whether streaming %s gives the same bytes as scaling it "
+           "whole... ",
+           names[i]);
+    struct img_st img = {0, 0, NULL, NULL, 0, 0, 0};
+    FILE *fp = fopen(names[i], "r");
+    if (!fp || parse_file(fp, &img)) {
+      printf("Failed to read %s.\n", names[i]);
+      if (fp)
+        fclose(fp);
+      fail++;
+      continue;
+    }
+    fclose(fp);
+    const size_t ss = img_sample_size(&img);
+
+    bool ok = true;
+    for (size_t f = 0; ok && f < sizeof(factors) / sizeof(factors[0]); f++) {
+      const size_t s = factors[f];
+      uint8_t *result = NULL;
+      if (img.width * img.height != 0) {
+        result = malloc(output_imgsize(img.width, img.height, s,
+                                       img.channels * ss));
+        if (!result) {
+          ok = false;
+          break;
+        }
+        scale_parallel(scale_band_fun(pick_version(s, img.width,
+                                                   img.channels, ss),
+                                      img.channels, ss),
+                       TEST_THREADS, img.img, img.width, img.height, s,
+                       result);
+      }
+      // There is no plain-text PAM
+      for (int plain = 0; ok && plain < (img.channels == 4 ? 1 : 2);
+           plain++) {
+        fp = fopen(expected_path, "w");
+        if (!fp || (plain ? write_img_plain : write_img)(
+                       fp, img.width * s, img.height * s, img.channels,
+                       img.maxval, result)) {
+          ok = false;
+        }
+        if (fp && fclose(fp))
+          ok = false;
+        for (size_t t = 0; ok && t < sizeof(threads) / sizeof(threads[0]);
+             t++) {
+          ok = !stream_file(names[i], stream_path, s, threads[t], plain) &&
+               files_equal(stream_path, expected_path);
+          if (!ok)
+            printf("(factor %zu, %zu thread(s)%s) ", s, threads[t],
+                   plain ? ", plain" : "");
+        }
+      }
+      free(result);
+    }
+    free_img(&img);
+    printf(ok ? "OK.\n" : "Failed.\n");
+    fail += !ok;
+  }
+
+  // Missing rows must be reported, not written as zeros
+  const char *truncated[] = {"test/parse/too-short-p3.ppm",
+                             "test/parse/too-short-p6.ppm",
+                             "test/out/lena-p6-short.ppm"};
+  for (size_t i = 0; i < sizeof(truncated) / sizeof(truncated[0]); i++) {
+    printf("Testing whether streaming the truncated %s is an error... ",
+           truncated[i]);
+    bool ok = stream_file(truncated[i], stream_path, 2, TEST_THREADS, false);
+    printf(ok ? "OK.\n" : "Failed.\n");
+    fail += !ok;
+  }
+
+  return fail;
+}
+
+int test_resize() {
+  printf("\nResize tests\n");
+  int fail = 0;
+  // Padded like in test_hard_coded()
+  uint8_t img[48] = {255, 0, 0, 0, 255, 255, 0, 0, 255, 255, 0, 255};
+  uint8_t result[3 * 8 * 4];
+
+  // Powers of 2 must give exactly what scaling does
+  uint8_t expected[3 * 4 * 4];
+  printf("Testing whether resizing by 2 matches scale_naive... ");
+  scale_naive(img, 2, 2, 2, expected);
+  if (resize(img, 2, 2, result, 4, 4) || memcmp(result, expected, 48)) {
+    printf("Failed.\n");
+    fail++;
+  } else {
+    printf("OK.\n");
+  }
+
+  printf("Testing whether resizing to the same size copies the image... ");
+  if (resize(img, 2, 2, result, 2, 2) || memcmp(result, img, 12)) {
+    printf("Failed.\n");
+    fail++;
+  } else {
+    printf("OK.\n");
+  }
+
+  // Different factors per axis: 4 in x, 3/2 in y, against the exact
+  // interpolation (source position X * 2 / 8, Y * 2 / 3), truncated
+  printf("Testing resizing by 4:3/2... ");
+  bool ok = !resize(img, 2, 2, result, 8, 3);
+  for (size_t y = 0; y < 3; y++) {
+    for (size_t x = 0; x < 8; x++) {
+      double u = x * 2 / 8.0 < 1 ? x * 2 / 8.0 : 1;
+      double v = y * 2 / 3.0 < 1 ? y * 2 / 3.0 : 1;
+      for (size_t c = 0; c < 3; c++) {
+        double exact = (1 - u) * (1 - v) * img[c] + u * (1 - v) * img[3 + c] +
+                       (1 - u) * v * img[6 + c] + u * v * img[9 + c];
+        double diff = result[(y * 8 + x) * 3 + c] - (int)exact;
+        if (diff > 1 || diff < -1)
+          ok = false;
+      }
+    }
+  }
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  printf("Testing parsing of --resize arguments... ");
+  struct resize_spec_st spec;
+  size_t w, h;
+  ok = !resize_parse_spec("2.25", &spec) &&
+       !resize_target(&spec, 100, 10, &w, &h) && w == 225 && h == 22;
+  ok = ok && !resize_parse_spec("4:3/2", &spec) &&
+       !resize_target(&spec, 100, 10, &w, &h) && w == 400 && h == 15;
+  ok = ok && !resize_parse_spec("1920x1080", &spec) &&
+       !resize_target(&spec, 100, 10, &w, &h) && w == 1920 && h == 1080;
+  // These print error messages
+  ok = ok && resize_parse_spec("0", &spec) && resize_parse_spec("1:", &spec) &&
+       resize_parse_spec("3/0", &spec) && resize_parse_spec("10x", &spec);
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  return fail;
+}
+
+// Checks that interp_scale_roi() gives the pixels of roi in full, the whole
+// output of interp_scale() (width_out pixels per row of px bytes)
+static bool roi_matches(struct interp_ctx_st *ctx,
+                        const struct interp_image_st *img, size_t s,
+                        const struct interp_roi_st *roi, const uint8_t *full,
+                        size_t width_out, size_t px) {
+  const size_t size = roi->width * roi->height * px;
+  uint8_t *out = malloc(size ? size : 1);
+  bool ok = out && interp_scale_roi(ctx, img, s, roi, out, size) == INTERP_OK;
+  for (size_t y = 0; ok && y < roi->height; y++)
+    ok = !memcmp(out + y * roi->width * px,
+                 full + ((roi->y + y) * width_out + roi->x) * px,
+                 roi->width * px);
+  free(out);
+  return ok;
+}
+
+// interp_scale_roi() must match interp_scale() for every implementation,
+// for rectangles inside the image and for ones that touch its last row or
+// column, where the boundary rules apply.
+static int test_interp_roi(void) {
+  int fail = 0;
+  struct interp_ctx_st *ctx = interp_ctx_new(TEST_THREADS);
+  if (!ctx) {
+    printf("Failed to create a context.\n");
+    return 1;
+  }
+  const size_t width = 23, height = 9;
+  const size_t channels[] = {1, 3, 4};
+  const size_t maxvals[] = {255, 65535};
+  const size_t factors[] = {1, 3, 16};
+  uint8_t *raster = malloc(width * height * 4 * 2);
+  if (!raster) {
+    printf("Failed to allocate memory for the tests.\n");
+    interp_ctx_free(ctx);
+    return 1;
+  }
+  for (size_t i = 0; i < width * height * 4 * 2; i++)
+    raster[i] = i * 37 + i / 5;
+
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t m = 0; m < 2; m++) {
+      const size_t px = channels[c] * (maxvals[m] > 255 ? 2 : 1);
+      const struct interp_image_st img = {width,       height,
+                                          channels[c], maxvals[m],
+                                          raster,      width * height * px};
+      for (size_t v = 0; v <= MAX_IMPLEMENTATION; v++) {
+        if (v && (!scale_band_fun(v, channels[c], px / channels[c]) ||
+                  !scale_supported(v)))
+          continue;
+        interp_set_version(ctx, v);
+        for (size_t f = 0; f < 3; f++) {
+          const size_t s = factors[f];
+          const size_t wo = width * s, ho = height * s;
+          const struct interp_roi_st rois[] = {
+              {0, 0, wo, ho},         {s + 1, s / 2, 2 * s + 3, s + 2},
+              {wo - 5, 0, 5, ho},     {0, ho - 3, wo, 3},
+              {wo - 1, ho - 1, 1, 1}, {0, 0, 1, 1},
+              {wo / 2, ho / 2, 0, 4}};
+          size_t size_out;
+          interp_output_size(&img, s, &size_out);
+          uint8_t *full = malloc(size_out);
+          bool ok = full &&
+                    interp_scale(ctx, &img, s, full, size_out) == INTERP_OK;
+          for (size_t r = 0; ok && r < sizeof(rois) / sizeof(rois[0]); r++)
+            ok = roi_matches(ctx, &img, s, &rois[r], full, wo, px);
+          free(full);
+          printf("Test %s: interp_scale_roi(), %zu channel(s), maxval %zu, "
+                 "-V%zu, scale_factor: %zu\n",
+                 ok ? "passed" : "failed", channels[c], maxvals[m], v, s);
+          fail += !ok;
+        }
+      }
+    }
+  }
+
+  const struct interp_image_st img = {width, height, 3, 255, raster,
+                                      width * height * 3};
+  uint8_t out[3 * 4];
+  interp_set_version(ctx, 0);
+  printf("Testing whether interp_scale_roi() rejects a ROI beyond the "
+         "image... ");
+  const struct interp_roi_st outside = {2 * width - 1, 0, 2, 2};
+  bool ok = interp_scale_roi(ctx, &img, 2, &outside, out, sizeof(out)) ==
+            INTERP_EINVAL;
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+  printf("Testing whether interp_scale_roi() rejects a small output "
+         "buffer... ");
+  const struct interp_roi_st big = {0, 0, 3, 2};
+  ok = interp_scale_roi(ctx, &img, 2, &big, out, sizeof(out)) == INTERP_ESIZE;
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  free(raster);
+  interp_ctx_free(ctx);
+  return fail;
+}
+
+// Checks that interp_scale(ctx, img, s, ...) returns expect_res, and if that
+// is INTERP_OK, that its output matches expected (size_out bytes)
+static int interp_test(struct interp_ctx_st *ctx,
+                       const struct interp_image_st *img, size_t s,
+                       uint8_t *result, size_t out_size,
+                       const uint8_t *expected, size_t size_out,
+                       enum interp_err expect_res, const char *description) {
+  printf("%s... ", description);
+  enum interp_err res = interp_scale(ctx, img, s, result, out_size);
+  bool ok = res == expect_res &&
+            (res != INTERP_OK || !memcmp(result, expected, size_out));
+  printf(ok ? "OK.\n" : "Failed (%s).\n", interp_strerror(res));
+  return !ok;
+}
+
+// The library interface: interp_scale() must give the same results as
+// calling the implementation it picks directly, whether or not the input is
+// padded (see interp_input_size()), and report invalid arguments. One context
+// scales all images, so its thread pool and scratch buffer are reused.
+int test_interp() {
+  printf("\nLibrary tests\n");
+  int fail = 0;
+  struct interp_ctx_st *ctx = interp_ctx_new(TEST_THREADS);
+  if (!ctx) {
+    printf("Failed to create a context.\n");
+    return 1;
+  }
+
+  const size_t width = 37, height = 11;
+  const size_t channels[] = {1, 3, 4};
+  const size_t maxvals[] = {255, 65535};
+  const size_t factors[] = {1, 3, 8, 20};
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t m = 0; m < 2; m++) {
+      struct interp_image_st img = {width, height, channels[c], maxvals[m],
+                                    NULL, 0};
+      const size_t ss = maxvals[m] > 255 ? 2 : 1;
+      const size_t raster_size = width * height * channels[c] * ss;
+      size_t size_in;
+      // Exactly the raster, so that reading past it would show up with
+      // AddressSanitizer, and a padded copy to scale directly
+      uint8_t *raster = malloc(raster_size);
+      uint8_t *padded = NULL;
+      if (interp_input_size(&img, &size_in) == INTERP_OK)
+        padded = calloc(size_in, 1);
+      if (!raster || !padded) {
+        printf("Failed to allocate memory for the tests.\n");
+        free(raster);
+        free(padded);
+        fail++;
+        continue;
+      }
+      for (size_t i = 0; i < raster_size; i++)
+        raster[i] = padded[i] = i * 29 + i / 3;
+
+      for (size_t f = 0; f < 4; f++) {
+        const size_t s = factors[f];
+        size_t size_out = 0;
+        interp_output_size(&img, s, &size_out);
+        uint8_t *expected = malloc(size_out);
+        uint8_t *result = malloc(size_out);
+        if (!expected || !result) {
+          printf("Failed to allocate memory for the tests.\n");
+          free(expected);
+          free(result);
+          fail++;
+          continue;
+        }
+        const size_t version = pick_version(s, width, channels[c], ss);
+        scale_band_fun(version, channels[c], ss)(padded, width, height, s,
+                                                 expected, 0, height);
+
+        char desc[160];
+        img.data = raster;
+        img.size = raster_size;
+        snprintf(desc, sizeof(desc),
+                 "Testing interp_scale() with %zu channel(s), maxval %zu, "
+                 "factor %zu, unpadded input",
+                 channels[c], maxvals[m], s);
+        fail += interp_test(ctx, &img, s, result, size_out, expected,
+                            size_out - 2, INTERP_OK, desc);
+        img.data = padded;
+        img.size = size_in;
+        snprintf(desc, sizeof(desc),
+                 "Testing interp_scale() with %zu channel(s), maxval %zu, "
+                 "factor %zu, padded input",
+                 channels[c], maxvals[m], s);
+        fail += interp_test(ctx, &img, s, result, size_out, expected,
+                            size_out - 2, INTERP_OK, desc);
+        free(expected);
+        free(result);
+      }
+      free(raster);
+      free(padded);
+    }
+  }
+
+  uint8_t px[64] = {0}, out[64];
+  struct interp_image_st img = {2, 2, 3, 255, px, sizeof(px)};
+  fail += interp_test(ctx, &img, 2, out, 49, NULL, 0, INTERP_ESIZE,
+                      "Testing whether interp_scale() rejects a small output "
+                      "buffer");
+  fail += interp_test(ctx, &img, 0, out, sizeof(out), NULL, 0, INTERP_EINVAL,
+                      "Testing whether interp_scale() rejects factor 0");
+  img.channels = 2;
+  fail += interp_test(ctx, &img, 2, out, sizeof(out), NULL, 0, INTERP_EINVAL,
+                      "Testing whether interp_scale() rejects 2 channels");
+  img.channels = 1;
+  img.size = 3;
+  fail += interp_test(ctx, &img, 2, out, sizeof(out), NULL, 0, INTERP_EINVAL,
+                      "Testing whether interp_scale() rejects input smaller "
+                      "than the raster");
+  img.size = sizeof(px);
+  img.width = SIZE_MAX / 2;
+  fail += interp_test(ctx, &img, 4, out, sizeof(out), NULL, 0, INTERP_ERANGE,
+                      "Testing whether interp_scale() rejects an output size "
+                      "out of range");
+  img.width = 2;
+  printf("Testing whether interp_set_version() rejects -V%d... ",
+         MAX_IMPLEMENTATION + 1);
+  bool ok = interp_set_version(ctx, MAX_IMPLEMENTATION + 1) == INTERP_EINVAL;
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+  interp_set_version(ctx, 4);
+  fail += interp_test(ctx, &img, 2, out, sizeof(out), NULL, 0, INTERP_ENOTSUP,
+                      "Testing whether interp_scale() rejects grey images "
+                      "with scale4");
+
+  // Beyond their limits, the implementations would write wrong pixels
+  const struct {
+    size_t version, width, maxval, scale_factor;
+    const char *description;
+  } limits[] = {
+      {8, 2, 255, SCALE8_MAX_FACTOR + 2,
+       "Testing whether interp_scale() rejects factor 130 with scale8"},
+      {9, 2, 65535, SCALE9_16_MAX_FACTOR + 1,
+       "Testing whether interp_scale() rejects factor 257 with 16-bit "
+       "scale9"},
+      {5, 2, 255, SCALE5_MAX_FACTOR + 1,
+       "Testing whether interp_scale() rejects factor 257 with scale5"},
+      {6, 2, 255, SCALE6_MAX_FACTOR + 1,
+       "Testing whether interp_scale() rejects factor 257 with scale6"},
+      {4, 1, 255, 2,
+       "Testing whether interp_scale() rejects a single column with scale4"}};
+  img.channels = 3;
+  for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+    interp_set_version(ctx, limits[i].version);
+    img.width = limits[i].width;
+    img.maxval = limits[i].maxval;
+    size_t size_out = 0;
+    interp_output_size(&img, limits[i].scale_factor, &size_out);
+    uint8_t *big = malloc(size_out);
+    if (!big) {
+      printf("Failed to allocate memory for the tests.\n");
+      fail++;
+      continue;
+    }
+    fail += interp_test(ctx, &img, limits[i].scale_factor, big, size_out,
+                        NULL, 0, INTERP_ENOTSUP, limits[i].description);
+    free(big);
+  }
+
+  interp_ctx_free(ctx);
+  return fail + test_interp_roi();
+}
+
+int test_tune() {
+  printf("\nAutotune tests\n");
+  int fail = 0;
+
+  printf("Testing size buckets... ");
+  bool ok = tune_bucket(0, 0) == 0 && tune_bucket(1, 3) == 0 &&
+            tune_bucket(2, 2) == 1 && tune_bucket(64, 64) == 6 &&
+            tune_bucket(100, 100) == 6 && tune_bucket(128, 128) == 7 &&
+            tune_bucket(1024, 1024) == 10 && tune_bucket(SIZE_MAX, 2) == 31;
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  const char *path = "test/out/tune/table";
+  struct tune_table_st saved = {NULL, 0, 0}, loaded = {NULL, 0, 0};
+  struct tune_entry_st entries[] = {{3, 1, 2, 6, 6, 1},
+                                    {3, 1, 2, 10, 9, 4},
+                                    {1, 1, 2, 8, 8, 1},
+                                    {3, 2, 4, 8, 9, 2}};
+  saved.entries = entries;
+  saved.n = saved.cap = sizeof(entries) / sizeof(entries[0]);
+  printf("Testing whether a saved table loads again... ");
+  ok = !tune_save(&saved, path) && !tune_load(&loaded, path) &&
+       loaded.n == saved.n &&
+       !memcmp(loaded.entries, entries, sizeof(entries));
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+
+  printf("Testing lookups by the nearest bucket... ");
+  struct img_st img = {100, 100, NULL, NULL, 0, 3, 255};
+  const struct tune_entry_st *small = tune_lookup(&loaded, &img, 2);
+  img.width = img.height = 4000;
+  const struct tune_entry_st *large = tune_lookup(&loaded, &img, 2);
+  // Bucket 8 is as far from 6 as from 10; the larger one wins
+  img.width = img.height = 256;
+  const struct tune_entry_st *tie = tune_lookup(&loaded, &img, 2);
+  const struct tune_entry_st *other_factor = tune_lookup(&loaded, &img, 3);
+  img.channels = 4;
+  const struct tune_entry_st *other_format = tune_lookup(&loaded, &img, 2);
+  ok = small && small->version == 6 && large && large->version == 9 && tie &&
+       tie->version == 9 && !other_factor && !other_format;
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+  tune_free(&loaded);
+
+  printf("Testing whether foreign or malformed tables are refused... ");
+  // A table of this host with an implementation that doesn't exist
+  struct tune_entry_st bad = {3, 1, 2, 6, MAX_IMPLEMENTATION + 1, 1};
+  saved.entries = &bad;
+  saved.n = saved.cap = 1;
+  ok = !tune_save(&saved, path);
+  errno = 0;
+  if (!tune_load(&loaded, path) || errno != EINVAL || loaded.n)
+    ok = false;
+  tune_free(&loaded);
+  const char *tables[] = {
+      "# interp autotune table v2, host some-other-host\n3 1 2 6 6 1\n",
+      "3 1 2 6 6 1\n"};
+  for (size_t i = 0; i < 2; i++) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+      ok = false;
+      break;
+    }
+    fputs(tables[i], fp);
+    fclose(fp);
+    errno = 0;
+    if (!tune_load(&loaded, path) || errno != EINVAL || loaded.n)
+      ok = false;
+    tune_free(&loaded);
+  }
+  printf(ok ? "OK.\n" : "Failed.\n");
+  fail += !ok;
+  remove(path);
+
   return fail;
 }
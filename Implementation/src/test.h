@@ -1,3 +1,8 @@
 extern int test_batch(void);
+extern int test_batch_mode(void);
 extern int test_hard_coded(void);
 extern int test_parser(void);
+extern int test_resize(void);
+extern int test_stream(void);
+extern int test_interp(void);
+extern int test_tune(void);
@@ -1,15 +1,24 @@
 // clock_gettime requires this macro to compile; the alternative would have been
 // to change GCC flags from -std=c17 to -std=gnu17, but it is unclear whether we
-// are allowed to do so. See: man clock_gettime(2)
+// are allowed to do so. sched_setaffinity() additionally needs _GNU_SOURCE.
+// See: man clock_gettime(2)
+//      man sched_setaffinity(2)
 //      man feature_test_macros(7)
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <errno.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
+#include "counters.h"
+#include "parallel.h"
+#include "scale.h"
+#include "timing.h"
+
 void subtract_timespec(struct timespec *tres, struct timespec t1,
                        struct timespec t2) {
   time_t carry = 0;
@@ -23,26 +32,73 @@ void subtract_timespec(struct timespec *tres, struct timespec t1,
   tres->tv_sec = t2.tv_sec - t1.tv_sec - carry;
 }
 
-int timing_loop(struct timespec *total, bool do_timing, size_t timing_repeats,
-                void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *),
-                const uint8_t *img, size_t width, size_t height,
-                size_t scale_factor, uint8_t *result) {
-  struct timespec start;
-  struct timespec stop;
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile p of the n sorted values in times
+static uint64_t percentile(const uint64_t *times, size_t n, size_t p) {
+  size_t rank = (p * n + 99) / 100;
+  return times[rank ? rank - 1 : 0];
+}
+
+int timing_loop(struct timing_stats_st *stats, bool do_timing, size_t warmup,
+                size_t timing_repeats, struct counters_st *counters,
+                void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *,
+                            size_t, size_t),
+                size_t threads, const uint8_t *img, size_t width,
+                size_t height, size_t scale_factor, uint8_t *result) {
+  *stats = (struct timing_stats_st){0, 0, 0, 0, 0, 0};
   errno = 0;
+  // Build the tables for scale_factor now, not in the first timed iteration
+  if (do_timing && scale_prepare(scale_factor)) {
+    fprintf(stderr, "Error while scaling: Could not allocate memory.\n");
+    return 1;
+  }
   if (!do_timing) {
-    (*fun)(img, width, height, scale_factor, result);
-  } else {
-    int res1 = clock_gettime(CLOCK_MONOTONIC, &start);
+    scale_parallel(fun, threads, img, width, height, scale_factor, result);
+  } else if (timing_repeats > 0) {
+    uint64_t *times = malloc(timing_repeats * sizeof(uint64_t));
+    if (!times) {
+      fprintf(stderr, "Error allocating memory.\n");
+      return 1;
+    }
+
+    // Let caches, page tables and the CPU's clock settle before measuring
+    for (size_t i = 0; i < warmup; i++)
+      scale_parallel(fun, threads, img, width, height, scale_factor, result);
+
+    int res = 0;
     for (size_t i = 0; i < timing_repeats; i++) {
-      (*fun)(img, width, height, scale_factor, result);
+      struct timespec start, stop, diff;
+      // Read the counters outside the timed part, their system calls take
+      // microseconds
+      if (counters)
+        counters_begin(counters);
+      res |= clock_gettime(CLOCK_MONOTONIC, &start);
+      scale_parallel(fun, threads, img, width, height, scale_factor, result);
+      res |= clock_gettime(CLOCK_MONOTONIC, &stop);
+      if (counters)
+        counters_end(counters);
+      subtract_timespec(&diff, start, stop);
+      times[i] = diff.tv_sec * UINT64_C(1000000000) + diff.tv_nsec;
+      stats->total += times[i];
     }
-    int res2 = clock_gettime(CLOCK_MONOTONIC, &stop);
-    if (res1 || res2) {
+    if (res) {
       perror("Error getting time");
+      free(times);
       return 1;
     }
-    subtract_timespec(total, start, stop);
+
+    qsort(times, timing_repeats, sizeof(uint64_t), compare_u64);
+    stats->iterations = timing_repeats;
+    stats->min = times[0];
+    stats->median = percentile(times, timing_repeats, 50);
+    stats->p95 = percentile(times, timing_repeats, 95);
+    stats->p99 = percentile(times, timing_repeats, 99);
+    free(times);
   }
   if (errno == ENOMEM) {
     fprintf(stderr, "Error while scaling: Could not allocate memory.\n");
@@ -53,3 +109,32 @@ int timing_loop(struct timespec *total, bool do_timing, size_t timing_repeats,
   }
   return 0;
 }
+
+double timing_mb_s(const struct timing_stats_st *stats, size_t width,
+                   size_t height, size_t scale_factor, size_t pixel_size) {
+  return timing_mp_s(stats, width, height, scale_factor) * pixel_size;
+}
+
+double timing_mp_s(const struct timing_stats_st *stats, size_t width,
+                   size_t height, size_t scale_factor) {
+  if (!stats->median)
+    return 0;
+  double pixels = (double)width * height * scale_factor * scale_factor;
+  return pixels * 1e3 / stats->median;
+}
+
+int pin_to_cpu(size_t cpu) {
+  cpu_set_t set;
+  if (cpu >= CPU_SETSIZE) {
+    fprintf(stderr, "Error pinning to CPU %zu: No such CPU.\n", cpu);
+    return 1;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    fprintf(stderr, "Error pinning to CPU %zu: ", cpu);
+    perror(NULL);
+    return 1;
+  }
+  return 0;
+}
@@ -2,18 +2,60 @@
 extern void subtract_timespec(struct timespec *tres, struct timespec t1,
                               struct timespec t2);
 
+// Per-iteration times measured by timing_loop(), in nanoseconds. Percentiles
+// use the nearest-rank method.
+struct timing_stats_st {
+  size_t iterations;
+  uint64_t total;
+  uint64_t min;
+  uint64_t median;
+  uint64_t p95;
+  uint64_t p99;
+};
+
+struct counters_st;
+
 // Explanation of the signature:
-//   struct timespec *total:
-//     pointer to timespec into which to write result
+//   struct timing_stats_st *stats:
+//     pointer to struct into which to write the results (all 0 if do_timing
+//     is false or timing_repeats is 0)
 //   bool do_timing:
 //     if false, don't do timing and the loop, just call the function
+//   size_t warmup:
+//     how many times to call the function before starting to measure
+//   size_t timing_repeats:
+//     how many times to call the function while measuring; each call is timed
+//     on its own
+//   struct counters_st *counters:
+//     if not NULL, hardware counters (see counters.h) that count each timed
+//     call as well
 //   void (*fun)(...):
-//     pointer to a function that takes the same arguments as scale()
-//     (to be used with implementations of scale())
+//     pointer to a function that takes the same arguments as scale_band()
+//     (to be used with the entries of scale_band_funs)
+//   size_t threads:
+//     number of threads to split the scaling across, see scale_parallel()
 //   ...:
 //     parameters to be passed to (*fun)
 extern int
-timing_loop(struct timespec *total, bool do_timing, size_t timing_repeats,
-            void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *),
-            const uint8_t *img, size_t width, size_t height,
+timing_loop(struct timing_stats_st *stats, bool do_timing, size_t warmup,
+            size_t timing_repeats, struct counters_st *counters,
+            void (*fun)(const uint8_t *, size_t, size_t, size_t, uint8_t *,
+                        size_t, size_t),
+            size_t threads, const uint8_t *img, size_t width, size_t height,
             size_t scale_factor, uint8_t *result);
+
+// Throughput at the median time: megabytes (10^6 bytes) of output and output
+// megapixels per second, for pixels of <pixel_size> bytes. 0 if there are no
+// timing results.
+extern double timing_mb_s(const struct timing_stats_st *stats, size_t width,
+                          size_t height, size_t scale_factor,
+                          size_t pixel_size);
+extern double timing_mp_s(const struct timing_stats_st *stats, size_t width,
+                          size_t height, size_t scale_factor);
+
+// Restricts the calling thread, and every thread it creates afterwards, to
+// the CPU with number cpu, so that benchmarks don't migrate between cores.
+// Return value:
+//   0 if successful
+//   1 otherwise, after printing an error message
+extern int pin_to_cpu(size_t cpu);
@@ -0,0 +1,105 @@
+// clock_gettime() and getpid() are POSIX, not C17; see
+// man feature_test_macros(7)
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Spans kept for trace_write_chrome(); writing a large plain-text image takes
+// one encode and one write span per 64 KiB
+#define TRACE_MAX_EVENTS (64 * 1024)
+
+static const char *const stage_names[TRACE_STAGES] = {
+    "open", "header", "decode", "alloc", "kernel", "encode", "write"};
+
+struct trace_event_st {
+  enum trace_stage stage;
+  uint64_t begin;
+  uint64_t end;
+  size_t bytes;
+};
+
+struct trace_total_st {
+  size_t count;
+  uint64_t ns;
+  uint64_t bytes;
+};
+
+bool trace_on = false;
+static uint64_t trace_origin;
+static struct trace_event_st *events;
+static size_t n_events;
+static size_t dropped;
+static struct trace_total_st totals[TRACE_STAGES];
+
+uint64_t trace_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_record(enum trace_stage stage, uint64_t begin, uint64_t end,
+                  size_t bytes) {
+  totals[stage].count++;
+  totals[stage].ns += end - begin;
+  totals[stage].bytes += bytes;
+  if (n_events < TRACE_MAX_EVENTS)
+    events[n_events++] = (struct trace_event_st){stage, begin, end, bytes};
+  else
+    dropped++;
+}
+
+int trace_start(void) {
+  events = malloc(TRACE_MAX_EVENTS * sizeof(struct trace_event_st));
+  if (!events) {
+    errno = ENOMEM;
+    return 1;
+  }
+  n_events = dropped = 0;
+  for (size_t i = 0; i < TRACE_STAGES; i++)
+    totals[i] = (struct trace_total_st){0, 0, 0};
+  trace_origin = trace_clock();
+  trace_on = true;
+  return 0;
+}
+
+void trace_stop(void) {
+  trace_on = false;
+  free(events);
+  events = NULL;
+}
+
+void trace_summary(FILE *out) {
+  fprintf(out, "{\"wall_ns\": %lu, \"stages\": {",
+          (unsigned long)(trace_clock() - trace_origin));
+  for (size_t i = 0; i < TRACE_STAGES; i++) {
+    fprintf(out, "%s\"%s\": {\"count\": %zu, \"ns\": %lu, \"bytes\": %lu}",
+            i ? ", " : "", stage_names[i], totals[i].count,
+            (unsigned long)totals[i].ns, (unsigned long)totals[i].bytes);
+  }
+  fprintf(out, "}, \"dropped_events\": %zu}\n", dropped);
+}
+
+int trace_write_chrome(FILE *out) {
+  const long pid = getpid();
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (size_t i = 0; i < n_events; i++) {
+    const struct trace_event_st *e = &events[i];
+    fprintf(out,
+            "%s\n  {\"name\": \"%s\", \"cat\": \"interp\", \"ph\": \"X\", "
+            "\"pid\": %ld, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, "
+            "\"args\": {\"bytes\": %zu}}",
+            i ? "," : "", stage_names[e->stage], pid,
+            (e->begin - trace_origin) / 1e3, (e->end - e->begin) / 1e3,
+            e->bytes);
+  }
+  fprintf(out, "\n]}\n");
+  return ferror(out) != 0;
+}
@@ -0,0 +1,63 @@
+// Per-stage latency tracing: where the time of scaling a file goes, from
+// opening it to writing the result. Each stage is timed as spans with the
+// number of bytes they processed; afterwards, the totals can be written as a
+// JSON summary line and the spans as a Chrome trace-event file (for
+// chrome://tracing or Perfetto). Spans are recorded by the thread that
+// started tracing only, worker threads are covered by the span around them.
+//
+// While tracing is off, trace_begin() and trace_end() only test a flag.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+enum trace_stage {
+  TRACE_OPEN,   // opening the input and output files
+  TRACE_HEADER, // parsing the input header; bytes of the header
+  TRACE_DECODE, // reading and decoding the raster; bytes of the raster
+  TRACE_ALLOC,  // allocating the input and output rasters; bytes allocated
+  TRACE_KERNEL, // scaling; bytes of output
+  TRACE_ENCODE, // formatting samples for output (text, byte order); bytes
+  TRACE_WRITE,  // writing to the output file; bytes written
+  TRACE_STAGES
+};
+
+extern bool trace_on;
+
+extern uint64_t trace_clock(void);
+extern void trace_record(enum trace_stage stage, uint64_t begin, uint64_t end,
+                         size_t bytes);
+
+// Start time of a span, to pass to trace_end()
+static inline uint64_t trace_begin(void) {
+  return trace_on ? trace_clock() : 0;
+}
+
+// Records the span of stage from begin until now, which processed bytes
+// bytes
+static inline void trace_end(enum trace_stage stage, uint64_t begin,
+                             size_t bytes) {
+  if (trace_on)
+    trace_record(stage, begin, trace_clock(), bytes);
+}
+#endif
+
+// Turns tracing on; time stamps count from now.
+// Return value:
+//   0 if successful
+//   1 if allocating memory failed (errno is set to ENOMEM)
+extern int trace_start(void);
+
+// Turns tracing off and frees the spans
+extern void trace_stop(void);
+
+// Writes the totals per stage as one line of JSON: count of spans,
+// nanoseconds and bytes, and the wall time since trace_start()
+extern void trace_summary(FILE *out);
+
+// Writes the spans in the Chrome trace-event format (JSON, "X" events with
+// microsecond time stamps). Spans beyond the first TRACE_MAX_EVENTS are only
+// counted in the totals.
+// Return value:
+//   0 if successful
+//   1 if writing failed
+extern int trace_write_chrome(FILE *out);
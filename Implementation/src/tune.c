@@ -0,0 +1,343 @@
+// gethostname(), mkdir() and sysconf() are POSIX, not C17; see
+// man feature_test_macros(7)
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_parsing.h"
+#include "outbuf.h"
+#include "parallel.h"
+#include "scale.h"
+#include "timing.h"
+#include "tune.h"
+#include "util.h"
+
+// Side lengths of the square images tune_run() measures, buckets 6, 8 and 10
+static const size_t tune_sides[] = {64, 256, 1024};
+// Pixel formats tune_run() measures: channels and bytes per sample
+static const size_t tune_formats[][2] = {{1, 1}, {3, 1}, {4, 1},
+                                         {1, 2}, {3, 2}, {4, 2}};
+// Outputs larger than this aren't measured; images that large use the entry
+// of the nearest smaller bucket
+#define TUNE_MAX_OUTPUT ((size_t)128 << 20)
+// First line of a table, followed by the host name. Tables of v1 could pick
+// implementations whose output differs from pick_version()'s.
+#define TUNE_MAGIC "# interp autotune table v2, host "
+
+size_t tune_bucket(size_t width, size_t height) {
+  size_t pixels;
+  if (__builtin_mul_overflow(width, height, &pixels))
+    pixels = SIZE_MAX;
+  size_t bucket = 0;
+  for (; pixels >= 4; pixels /= 4)
+    bucket++;
+  return bucket;
+}
+
+static int tune_add(struct tune_table_st *t, struct tune_entry_st e) {
+  if (t->n == t->cap) {
+    size_t cap = t->cap ? 2 * t->cap : 32;
+    struct tune_entry_st *grown =
+        realloc(t->entries, cap * sizeof(struct tune_entry_st));
+    if (!grown) {
+      errno = ENOMEM;
+      return 1;
+    }
+    t->entries = grown;
+    t->cap = cap;
+  }
+  t->entries[t->n++] = e;
+  return 0;
+}
+
+// Thread counts tune_run() tries: powers of two below max, then max
+static size_t next_threads(size_t threads, size_t max) {
+  return threads < max && 2 * threads > max ? max : 2 * threads;
+}
+
+// Median time of implementation version scaling img by scale_factor, in ns.
+// UINT64_MAX if it failed.
+static uint64_t tune_measure(size_t version, size_t threads,
+                             const struct img_st *img, size_t scale_factor,
+                             uint8_t *result, size_t warmup, size_t repeats) {
+  struct timing_stats_st stats;
+  if (timing_loop(&stats, true, warmup, repeats ? repeats : 1, NULL,
+                  scale_band_fun(version, img->channels, img_sample_size(img)),
+                  threads, img->img, img->width, img->height, scale_factor,
+                  result))
+    return UINT64_MAX;
+  return stats.median;
+}
+
+int tune_run(struct tune_table_st *t, const size_t *factors,
+             size_t n_factors, size_t max_threads, size_t warmup,
+             size_t repeats, FILE *log) {
+  if (max_threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+  }
+  // Any pixel values will do, as long as the kernels can't take shortcuts
+  uint32_t seed = 1;
+
+  for (size_t i = 0; i < sizeof(tune_sides) / sizeof(tune_sides[0]); i++) {
+    const size_t side = tune_sides[i];
+    for (size_t f = 0; f < sizeof(tune_formats) / sizeof(tune_formats[0]);
+         f++) {
+      const size_t channels = tune_formats[f][0], ss = tune_formats[f][1];
+      const size_t px = channels * ss;
+      uint8_t *raster = malloc(input_imgsize(side, side, px));
+      if (!raster) {
+        errno = ENOMEM;
+        return 1;
+      }
+      for (size_t j = 0; j < side * side * px; j++) {
+        seed = seed * 1103515245 + 12345;
+        raster[j] = seed >> 24;
+      }
+      struct img_st img = {side, side, raster, NULL, 0, channels,
+                           ss == 2 ? 65535 : 255};
+
+      for (size_t k = 0; k < n_factors; k++) {
+        const size_t sf = factors[k];
+        errno = 0;
+        const size_t size_out = output_imgsize(side, side, sf, px);
+        if (!sf || errno == ERANGE || size_out > TUNE_MAX_OUTPUT)
+          continue;
+        struct outbuf_st result = {NULL, 0, 0};
+        uint8_t *expected = malloc(size_out);
+        if (!expected || outbuf_alloc(&result, size_out, true)) {
+          free(expected);
+          free(raster);
+          errno = ENOMEM;
+          return 1;
+        }
+        // The table must not change the output, only how fast it's made:
+        // candidates have to match what pick_version() would write, which
+        // rules out scale2 and scale3 with their own rounding and borders
+        const size_t ref = pick_version(sf, side, channels, ss);
+        errno = 0;
+        scale_band_fun(ref, channels, ss)(raster, side, side, sf, expected, 0,
+                                          side);
+        if (errno == ENOMEM) {
+          outbuf_free(&result);
+          free(expected);
+          free(raster);
+          return 1;
+        }
+
+        size_t best_version = 0, best_threads = 1;
+        uint64_t best = UINT64_MAX;
+        for (size_t v = 1; v <= MAX_IMPLEMENTATION; v++) {
+          if (!scale_usable(v, sf, side, channels, ss))
+            continue;
+          const uint64_t ns =
+              tune_measure(v, 1, &img, sf, result.data, warmup, repeats);
+          if (ns < best && !memcmp(result.data, expected, size_out)) {
+            best = ns;
+            best_version = v;
+          }
+        }
+        // Trying every thread count with every implementation would take
+        // far longer, and rarely changes the winner
+        for (size_t th = 2; best_version && th <= max_threads;
+             th = next_threads(th, max_threads)) {
+          const uint64_t ns = tune_measure(best_version, th, &img, sf,
+                                           result.data, warmup, repeats);
+          if (ns < best) {
+            best = ns;
+            best_threads = th;
+          }
+        }
+        outbuf_free(&result);
+        free(expected);
+        if (!best_version)
+          continue;
+
+        const struct tune_entry_st e = {channels,
+                                        ss,
+                                        sf,
+                                        tune_bucket(side, side),
+                                        best_version,
+                                        best_threads};
+        if (tune_add(t, e)) {
+          free(raster);
+          return 1;
+        }
+        fprintf(log,
+                "%zux%zu, %zu channel(s) of %zu bit, factor %zu: -V%zu "
+                "-T%zu, %.3f ms\n",
+                side, side, channels, 8 * ss, sf, best_version, best_threads,
+                best / 1e6);
+        fflush(log);
+      }
+      free(raster);
+    }
+  }
+  return 0;
+}
+
+const struct tune_entry_st *tune_lookup(const struct tune_table_st *t,
+                                        const struct img_st *img,
+                                        size_t scale_factor) {
+  const size_t bucket = tune_bucket(img->width, img->height);
+  const size_t ss = img_sample_size(img);
+  const struct tune_entry_st *best = NULL;
+  size_t best_dist = SIZE_MAX;
+  for (size_t i = 0; i < t->n; i++) {
+    const struct tune_entry_st *e = &t->entries[i];
+    if (e->channels != img->channels || e->sample_size != ss ||
+        e->scale_factor != scale_factor)
+      continue;
+    const size_t dist =
+        e->bucket > bucket ? e->bucket - bucket : bucket - e->bucket;
+    // On ties, the larger bucket: small images take little time either way
+    if (dist < best_dist || (dist == best_dist && e->bucket > best->bucket)) {
+      best = e;
+      best_dist = dist;
+    }
+  }
+  return best;
+}
+
+// Stores the host name, always terminated, in buf
+static int host_name(char *buf, size_t size) {
+  if (gethostname(buf, size - 1))
+    return 1;
+  buf[size - 1] = 0;
+  return 0;
+}
+
+// Creates the directories leading to path, like mkdir -p $(dirname path)
+static int make_parents(const char *path) {
+  char *dir = malloc(strlen(path) + 1);
+  if (!dir) {
+    errno = ENOMEM;
+    return 1;
+  }
+  strcpy(dir, path);
+  for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+    *p = 0;
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+      free(dir);
+      return 1;
+    }
+    *p = '/';
+  }
+  free(dir);
+  return 0;
+}
+
+int tune_save(const struct tune_table_st *t, const char *path) {
+  char host[256];
+  if (host_name(host, sizeof(host)) || make_parents(path))
+    return 1;
+  // Write a temporary file next to path and rename it, so that a scaling
+  // process never reads half a table
+  char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+  if (!tmp) {
+    errno = ENOMEM;
+    return 1;
+  }
+  sprintf(tmp, "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    free(tmp);
+    return 1;
+  }
+  fprintf(fp, TUNE_MAGIC "%s\n", host);
+  fprintf(fp, "# channels sample_size scale_factor bucket version threads\n");
+  for (size_t i = 0; i < t->n; i++) {
+    const struct tune_entry_st *e = &t->entries[i];
+    fprintf(fp, "%zu %zu %zu %zu %zu %zu\n", e->channels, e->sample_size,
+            e->scale_factor, e->bucket, e->version, e->threads);
+  }
+  int res = ferror(fp);
+  if (fclose(fp))
+    res = 1;
+  if (res || rename(tmp, path)) {
+    const int saved = errno;
+    remove(tmp);
+    errno = saved;
+    res = 1;
+  }
+  free(tmp);
+  return res;
+}
+
+// Whether e could have come from tune_run()
+static bool tune_valid(const struct tune_entry_st *e) {
+  return (e->channels == 1 || e->channels == CHANNELS || e->channels == 4) &&
+         (e->sample_size == 1 || e->sample_size == 2) && e->scale_factor &&
+         e->version >= 1 && e->version <= MAX_IMPLEMENTATION &&
+         e->threads >= 1 && e->threads <= MAX_THREADS;
+}
+
+int tune_load(struct tune_table_st *t, const char *path) {
+  char host[256], line[512];
+  if (host_name(host, sizeof(host)))
+    return 1;
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 1;
+  if (!fgets(line, sizeof(line), fp) ||
+      strncmp(line, TUNE_MAGIC, strlen(TUNE_MAGIC)) ||
+      strcspn(line + strlen(TUNE_MAGIC), "\n") != strlen(host) ||
+      strncmp(line + strlen(TUNE_MAGIC), host, strlen(host)))
+    goto invalid;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#')
+      continue;
+    struct tune_entry_st e;
+    if (sscanf(line, "%zu %zu %zu %zu %zu %zu", &e.channels, &e.sample_size,
+               &e.scale_factor, &e.bucket, &e.version, &e.threads) != 6 ||
+        !tune_valid(&e))
+      goto invalid;
+    if (tune_add(t, e)) {
+      fclose(fp);
+      tune_free(t);
+      return 1;
+    }
+  }
+  if (ferror(fp))
+    goto invalid;
+  fclose(fp);
+  return 0;
+
+invalid:
+  fclose(fp);
+  tune_free(t);
+  errno = EINVAL;
+  return 1;
+}
+
+void tune_free(struct tune_table_st *t) {
+  free(t->entries);
+  *t = (struct tune_table_st){NULL, 0, 0};
+}
+
+int tune_path(char *buf, size_t size) {
+  const char *file = getenv("INTERP_TUNE_FILE");
+  if (file && *file)
+    return (size_t)snprintf(buf, size, "%s", file) >= size;
+
+  char host[256];
+  if (host_name(host, sizeof(host)))
+    return 1;
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int len;
+  if (cache && *cache)
+    len = snprintf(buf, size, "%s/interp/tune-%s", cache, host);
+  else if (home && *home)
+    len = snprintf(buf, size, "%s/.cache/interp/tune-%s", home, host);
+  else
+    return 1;
+  return len < 0 || (size_t)len >= size;
+}
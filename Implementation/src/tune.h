@@ -0,0 +1,75 @@
+// Autotuning: measures which implementation and thread count scale fastest on
+// this machine, per pixel format, scale factor and image size, and keeps the
+// winners in a table on disk. Scaling a single image without --version
+// consults that table, and falls back to pick_version() where it has nothing.
+
+// Longest path tune_path() produces
+#define TUNE_PATH_MAX 4096
+
+#ifndef TUNE_ST_H
+#define TUNE_ST_H
+// The fastest configuration for images of channels samples of sample_size
+// bytes, scaled by scale_factor, whose tune_bucket() is bucket
+struct tune_entry_st {
+  size_t channels;
+  size_t sample_size;
+  size_t scale_factor;
+  size_t bucket;
+  size_t version;
+  size_t threads;
+};
+
+// Initialize with {NULL, 0, 0}, release with tune_free()
+struct tune_table_st {
+  struct tune_entry_st *entries;
+  size_t n;
+  size_t cap;
+};
+#endif
+
+// The size bucket of a width x height image: floor(log4(pixels)), so that
+// every bucket is twice the side length of the previous one.
+extern size_t tune_bucket(size_t width, size_t height);
+
+// Measures every implementation that can handle them on square images of 64,
+// 256 and 1024 pixels side length, grey, RGB and RGBA of 8 and 16 bit, at the
+// n_factors scale factors in factors, and adds the fastest one (by median
+// time) whose output is identical to that of pick_version()'s choice to t. The winner at one thread is then tried with 2, 4, 8... threads,
+// up to max_threads (0 means all online CPUs). Combinations with outputs
+// larger than 128 MiB are left out. One line per entry is written to log.
+// Return value:
+//   0 if successful
+//   1 if allocating memory failed (errno is set to ENOMEM)
+extern int tune_run(struct tune_table_st *t, const size_t *factors,
+                    size_t n_factors, size_t max_threads, size_t warmup,
+                    size_t repeats, FILE *log);
+
+// The entry of t for img scaled by scale_factor: the one for its pixel format
+// and scale factor whose bucket is closest to img's. NULL if there is none.
+extern const struct tune_entry_st *tune_lookup(const struct tune_table_st *t,
+                                               const struct img_st *img,
+                                               size_t scale_factor);
+
+// Writes t to path, which it replaces atomically, creating the directories
+// leading to it.
+// Return value:
+//   0 if successful
+//   1 otherwise (errno is set)
+extern int tune_save(const struct tune_table_st *t, const char *path);
+
+// Reads the table tune_save() wrote to path into t, which must be empty.
+// Tables written on another host are refused.
+// Return value:
+//   0 if successful
+//   1 otherwise (errno is set; EINVAL for malformed or foreign tables)
+extern int tune_load(struct tune_table_st *t, const char *path);
+
+extern void tune_free(struct tune_table_st *t);
+
+// Stores where the table of this host lives in buf: $INTERP_TUNE_FILE if
+// set, else tune-<hostname> in $XDG_CACHE_HOME/interp or ~/.cache/interp.
+// Return value:
+//   0 if successful
+//   1 if neither the variables nor the host name tell, or the path is longer
+//   than size
+extern int tune_path(char *buf, size_t size);
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <unistd.h>
 
 // The problem with strotoul and similar is that they consider negative numbers
 // a valid input and provide no indication that the parsed number was negative -
@@ -92,11 +93,11 @@ size_t int_pow(size_t base, size_t exp) {
 // program and in the tests, we split them out into this file so we can easily
 // verify that the overflow checks were done correctly everywhere.
 //
-// The following two functions return input/output image size if it didn't
-// overflow, and SIZE_MAX otherwise. If an overflow happened, they set errno to
-// ERANGE.
+// The following two functions return input/output image size for <pixel_size>
+// bytes per pixel (channels times bytes per sample) if it didn't overflow, and
+// SIZE_MAX otherwise. If an overflow happened, they set errno to ERANGE.
 
-size_t input_imgsize(size_t width, size_t height) {
+size_t input_imgsize(size_t width, size_t height, size_t pixel_size) {
   // We allocate more bytes than needed.
   // We must guarantee that the width is divisble by 4 for scale3().
   // We must also guarantee that there are at least 5 extra bytes for scale5().
@@ -111,9 +112,9 @@ size_t input_imgsize(size_t width, size_t height) {
     goto overflow;
   size_t width_aligned = width + 8 - width % 4;
   size_t imgbuf_size = width_aligned * height;
-  if (__builtin_mul_overflow_p(imgbuf_size, 3, (size_t)0))
+  if (__builtin_mul_overflow_p(imgbuf_size, pixel_size, (size_t)0))
     goto overflow;
-  imgbuf_size *= 3; // Consider that each pixel needs 3 bytes to be represented
+  imgbuf_size *= pixel_size;
   if (__builtin_add_overflow_p(imgbuf_size, 5, (size_t)0))
     goto overflow;
   return imgbuf_size;
@@ -123,7 +124,8 @@ overflow:
   return SIZE_MAX;
 }
 
-size_t output_imgsize(size_t width, size_t height, size_t scale_factor) {
+size_t output_imgsize(size_t width, size_t height, size_t scale_factor,
+                      size_t pixel_size) {
   if (__builtin_mul_overflow_p(width, scale_factor, (size_t)0) ||
       __builtin_mul_overflow_p(height, scale_factor, (size_t)0))
     goto overflow;
@@ -131,9 +133,9 @@ size_t output_imgsize(size_t width, size_t height, size_t scale_factor) {
   size_t height_out = height * scale_factor;
   size_t size_out = width_out * height_out;
   if (__builtin_mul_overflow_p(width_out, height_out, (size_t)0) ||
-      __builtin_mul_overflow_p(size_out, 3, (size_t)0))
+      __builtin_mul_overflow_p(size_out, pixel_size, (size_t)0))
     goto overflow;
-  size_out *= 3;
+  size_out *= pixel_size;
   // More extra bytes due to the issues that _mm_storeu_64 otherwise causes when
   // calling scale5 with scale factor 1
   if (__builtin_add_overflow_p(size_out, 2, (size_t)0))
@@ -145,3 +147,10 @@ overflow:
   errno = ERANGE;
   return SIZE_MAX;
 }
+
+// Size of the (per-core) L2 cache in bytes, as the C library reports it, or
+// 1 MiB if it doesn't know
+size_t l2_cache_size(void) {
+  long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  return size > 0 ? (size_t)size : 1 << 20;
+}
@@ -1,5 +1,7 @@
 extern size_t strtosizet(const char *nptr, const char **endptr,
                          const char **numptr);
 extern size_t int_pow(size_t base, size_t exp);
-extern size_t input_imgsize(size_t width, size_t height);
-extern size_t output_imgsize(size_t width, size_t height, size_t scale_factor);
+extern size_t input_imgsize(size_t width, size_t height, size_t pixel_size);
+extern size_t output_imgsize(size_t width, size_t height, size_t scale_factor,
+                             size_t pixel_size);
+extern size_t l2_cache_size(void);